@@ -0,0 +1,285 @@
+// Author: Andrew Shuvalov
+//
+// Documentation: https://github.com/shuvalov-mdb/thread-liveness-monitor
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "thread_monitor/kernel_thread_state.h"
+#include "thread_monitor/thread_monitor_central_repository.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+#include <unistd.h>
+
+namespace thread_monitor {
+namespace benchmark_support {
+
+/**
+ * Nanoseconds between two reads of the steady clock.
+ */
+inline int64_t elapsedNanos(std::chrono::steady_clock::time_point start,
+                            std::chrono::steady_clock::time_point end) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+}
+
+/**
+ * The domain returned by 'create' for the first call with the 'key', the later
+ * calls return the same one. The domains are leaked, thus the benchmark threads
+ * and the runs share the populated domain and none of them pays for its setup.
+ */
+inline ThreadMonitorCentralRepository* leakedDomain(
+    const std::string& key, const std::function<ThreadMonitorCentralRepository*()>& create) {
+    static std::mutex mutex;
+    static std::map<std::string, ThreadMonitorCentralRepository*> domains;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& domain = domains[key];
+    if (domain == nullptr) {
+        domain = create();
+    }
+    return domain;
+}
+
+/**
+ * A leaked domain without the monitor thread holding 'registrations' live
+ * registrations without monitors, which never update their liveness. They are
+ * registered from 'loaderThreads' threads, which pick their shards.
+ */
+inline ThreadMonitorCentralRepository* preloadedDomain(const char* name,
+                                                       int64_t registrations,
+                                                       int loaderThreads) {
+    return leakedDomain(std::string(name) + "/" + std::to_string(registrations), [&] {
+        ThreadMonitorCentralRepository::DomainOptions options;
+        options.name = name;
+        options.withMonitorThread = false;
+        auto* domain = new ThreadMonitorCentralRepository(options);
+        domain->setThreadTimeout(std::chrono::hours{24 * 365});
+        domain->reserve(registrations);
+        std::vector<std::thread> loaders;
+        for (int t = 0; t < loaderThreads; ++t) {
+            loaders.emplace_back([domain, registrations, loaderThreads, t] {
+                const pid_t tid = details::currentKernelThreadId();
+                for (int64_t i = t; i < registrations; i += loaderThreads) {
+                    domain->registerThread(std::this_thread::get_id(), tid, nullptr, nullptr,
+                                           std::chrono::system_clock::now());
+                }
+            });
+        }
+        for (auto& loader : loaders) {
+            loader.join();
+        }
+        return domain;
+    });
+}
+
+/**
+ * Value at 'quantile' (0..1) of the sorted 'values'.
+ */
+template <typename T>
+T percentile(const std::vector<T>& sorted, double quantile) {
+    if (sorted.empty()) {
+        return T{};
+    }
+    const size_t index = std::min(sorted.size() - 1, static_cast<size_t>(quantile * sorted.size()));
+    return sorted[index];
+}
+
+/**
+ * Sorts the latencies in nanoseconds and reports p50/p99/p999/max as the benchmark counters.
+ */
+template <typename T>
+void reportLatencies(benchmark::State& state, std::vector<T>* latencies) {
+    std::sort(latencies->begin(), latencies->end());
+    state.counters["p50_ns"] = percentile(*latencies, 0.5);
+    state.counters["p99_ns"] = percentile(*latencies, 0.99);
+    state.counters["p999_ns"] = percentile(*latencies, 0.999);
+    state.counters["max_ns"] = latencies->empty() ? 0 : latencies->back();
+}
+
+/**
+ * Latency histogram in nanoseconds with a constant memory, for the operations
+ * too frequent to keep every sample. The buckets are log-linear: 16 linear
+ * sub-buckets per power of two, thus a percentile is within 1/16 of the value.
+ */
+class LatencyHistogram {
+public:
+    void record(uint64_t nanos) {
+        ++_counts[_bucket(nanos)];
+        ++_count;
+        _max = std::max(_max, nanos);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < kBuckets; ++i) {
+            _counts[i] += other._counts[i];
+        }
+        _count += other._count;
+        _max = std::max(_max, other._max);
+    }
+
+    /**
+     * Upper bound of the bucket holding the value at 'quantile' (0..1).
+     */
+    uint64_t percentile(double quantile) const {
+        const uint64_t rank = std::max<uint64_t>(1, std::ceil(quantile * _count));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBuckets; ++i) {
+            seen += _counts[i];
+            if (seen >= rank) {
+                return std::min(_max, _upperBound(i));
+            }
+        }
+        return _max;
+    }
+
+    uint64_t count() const {
+        return _count;
+    }
+
+    uint64_t max() const {
+        return _max;
+    }
+
+private:
+    static inline constexpr int kSubBucketBits = 4;
+    static inline constexpr uint64_t kSubBuckets = 1 << kSubBucketBits;
+    static inline constexpr size_t kBuckets = (64 - kSubBucketBits + 1) * kSubBuckets;
+
+    static size_t _bucket(uint64_t value) {
+        if (value < kSubBuckets) {
+            return value;
+        }
+        const int shift = 63 - __builtin_clzll(value) - kSubBucketBits;
+        return (shift + 1) * kSubBuckets + ((value >> shift) & (kSubBuckets - 1));
+    }
+
+    static uint64_t _upperBound(size_t bucket) {
+        if (bucket < kSubBuckets) {
+            return bucket;
+        }
+        const int shift = bucket / kSubBuckets - 1;
+        const uint64_t lower = (kSubBuckets + bucket % kSubBuckets) << shift;
+        return lower + ((uint64_t{1} << shift) - 1);
+    }
+
+    std::array<uint64_t, kBuckets> _counts{};
+    uint64_t _count = 0;
+    uint64_t _max = 0;
+};
+
+/**
+ * Reports p50/p99/p999/max of the 'histogram' as the benchmark counters named
+ * with the 'prefix'. The counters of the benchmark threads are summed, thus with
+ * several threads only one of them reports, see `HistogramMerger`.
+ */
+inline void reportHistogram(benchmark::State& state,
+                            const LatencyHistogram& histogram,
+                            const std::string& prefix = "") {
+    state.counters[prefix + "p50_ns"] = histogram.percentile(0.5);
+    state.counters[prefix + "p99_ns"] = histogram.percentile(0.99);
+    state.counters[prefix + "p999_ns"] = histogram.percentile(0.999);
+    state.counters[prefix + "max_ns"] = histogram.max();
+}
+
+/**
+ * Merges the histograms of all benchmark threads, the thread 0 waits for the
+ * others and reports the percentiles of the merged one. The percentiles of the
+ * threads can not be averaged. One instance per histogram of the benchmark,
+ * e.g. a function static, reused by the runs one after another.
+ */
+class HistogramMerger {
+public:
+    // Invoked by every benchmark thread after its loop.
+    void report(benchmark::State& state,
+                const LatencyHistogram& histogram,
+                const std::string& prefix = "") {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _merged.merge(histogram);
+        ++_threads;
+        if (state.thread_index() != 0) {
+            _allMerged.notify_one();
+            return;
+        }
+        _allMerged.wait(lock, [&] { return _threads == state.threads(); });
+        reportHistogram(state, _merged, prefix);
+        _merged = LatencyHistogram();
+        _threads = 0;
+    }
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _allMerged;
+    LatencyHistogram _merged;
+    int _threads = 0;
+};
+
+/**
+ * Hardware event counter of the calling thread, invalid where perf events are
+ * not available, e.g. in containers, virtual machines or with a restrictive
+ * `perf_event_paranoid`. Only counts in the user space.
+ */
+class PerfCounter {
+public:
+#ifdef __linux__
+    static inline constexpr uint64_t kCacheMisses = PERF_COUNT_HW_CACHE_MISSES;
+#else
+    static inline constexpr uint64_t kCacheMisses = 0;
+#endif
+
+    explicit PerfCounter(uint64_t event) {
+#ifdef __linux__
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = event;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        _fd = ::syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+#endif
+    }
+
+    ~PerfCounter() {
+        if (_fd >= 0) {
+            ::close(_fd);
+        }
+    }
+
+    PerfCounter(const PerfCounter&) = delete;
+    PerfCounter& operator=(const PerfCounter&) = delete;
+
+    bool valid() const {
+        return _fd >= 0;
+    }
+
+    uint64_t read() const {
+        uint64_t value = 0;
+        if (_fd < 0 || ::read(_fd, &value, sizeof(value)) != sizeof(value)) {
+            return 0;
+        }
+        return value;
+    }
+
+private:
+    int _fd = -1;
+};
+
+}  // namespace benchmark_support
+}  // namespace thread_monitor
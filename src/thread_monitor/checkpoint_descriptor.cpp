@@ -0,0 +1,81 @@
+#include "thread_monitor/checkpoint_descriptor.h"
+
+#include <cassert>
+#include <deque>
+#include <mutex>
+
+namespace thread_monitor {
+
+namespace {
+
+// Descriptors are registered from static initializers of any translation unit,
+// thus the registry is created on first use and never deleted.
+struct DescriptorRegistry {
+    std::mutex mutex;
+    // Deque keeps the elements pointer-stable.
+    std::deque<CheckpointDescriptor> descriptors;
+};
+
+DescriptorRegistry& registry() {
+    static DescriptorRegistry* instance = new DescriptorRegistry();
+    return *instance;
+}
+
+}  // namespace
+
+const CheckpointDescriptor* findCheckpointDescriptor(uint32_t checkpointId) {
+    if ((checkpointId & kDescriptorCheckpointBit) == 0) {
+        return nullptr;
+    }
+    // Ignore the progress and any other flag bits above the descriptor bit.
+    const uint32_t index = scopeCheckpointId(checkpointId) & (kDescriptorCheckpointBit - 1);
+    auto& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    if (index >= r.descriptors.size()) {
+        return nullptr;
+    }
+    return &r.descriptors[index];
+}
+
+std::vector<const CheckpointDescriptor*> findCheckpointDescriptors(
+    const std::vector<uint32_t>& checkpointIds) {
+    std::vector<const CheckpointDescriptor*> result(checkpointIds.size(), nullptr);
+    auto& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for (size_t i = 0; i < checkpointIds.size(); ++i) {
+        if ((checkpointIds[i] & kDescriptorCheckpointBit) == 0) {
+            continue;
+        }
+        const uint32_t index =
+            scopeCheckpointId(checkpointIds[i]) & (kDescriptorCheckpointBit - 1);
+        if (index < r.descriptors.size()) {
+            result[i] = &r.descriptors[index];
+        }
+    }
+    return result;
+}
+
+std::string checkpointName(uint32_t checkpointId) {
+    return checkpointName(checkpointId, findCheckpointDescriptor(checkpointId));
+}
+
+std::string checkpointName(uint32_t checkpointId, const CheckpointDescriptor* descriptor) {
+    if (descriptor != nullptr) {
+        return descriptor->label;
+    }
+    return std::to_string(scopeCheckpointId(checkpointId) & (kDescriptorCheckpointBit - 1));
+}
+
+namespace details {
+
+uint32_t registerCheckpointDescriptor(const CheckpointDescriptor& descriptor) {
+    auto& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    // The index takes the 24 bits below the scope bits, so the scopes can use it.
+    assert(r.descriptors.size() < (1u << kScopeDepthShift));
+    r.descriptors.push_back(descriptor);
+    return kDescriptorCheckpointBit | static_cast<uint32_t>(r.descriptors.size() - 1);
+}
+
+}  // namespace details
+}  // namespace thread_monitor
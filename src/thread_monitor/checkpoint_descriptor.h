@@ -0,0 +1,104 @@
+// Author: Andrew Shuvalov
+//
+// Documentation: https://github.com/shuvalov-mdb/thread-liveness-monitor
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace thread_monitor {
+
+/**
+ * Static description of a checkpoint call site, created by `TLM_CHECKPOINT()`.
+ */
+struct CheckpointDescriptor {
+    const char* label;
+    const char* file;
+    uint32_t line;
+    const char* function;
+};
+
+/**
+ * Checkpoint ids with this bit set are indexes of registered descriptors rather
+ * than ids picked by the user. Together with `kProgressCheckpointBit` and the
+ * scope bits below this leaves 24 bits for user picked ids.
+ */
+static inline constexpr uint32_t kDescriptorCheckpointBit = 1u << 30;
+
+/**
+ * Records written by `CheckpointScope` when the scope is entered and exited.
+ * The nesting depth of the scope, saturated at `kMaxScopeDepth`, is stored
+ * in the bits from `kScopeDepthShift` to the enter bit.
+ */
+static inline constexpr uint32_t kScopeExitBit = 1u << 29;
+static inline constexpr uint32_t kScopeEnterBit = 1u << 28;
+static inline constexpr uint32_t kScopeDepthShift = 24;
+static inline constexpr uint32_t kMaxScopeDepth = 15;
+
+constexpr bool isScopeCheckpoint(uint32_t checkpointId) {
+    return (checkpointId & (kScopeEnterBit | kScopeExitBit)) != 0;
+}
+
+constexpr uint32_t scopeDepth(uint32_t checkpointId) {
+    return (checkpointId >> kScopeDepthShift) & kMaxScopeDepth;
+}
+
+/**
+ * Returns the checkpoint id passed to the scope, without the scope bits and depth.
+ */
+constexpr uint32_t scopeCheckpointId(uint32_t checkpointId) {
+    return isScopeCheckpoint(checkpointId)
+        ? checkpointId &
+            ~(kScopeEnterBit | kScopeExitBit | (kMaxScopeDepth << kScopeDepthShift))
+        : checkpointId;
+}
+
+/**
+ * Returns the descriptor for the checkpoint id created by `TLM_CHECKPOINT()`,
+ * or nullptr for ids picked by the user. The progress and scope bits are ignored.
+ * This takes a mutex, thus it should not be used on the hot path.
+ */
+const CheckpointDescriptor* findCheckpointDescriptor(uint32_t checkpointId);
+
+/**
+ * Human readable name of the checkpoint: the label for the registered descriptors
+ * or the numeric id otherwise. Both records of a scope have the name of its id.
+ */
+std::string checkpointName(uint32_t checkpointId);
+
+/**
+ * Same as above with the descriptor already found, nullptr for the ids picked by
+ * the user.
+ */
+std::string checkpointName(uint32_t checkpointId, const CheckpointDescriptor* descriptor);
+
+/**
+ * Returns `findCheckpointDescriptor()` for every id, taking the mutex once.
+ */
+std::vector<const CheckpointDescriptor*> findCheckpointDescriptors(
+    const std::vector<uint32_t>& checkpointIds);
+
+namespace details {
+
+/**
+ * Assigns the next descriptor id. Invoked once per call site when it is first
+ * visited, the descriptor must remain valid forever.
+ */
+uint32_t registerCheckpointDescriptor(const CheckpointDescriptor& descriptor);
+
+// One instantiation per call site, `Site` is a local class of the macro.
+// The function local static is safe to use from the static initializers of any
+// translation unit; after the first visit reading it is a load and a branch on
+// the guard variable.
+template <typename Site>
+struct CheckpointSiteId {
+    static uint32_t value() {
+        static const uint32_t id = registerCheckpointDescriptor(Site::descriptor());
+        return id;
+    }
+};
+
+}  // namespace details
+}  // namespace thread_monitor
@@ -0,0 +1,146 @@
+#include "thread_monitor/chrome_trace_writer.h"
+
+#include <unistd.h>
+
+#include <cstdio>
+
+namespace thread_monitor {
+
+namespace details {
+
+void writeJsonString(std::ostream& out, const std::string& s) {
+    out << '"';
+    for (const char c : s) {
+        switch (c) {
+            case '"':
+                out << "\\\"";
+                break;
+            case '\\':
+                out << "\\\\";
+                break;
+            case '\n':
+                out << "\\n";
+                break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char escaped[8];
+                    std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out << escaped;
+                } else {
+                    out << c;
+                }
+        }
+    }
+    out << '"';
+}
+
+int64_t toMicros(std::chrono::system_clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(t.time_since_epoch()).count();
+}
+
+}  // namespace details
+
+ChromeTraceWriter::ChromeTraceWriter(std::ostream& out) : _out(out), _pid(::getpid()) {
+    _out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+}
+
+void ChromeTraceWriter::addHistory(const void* thread,
+                                   pid_t tid,
+                                   const std::string& threadName,
+                                   const details::ThreadMonitorBase::History& history) {
+    if (history.empty()) {
+        auto it = _tracks.find(thread);
+        if (it != _tracks.end()) {
+            it->second.seen = true;
+        }
+        return;
+    }
+    auto it = _tracks.find(thread);
+    if (it != _tracks.end() && it->second.name != threadName) {
+        // The key was reused by another thread.
+        _writeInstantEvent(it->second);
+        _tracks.erase(it);
+        it = _tracks.end();
+    }
+    if (it == _tracks.end()) {
+        const uint32_t id = _nextTrackId++;
+        _writeEventPrefix("M", id);
+        _out << ",\"name\":\"thread_name\",\"args\":{\"name\":";
+        details::writeJsonString(_out, threadName);
+        _out << ",\"tid\":" << tid << "}}";
+        it = _tracks
+                 .emplace(thread, Track{id, threadName, history.front().timestamp,
+                                        history.front().checkpointId, true})
+                 .first;
+    }
+    Track& track = it->second;
+    track.seen = true;
+    if (history.front().timestamp > track.lastTimestamp) {
+        // The checkpoints since the previous snapshot were overwritten, the
+        // interval of the last written one is unknown.
+        _writeInstantEvent(track);
+        track.lastTimestamp = history.front().timestamp;
+        track.lastCheckpointId = history.front().checkpointId;
+    }
+    for (const auto& record : history) {
+        if (record.timestamp <= track.lastTimestamp) {
+            continue;  // Written from the previous snapshot.
+        }
+        _writeCheckpointEvent(track.id, track.lastCheckpointId, track.lastTimestamp,
+                              record.timestamp);
+        track.lastTimestamp = record.timestamp;
+        track.lastCheckpointId = record.checkpointId;
+    }
+}
+
+void ChromeTraceWriter::endSnapshot() {
+    for (auto it = _tracks.begin(); it != _tracks.end();) {
+        if (!it->second.seen) {
+            _writeInstantEvent(it->second);
+            it = _tracks.erase(it);
+            continue;
+        }
+        it->second.seen = false;
+        ++it;
+    }
+}
+
+void ChromeTraceWriter::finish(std::chrono::system_clock::time_point now) {
+    for (const auto& [thread, track] : _tracks) {
+        if (now > track.lastTimestamp) {
+            _writeCheckpointEvent(track.id, track.lastCheckpointId, track.lastTimestamp, now);
+        } else {
+            _writeInstantEvent(track);
+        }
+    }
+    _tracks.clear();
+    _out << "]}" << std::endl;
+}
+
+void ChromeTraceWriter::_writeEventPrefix(const char* phase, uint32_t trackId) {
+    if (!_firstEvent) {
+        _out << ",";
+    }
+    _firstEvent = false;
+    _out << "\n{\"ph\":\"" << phase << "\",\"pid\":" << _pid << ",\"tid\":" << trackId;
+}
+
+void ChromeTraceWriter::_writeCheckpointEvent(uint32_t trackId,
+                                              uint32_t checkpointId,
+                                              std::chrono::system_clock::time_point start,
+                                              std::chrono::system_clock::time_point end) {
+    _writeEventPrefix("X", trackId);
+    _out << ",\"name\":";
+    details::writeJsonString(_out, checkpointName(checkpointId));
+    _out << ",\"ts\":" << details::toMicros(start)
+         << ",\"dur\":" << details::toMicros(end) - details::toMicros(start) << "}";
+}
+
+void ChromeTraceWriter::_writeInstantEvent(const Track& track) {
+    _writeEventPrefix("i", track.id);
+    _out << ",\"s\":\"t\",\"name\":";
+    details::writeJsonString(_out, checkpointName(track.lastCheckpointId));
+    _out << ",\"ts\":" << details::toMicros(track.lastTimestamp) << "}";
+}
+
+}  // namespace thread_monitor
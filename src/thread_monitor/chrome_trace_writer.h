@@ -0,0 +1,98 @@
+// Author: Andrew Shuvalov
+//
+// Documentation: https://github.com/shuvalov-mdb/thread-liveness-monitor
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+
+#include "thread_monitor/thread_monitor.h"
+
+namespace thread_monitor {
+
+/**
+ * Streams checkpoint histories as Chrome Trace Event JSON, which is loaded by
+ * chrome://tracing and the Perfetto UI. Every monitored thread is a track and every
+ * interval between two checkpoints is a slice named after the first checkpoint.
+ * The events are written as the histories are added, only the last checkpoint
+ * of every thread is kept, thus the memory depends on the count of live threads
+ * but not on the count of events.
+ */
+class ChromeTraceWriter {
+public:
+    // Writes the header.
+    explicit ChromeTraceWriter(std::ostream& out);
+
+    ChromeTraceWriter(const ChromeTraceWriter&) = delete;
+    ChromeTraceWriter& operator=(const ChromeTraceWriter&) = delete;
+
+    /**
+     * Appends the checkpoints of the 'thread' newer than the ones already written,
+     * thus the overlapping snapshots of the same thread can be added. The 'thread'
+     * is any key of the monitored thread, e.g. its registration, the kernel 'tid'
+     * is only written to the track metadata. The interval after the last checkpoint
+     * remains open until the next checkpoint is added or the trace is finished.
+     * If the history does not overlap the written checkpoints, the ones between
+     * were lost and the open interval ends with an instant event instead. The same
+     * happens when the key is reused by a thread with another name.
+     */
+    void addHistory(const void* thread,
+                    pid_t tid,
+                    const std::string& threadName,
+                    const details::ThreadMonitorBase::History& history);
+
+    /**
+     * Ends a snapshot of all threads: the threads not added since the previous
+     * snapshot are gone, their last checkpoint is written as an instant event.
+     */
+    void endSnapshot();
+
+    /**
+     * Closes the open intervals at 'now' and writes the footer.
+     */
+    void finish(std::chrono::system_clock::time_point now);
+
+private:
+    struct Track {
+        // Written as the 'tid' of the events, unique in the trace.
+        uint32_t id;
+        std::string name;
+        std::chrono::system_clock::time_point lastTimestamp;
+        uint32_t lastCheckpointId;
+        bool seen;
+    };
+
+    void _writeEventPrefix(const char* phase, uint32_t trackId);
+    void _writeCheckpointEvent(uint32_t trackId,
+                               uint32_t checkpointId,
+                               std::chrono::system_clock::time_point start,
+                               std::chrono::system_clock::time_point end);
+    void _writeInstantEvent(const Track& track);
+
+    std::ostream& _out;
+    const pid_t _pid;
+    bool _firstEvent = true;
+    uint32_t _nextTrackId = 1;
+    std::unordered_map<const void*, Track> _tracks;
+};
+
+namespace details {
+
+/**
+ * Writes 's' as a JSON string literal with the quotes and control characters escaped.
+ */
+void writeJsonString(std::ostream& out, const std::string& s);
+
+/**
+ * Microseconds since the epoch, the timestamps of the JSON outputs.
+ */
+int64_t toMicros(std::chrono::system_clock::time_point t);
+
+}  // namespace details
+}  // namespace thread_monitor
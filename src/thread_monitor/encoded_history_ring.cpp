@@ -0,0 +1,228 @@
+#include "thread_monitor/encoded_history_ring.h"
+
+#include <cassert>
+#include <thread>
+
+namespace thread_monitor {
+namespace details {
+
+namespace {
+
+uint32_t encodeVarint(uint64_t value, uint8_t* out) {
+    uint32_t size = 0;
+    while (value >= 0x80) {
+        out[size++] = static_cast<uint8_t>(value | 0x80);
+        value >>= 7;
+    }
+    out[size++] = static_cast<uint8_t>(value);
+    return size;
+}
+
+// 'byteAt' returns the byte at the given offset from the record start.
+template <typename ByteAt>
+uint64_t decodeVarint(ByteAt byteAt, uint32_t* offset) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        const uint8_t byte = byteAt((*offset)++);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            break;
+        }
+    }
+    return value;
+}
+
+uint64_t zigzag(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+int64_t unzigzag(uint64_t value) {
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+template <typename ByteAt>
+uint32_t decodeRecord(ByteAt byteAt, uint32_t* checkpointId, int64_t* timeMicros) {
+    uint32_t offset = 0;
+    *checkpointId += static_cast<uint32_t>(unzigzag(decodeVarint(byteAt, &offset)));
+    *timeMicros += unzigzag(decodeVarint(byteAt, &offset));
+    return offset;
+}
+
+}  // namespace
+
+EncodedHistoryRing::EncodedHistoryRing(std::atomic<uint8_t>* bytes, uint32_t size)
+    : _bytes(bytes), _size(size) {
+    assert(_size >= kMaxRecordSize);
+}
+
+bool EncodedHistoryRing::empty() const {
+    return _head.load(std::memory_order_relaxed) == _tail.load(std::memory_order_relaxed);
+}
+
+uint32_t EncodedHistoryRing::size() const {
+    return _size;
+}
+
+void EncodedHistoryRing::clear() {
+    const auto sequence = _sequence.load(std::memory_order_relaxed);
+    _sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    // The next record is encoded from zero, same as the very first one.
+    _head.store(_tail.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    _anchorId.store(0, std::memory_order_relaxed);
+    _anchorTimeMicros.store(0, std::memory_order_relaxed);
+    _lastId.store(0, std::memory_order_relaxed);
+    _lastTimeMicros.store(0, std::memory_order_relaxed);
+
+    _sequence.store(sequence + 2, std::memory_order_release);
+}
+
+void EncodedHistoryRing::append(uint32_t checkpointId,
+                                std::chrono::system_clock::duration durationFromCreation) {
+    const auto sequence = _sequence.load(std::memory_order_relaxed);
+    _sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    _previousId = _lastId.load(std::memory_order_relaxed);
+    _previousTimeMicros = _lastTimeMicros.load(std::memory_order_relaxed);
+    _write(_previousId,
+           _previousTimeMicros,
+           checkpointId,
+           std::chrono::duration_cast<std::chrono::microseconds>(durationFromCreation).count());
+
+    _sequence.store(sequence + 2, std::memory_order_release);
+}
+
+void EncodedHistoryRing::replaceLast(uint32_t checkpointId,
+                                     std::chrono::system_clock::duration durationFromCreation) {
+    if (empty()) {
+        append(checkpointId, durationFromCreation);
+        return;
+    }
+    const auto sequence = _sequence.load(std::memory_order_relaxed);
+    _sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    // Rewind to the start of the newest record and encode it again from the
+    // previous record, the length may differ.
+    _tail.store(_lastRecordPosition, std::memory_order_relaxed);
+    _write(_previousId,
+           _previousTimeMicros,
+           checkpointId,
+           std::chrono::duration_cast<std::chrono::microseconds>(durationFromCreation).count());
+
+    _sequence.store(sequence + 2, std::memory_order_release);
+}
+
+void EncodedHistoryRing::_write(uint32_t baseId,
+                                int64_t baseTimeMicros,
+                                uint32_t checkpointId,
+                                int64_t timeMicros) {
+    uint8_t record[kMaxRecordSize];
+    uint32_t size = encodeVarint(zigzag(static_cast<int32_t>(checkpointId - baseId)), record);
+    size += encodeVarint(zigzag(timeMicros - baseTimeMicros), record + size);
+
+    // Evict the oldest records until the new one fits.
+    uint64_t head = _head.load(std::memory_order_relaxed);
+    const uint64_t tail = _tail.load(std::memory_order_relaxed);
+    if (tail + size - head > _size) {
+        uint32_t anchorId = _anchorId.load(std::memory_order_relaxed);
+        int64_t anchorTime = _anchorTimeMicros.load(std::memory_order_relaxed);
+        while (tail + size - head > _size) {
+            head += decodeRecord(
+                [this, head](uint32_t offset) {
+                    return _bytes[(head + offset) % _size].load(std::memory_order_relaxed);
+                },
+                &anchorId,
+                &anchorTime);
+        }
+        _anchorId.store(anchorId, std::memory_order_relaxed);
+        _anchorTimeMicros.store(anchorTime, std::memory_order_relaxed);
+        _head.store(head, std::memory_order_relaxed);
+    }
+
+    uint32_t offset = tail % _size;
+    for (uint32_t i = 0; i < size; ++i) {
+        _bytes[offset].store(record[i], std::memory_order_relaxed);
+        if (++offset == _size) {
+            offset = 0;
+        }
+    }
+    _lastRecordPosition = tail;
+    _tail.store(tail + size, std::memory_order_relaxed);
+    _lastId.store(checkpointId, std::memory_order_relaxed);
+    _lastTimeMicros.store(timeMicros, std::memory_order_relaxed);
+}
+
+uint32_t EncodedHistoryRing::lastId() const {
+    return _lastId.load(std::memory_order_relaxed);
+}
+
+std::chrono::system_clock::duration EncodedHistoryRing::lastDuration() const {
+    return std::chrono::microseconds{_lastTimeMicros.load(std::memory_order_relaxed)};
+}
+
+EncodedHistoryRing::Record EncodedHistoryRing::last() const {
+    while (true) {
+        const auto sequence = _sequence.load(std::memory_order_acquire);
+        if (sequence & 1) {
+            std::this_thread::yield();
+            continue;
+        }
+        const uint32_t id = _lastId.load(std::memory_order_relaxed);
+        const int64_t time = _lastTimeMicros.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (_sequence.load(std::memory_order_relaxed) == sequence) {
+            return {id, std::chrono::microseconds{time}};
+        }
+    }
+}
+
+std::vector<EncodedHistoryRing::Record> EncodedHistoryRing::decode() const {
+    std::vector<uint8_t> bytes;
+    uint32_t id;
+    int64_t time;
+    while (true) {
+        const auto sequence = _sequence.load(std::memory_order_acquire);
+        if (sequence & 1) {
+            std::this_thread::yield();
+            continue;
+        }
+        const uint64_t head = _head.load(std::memory_order_relaxed);
+        const uint64_t tail = _tail.load(std::memory_order_relaxed);
+        id = _anchorId.load(std::memory_order_relaxed);
+        time = _anchorTimeMicros.load(std::memory_order_relaxed);
+        if (tail - head <= _size) {
+            bytes.resize(tail - head);
+            uint32_t offset = head % _size;
+            for (auto& byte : bytes) {
+                byte = _bytes[offset].load(std::memory_order_relaxed);
+                if (++offset == _size) {
+                    offset = 0;
+                }
+            }
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (_sequence.load(std::memory_order_relaxed) == sequence) {
+            break;
+        }
+    }
+
+    std::vector<Record> records;
+    // Records are at least 2 bytes.
+    records.reserve(bytes.size() / 2);
+    for (uint32_t position = 0; position < bytes.size();) {
+        position += decodeRecord(
+            [&bytes, position](uint32_t offset) {
+                return position + offset < bytes.size() ? bytes[position + offset] : 0;
+            },
+            &id,
+            &time);
+        records.push_back({id, std::chrono::microseconds{time}});
+    }
+    return records;
+}
+
+}  // namespace details
+}  // namespace thread_monitor
@@ -0,0 +1,113 @@
+// Author: Andrew Shuvalov
+//
+// Documentation: https://github.com/shuvalov-mdb/thread-liveness-monitor
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace thread_monitor {
+namespace details {
+
+/**
+ * Circular history of checkpoints encoded in a byte buffer. Each record is the
+ * zigzag varint delta of the checkpoint id from the previous record followed by
+ * the varint delta of the time in microseconds. A typical record takes 3-4 bytes
+ * instead of 16 for `InternalHistoryRecord`.
+ *
+ * There is a single writer, the owner thread. Readers decode a consistent
+ * snapshot concurrently: the writer bumps a sequence number around every update
+ * and a reader retries if the sequence changed while it copied the bytes.
+ * The writer never waits and uses no fences besides compiler barriers on x86.
+ */
+class EncodedHistoryRing {
+public:
+    struct Record {
+        uint32_t checkpointId;
+        std::chrono::system_clock::duration durationFromCreation;
+    };
+
+    // Largest encoded record: 5 bytes of id delta and 10 bytes of time delta.
+    static inline constexpr uint32_t kMaxRecordSize = 15;
+
+    EncodedHistoryRing(std::atomic<uint8_t>* bytes, uint32_t size);
+
+    EncodedHistoryRing(const EncodedHistoryRing&) = delete;
+    EncodedHistoryRing& operator=(const EncodedHistoryRing&) = delete;
+
+    bool empty() const;
+
+    /**
+     * Capacity in bytes.
+     */
+    uint32_t size() const;
+
+    /**
+     * Writer only. Drops all records.
+     */
+    void clear();
+
+    /**
+     * Writer only. Appends the record evicting the oldest records if needed.
+     */
+    void append(uint32_t checkpointId, std::chrono::system_clock::duration durationFromCreation);
+
+    /**
+     * Writer only. Replaces the newest record, used to merge very close checkpoints.
+     */
+    void replaceLast(uint32_t checkpointId,
+                     std::chrono::system_clock::duration durationFromCreation);
+
+    /**
+     * Writer only. Checkpoint id of the newest record.
+     */
+    uint32_t lastId() const;
+
+    /**
+     * Writer only. Time of the newest record.
+     */
+    std::chrono::system_clock::duration lastDuration() const;
+
+    /**
+     * Consistent id and time of the newest record, zeros if empty.
+     * Safe to invoke from any thread.
+     */
+    Record last() const;
+
+    /**
+     * Decodes a consistent snapshot of all records, oldest first.
+     * Safe to invoke from any thread.
+     */
+    std::vector<Record> decode() const;
+
+private:
+    // Encodes the record as a delta from the base and writes it at the tail.
+    void _write(uint32_t baseId, int64_t baseTimeMicros, uint32_t checkpointId, int64_t timeMicros);
+
+    std::atomic<uint8_t>* const _bytes;
+    const uint32_t _size;
+
+    // Odd while the writer is updating the fields below.
+    std::atomic<uint32_t> _sequence{0};
+    // Monotonic byte positions, the ring offset is the position modulo size.
+    std::atomic<uint64_t> _head{0};
+    std::atomic<uint64_t> _tail{0};
+    // The record at head is encoded as a delta from these.
+    std::atomic<uint32_t> _anchorId{0};
+    std::atomic<int64_t> _anchorTimeMicros{0};
+    // The newest record, read by `last()` under the sequence.
+    std::atomic<uint32_t> _lastId{0};
+    std::atomic<int64_t> _lastTimeMicros{0};
+
+    // Owned by the writer. The previous values are the base of the newest
+    // record, to encode it again in `replaceLast()`.
+    uint64_t _lastRecordPosition = 0;
+    uint32_t _previousId = 0;
+    int64_t _previousTimeMicros = 0;
+};
+
+}  // namespace details
+}  // namespace thread_monitor
@@ -0,0 +1,34 @@
+// Author: Andrew Shuvalov
+//
+// Documentation: https://github.com/shuvalov-mdb/thread-liveness-monitor
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace thread_monitor {
+namespace details {
+
+/**
+ * Represents one checkpoint visited by a monitor, see
+ * `ThreadMonitorBase::getHistory()`.
+ */
+struct HistoryRecord {
+    uint32_t checkpointId;
+    std::chrono::system_clock::time_point timestamp;
+    // Zero if no payload was recorded or the layout does not keep payloads.
+    uint64_t payload;
+
+#ifndef NDEBUG
+    // Sequence number is very expensive to generate and thus
+    // it should be used only with debug builds.
+    uint64_t sequence;
+#endif
+};
+
+using History = std::vector<HistoryRecord>;
+
+}  // namespace details
+}  // namespace thread_monitor
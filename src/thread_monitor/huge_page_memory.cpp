@@ -0,0 +1,53 @@
+#include "thread_monitor/huge_page_memory.h"
+
+#include <new>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+namespace thread_monitor {
+namespace details {
+
+void* mapHugePageMemory(size_t size) {
+    size = (size + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+#ifdef __linux__
+    void* memory = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    // Explicit huge pages are only available if reserved by the administrator.
+    memory = ::mmap(nullptr,
+                    size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                    -1,
+                    0);
+#endif
+    if (memory == MAP_FAILED) {
+        memory = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+        // Otherwise ask for transparent huge pages.
+        if (memory != MAP_FAILED) {
+            ::madvise(memory, size, MADV_HUGEPAGE);
+        }
+#endif
+    }
+    if (memory == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+    return memory;
+#else
+    return ::operator new(size, std::align_val_t{64});
+#endif
+}
+
+void unmapHugePageMemory(void* memory, size_t size) {
+    size = (size + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+#ifdef __linux__
+    ::munmap(memory, size);
+#else
+    ::operator delete(memory, std::align_val_t{64});
+#endif
+}
+
+}  // namespace details
+}  // namespace thread_monitor
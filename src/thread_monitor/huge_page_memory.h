@@ -0,0 +1,28 @@
+// Author: Andrew Shuvalov
+//
+// Documentation: https://github.com/shuvalov-mdb/thread-liveness-monitor
+
+#pragma once
+
+#include <cstddef>
+
+namespace thread_monitor {
+namespace details {
+
+static inline constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+
+/**
+ * Maps 'size' bytes, rounded up to `kHugePageSize`, with explicit huge pages if
+ * reserved by the administrator, otherwise asks for transparent huge pages.
+ * Falls back to the heap on other platforms. Throws `std::bad_alloc` if the
+ * mapping fails. Only used for the long lived arenas.
+ */
+void* mapHugePageMemory(size_t size);
+
+/**
+ * Returns the 'size' bytes mapped by `mapHugePageMemory()`.
+ */
+void unmapHugePageMemory(void* memory, size_t size);
+
+}  // namespace details
+}  // namespace thread_monitor
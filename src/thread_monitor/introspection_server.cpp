@@ -0,0 +1,268 @@
+#include "thread_monitor/introspection_server.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <streambuf>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace thread_monitor {
+namespace details {
+
+namespace {
+
+// Longest accepted command line.
+constexpr size_t kMaxCommandLength = 256;
+
+#ifdef __linux__
+// Waits for the 'events' of the non-blocking socket, false on the stall timeout.
+bool waitForSocket(int fd, short events) {
+    const auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+        IntrospectionServer::kStallTimeout);
+    pollfd pfd{fd, events, 0};
+    while (true) {
+        const int ready = ::poll(&pfd, 1, static_cast<int>(timeout.count()));
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        return ready > 0;
+    }
+}
+
+// Buffers the response and sends it to the non-blocking socket in chunks. After
+// a failed or stalled send the rest of the response is discarded.
+class SocketStreamBuf : public std::streambuf {
+public:
+    explicit SocketStreamBuf(int fd) : _fd(fd) {
+        setp(_buffer, _buffer + sizeof(_buffer));
+    }
+
+    ~SocketStreamBuf() override {
+        sync();
+    }
+
+protected:
+    int_type overflow(int_type c) override {
+        if (sync() != 0) {
+            return traits_type::eof();
+        }
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync() override {
+        const char* data = pbase();
+        size_t size = pptr() - pbase();
+        while (size > 0 && !_failed) {
+            const ssize_t n = ::send(_fd, data, size, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+                waitForSocket(_fd, POLLOUT)) {
+                continue;
+            }
+            if (n <= 0) {
+                _failed = true;
+                break;
+            }
+            data += n;
+            size -= n;
+        }
+        setp(_buffer, _buffer + sizeof(_buffer));
+        return _failed ? -1 : 0;
+    }
+
+private:
+    const int _fd;
+    bool _failed = false;
+    char _buffer[64 * 1024];
+};
+
+bool makeAddress(const std::string& path, sockaddr_un* address) {
+    std::memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address->sun_path)) {
+        return false;
+    }
+    std::memcpy(address->sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+#endif
+
+}  // namespace
+
+IntrospectionServer::IntrospectionServer(Handler handler) : _handler(std::move(handler)) {}
+
+IntrospectionServer::~IntrospectionServer() {
+#ifdef __linux__
+    if (_thread) {
+        const char c = 0;
+        while (::write(_wakeupPipe[1], &c, 1) < 0 && errno == EINTR) {
+        }
+        _thread->join();
+    }
+    for (int fd : {_listenFd, _wakeupPipe[0], _wakeupPipe[1]}) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+    if (_listenFd >= 0) {
+        ::unlink(_path.c_str());
+    }
+#endif
+}
+
+bool IntrospectionServer::start(const std::string& path) {
+#ifdef __linux__
+    sockaddr_un address;
+    if (_thread || !makeAddress(path, &address)) {
+        std::cerr << "Invalid introspection socket path: " << path << std::endl;
+        return false;
+    }
+    _listenFd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (_listenFd < 0) {
+        std::cerr << "Introspection socket failed: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    // A socket left by a previous process would fail the bind. It is only removed
+    // if nothing listens on it, another live process keeps its socket.
+    struct stat st;
+    if (::stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        const int probe = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (probe >= 0) {
+            const bool refused =
+                ::connect(probe, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 &&
+                errno == ECONNREFUSED;
+            ::close(probe);
+            if (refused) {
+                ::unlink(path.c_str());
+            }
+        }
+    }
+    if (::bind(_listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        std::cerr << "Introspection socket " << path << " failed: " << std::strerror(errno)
+                  << std::endl;
+        ::close(_listenFd);
+        _listenFd = -1;
+        return false;
+    }
+    if (::listen(_listenFd, 4) != 0 || ::pipe2(_wakeupPipe, O_CLOEXEC) != 0) {
+        std::cerr << "Introspection socket " << path << " failed: " << std::strerror(errno)
+                  << std::endl;
+        ::close(_listenFd);
+        _listenFd = -1;
+        // Bound by this process.
+        ::unlink(path.c_str());
+        return false;
+    }
+    _path = path;
+    _thread = std::make_unique<std::thread>([this] { _serve(); });
+    return true;
+#else
+    return false;
+#endif
+}
+
+const std::string& IntrospectionServer::path() const {
+    return _path;
+}
+
+void IntrospectionServer::_serve() {
+#ifdef __linux__
+    while (true) {
+        pollfd fds[2] = {{_listenFd, POLLIN, 0}, {_wakeupPipe[0], POLLIN, 0}};
+        if (::poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        if (fds[1].revents != 0) {
+            return;  // Stopping.
+        }
+        const int fd = ::accept4(_listenFd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (fd < 0) {
+            continue;
+        }
+        _serveConnection(fd);
+        ::close(fd);
+    }
+#endif
+}
+
+void IntrospectionServer::_serveConnection(int fd) {
+#ifdef __linux__
+    std::string command;
+    char c;
+    while (command.size() < kMaxCommandLength) {
+        const ssize_t n = ::recv(fd, &c, 1, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && waitForSocket(fd, POLLIN)) {
+            continue;
+        }
+        if (n <= 0 || c == '\n') {
+            break;
+        }
+        command.push_back(c);
+    }
+    if (!command.empty() && command.back() == '\r') {
+        command.pop_back();
+    }
+    SocketStreamBuf buffer(fd);
+    std::ostream out(&buffer);
+    _handler(command, out);
+    out.flush();
+#endif
+}
+
+bool requestIntrospection(const std::string& path, const std::string& command, std::ostream& out) {
+#ifdef __linux__
+    sockaddr_un address;
+    if (!makeAddress(path, &address)) {
+        return false;
+    }
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+    const std::string line = command + "\n";
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        ::send(fd, line.data(), line.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(line.size())) {
+        ::close(fd);
+        return false;
+    }
+    char buffer[64 * 1024];
+    while (true) {
+        const ssize_t n = ::recv(fd, buffer, sizeof(buffer), 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        out.write(buffer, n);
+    }
+    ::close(fd);
+    return true;
+#else
+    return false;
+#endif
+}
+
+}  // namespace details
+}  // namespace thread_monitor
@@ -0,0 +1,69 @@
+// Author: Andrew Shuvalov
+//
+// Documentation: https://github.com/shuvalov-mdb/thread-liveness-monitor
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <thread>
+
+namespace thread_monitor {
+namespace details {
+
+/**
+ * Listens on a Unix domain socket and answers one request per connection: the
+ * client sends a command line, the handler writes the response to the stream,
+ * which is sent as it is written, and the connection is closed. The requests
+ * are served one at a time by the listener thread. Only for local debugging,
+ * the access is controlled by the permissions of the socket path.
+ */
+class IntrospectionServer {
+public:
+    using Handler = std::function<void(const std::string& command, std::ostream& out)>;
+
+    // How long a connection may stall on a client that does not send the command
+    // or does not read the response, then the connection is dropped. The socket
+    // is non-blocking, thus the listener never blocks longer than this.
+    static inline constexpr auto kStallTimeout = std::chrono::milliseconds{200};
+
+    explicit IntrospectionServer(Handler handler);
+    // Stops listening and removes the socket.
+    ~IntrospectionServer();
+
+    IntrospectionServer(const IntrospectionServer&) = delete;
+    IntrospectionServer& operator=(const IntrospectionServer&) = delete;
+
+    /**
+     * Binds the socket at 'path' and starts the listener thread. A socket file
+     * left by a dead process is replaced, one with a live listener is not.
+     * Returns false on failure, with the error printed.
+     */
+    bool start(const std::string& path);
+
+    const std::string& path() const;
+
+private:
+    void _serve();
+    void _serveConnection(int fd);
+
+    const Handler _handler;
+    std::string _path;
+    int _listenFd = -1;
+    // Written by the destructor to wake up the listener.
+    int _wakeupPipe[2] = {-1, -1};
+    std::unique_ptr<std::thread> _thread;
+};
+
+/**
+ * Connects to the introspection socket at 'path', sends 'command' and copies
+ * the response to 'out'. Returns false if the connection failed.
+ */
+bool requestIntrospection(const std::string& path, const std::string& command, std::ostream& out);
+
+}  // namespace details
+}  // namespace thread_monitor
@@ -0,0 +1,212 @@
+#include "thread_monitor/kernel_thread_state.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace thread_monitor {
+
+namespace {
+
+#ifdef __linux__
+// Reads a small /proc file into 'buffer' with plain syscalls to avoid
+// any stream allocations. Returns the count of bytes read or -1.
+ssize_t readProcFile(const char* path, char* buffer, size_t size) {
+    const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t total = 0;
+    while (total < static_cast<ssize_t>(size) - 1) {
+        const ssize_t n = ::read(fd, buffer + total, size - 1 - total);
+        if (n <= 0) {
+            break;
+        }
+        total += n;
+    }
+    ::close(fd);
+    buffer[total] = '\0';
+    return total;
+}
+
+// Parses '/proc/self/task/<tid>/stat'. The thread name in parentheses may
+// contain spaces, so the fields are counted from the last ')'.
+bool parseStat(const char* buffer, KernelThreadState* state) {
+    const char* p = std::strrchr(buffer, ')');
+    if (p == nullptr || p[1] == '\0') {
+        return false;
+    }
+    p += 2;
+    state->state = *p;
+    // The field after the name is 3rd in proc(5) numbering.
+    static constexpr int kUtimeField = 14;
+    static constexpr int kStimeField = 15;
+    static constexpr int kProcessorField = 39;
+    static const long ticksPerSecond = ::sysconf(_SC_CLK_TCK);
+    uint64_t utime = 0;
+    uint64_t stime = 0;
+    int field = 3;
+    while (*p != '\0' && field < kProcessorField) {
+        p = std::strchr(p, ' ');
+        if (p == nullptr) {
+            return false;
+        }
+        ++p;
+        ++field;
+        if (field == kUtimeField) {
+            utime = std::strtoull(p, nullptr, 10);
+        } else if (field == kStimeField) {
+            stime = std::strtoull(p, nullptr, 10);
+        } else if (field == kProcessorField) {
+            state->lastCpu = std::atoi(p);
+        }
+    }
+    if (ticksPerSecond > 0) {
+        state->cpuTime = std::chrono::nanoseconds{(utime + stime) * (1000000000 / ticksPerSecond)};
+    }
+    return true;
+}
+
+uint64_t parseStatusField(const char* buffer, const char* name) {
+    const char* p = std::strstr(buffer, name);
+    if (p == nullptr) {
+        return 0;
+    }
+    p = std::strchr(p, ':');
+    return p == nullptr ? 0 : std::strtoull(p + 1, nullptr, 10);
+}
+#endif
+
+}  // namespace
+
+bool readKernelThreadState(pid_t tid, KernelThreadState* state) {
+#ifdef __linux__
+    if (tid <= 0) {
+        return false;
+    }
+    char path[64];
+    char buffer[2048];
+    state->tid = tid;
+
+    std::snprintf(path, sizeof(path), "/proc/self/task/%d/stat", static_cast<int>(tid));
+    if (readProcFile(path, buffer, sizeof(buffer)) <= 0 || !parseStat(buffer, state)) {
+        return false;
+    }
+
+    // Schedstat has nanosecond precision but requires CONFIG_SCHED_INFO,
+    // when absent the tick based CPU time from 'stat' is kept.
+    std::snprintf(path, sizeof(path), "/proc/self/task/%d/schedstat", static_cast<int>(tid));
+    if (readProcFile(path, buffer, sizeof(buffer)) > 0) {
+        unsigned long long runTime = 0;
+        unsigned long long waitTime = 0;
+        if (std::sscanf(buffer, "%llu %llu", &runTime, &waitTime) == 2) {
+            state->cpuTime = std::chrono::nanoseconds{runTime};
+            state->runQueueWaitTime = std::chrono::nanoseconds{waitTime};
+        }
+    }
+
+    std::snprintf(path, sizeof(path), "/proc/self/task/%d/status", static_cast<int>(tid));
+    if (readProcFile(path, buffer, sizeof(buffer)) > 0) {
+        state->voluntaryContextSwitches = parseStatusField(buffer, "\nvoluntary_ctxt_switches");
+        state->involuntaryContextSwitches = parseStatusField(buffer, "nonvoluntary_ctxt_switches");
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+std::vector<KernelThreadStateReport> sampleKernelThreadStates(
+    const std::vector<pid_t>& tids, std::chrono::system_clock::duration interval) {
+    std::vector<KernelThreadStateReport> reports(tids.size());
+    std::vector<KernelThreadState> first(tids.size());
+    std::vector<bool> firstValid(tids.size());
+    const auto firstSampleTime = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < tids.size(); ++i) {
+        firstValid[i] = readKernelThreadState(tids[i], &first[i]);
+    }
+    std::this_thread::sleep_for(interval);
+    const auto samplingInterval = std::chrono::steady_clock::now() - firstSampleTime;
+
+    for (size_t i = 0; i < tids.size(); ++i) {
+        KernelThreadStateReport& report = reports[i];
+        report.valid = firstValid[i] && readKernelThreadState(tids[i], &report.state);
+        if (!report.valid) {
+            report.state.tid = tids[i];
+            continue;
+        }
+        report.samplingInterval = samplingInterval;
+        report.cpuTimeDelta = report.state.cpuTime - first[i].cpuTime;
+        report.runQueueWaitDelta = report.state.runQueueWaitTime - first[i].runQueueWaitTime;
+        report.voluntaryContextSwitchesDelta =
+            report.state.voluntaryContextSwitches - first[i].voluntaryContextSwitches;
+        report.involuntaryContextSwitchesDelta =
+            report.state.involuntaryContextSwitches - first[i].involuntaryContextSwitches;
+
+        // The thread is considered busy if it was doing something half of the time.
+        const auto busyThreshold = report.samplingInterval / 2;
+        if (report.cpuTimeDelta >= busyThreshold) {
+            report.diagnosis = ThreadStallDiagnosis::kSpinning;
+        } else if (report.runQueueWaitDelta >= busyThreshold) {
+            report.diagnosis = ThreadStallDiagnosis::kStarved;
+        } else if (report.state.state == 'S' || report.state.state == 'D' ||
+                   report.state.state == 'T' || report.state.state == 't') {
+            report.diagnosis = ThreadStallDiagnosis::kBlocked;
+        }
+    }
+    return reports;
+}
+
+const char* toString(ThreadStallDiagnosis diagnosis) {
+    switch (diagnosis) {
+        case ThreadStallDiagnosis::kSpinning:
+            return "spinning";
+        case ThreadStallDiagnosis::kBlocked:
+            return "blocked";
+        case ThreadStallDiagnosis::kStarved:
+            return "starved";
+        case ThreadStallDiagnosis::kUnknown:
+            break;
+    }
+    return "unknown";
+}
+
+void printKernelThreadStateReport(const KernelThreadStateReport& report) {
+    if (!report.valid) {
+        std::cerr << "Kernel state: tid: " << report.state.tid << " unavailable" << std::endl;
+        return;
+    }
+    using std::chrono::duration_cast;
+    using std::chrono::microseconds;
+    std::cerr << "Kernel state: tid: " << report.state.tid << " state: " << report.state.state
+              << " cpu: " << report.state.lastCpu
+              << " cpu time delta: " << duration_cast<microseconds>(report.cpuTimeDelta).count()
+              << " us run queue wait delta: "
+              << duration_cast<microseconds>(report.runQueueWaitDelta).count()
+              << " us in: " << duration_cast<microseconds>(report.samplingInterval).count()
+              << " us switches: " << report.voluntaryContextSwitchesDelta << " voluntary, "
+              << report.involuntaryContextSwitchesDelta << " involuntary"
+              << " diagnosis: " << toString(report.diagnosis) << std::endl;
+}
+
+namespace details {
+
+pid_t currentKernelThreadId() {
+#ifdef __linux__
+    static thread_local pid_t tid = static_cast<pid_t>(::syscall(SYS_gettid));
+    return tid;
+#else
+    return 0;
+#endif
+}
+
+}  // namespace details
+}  // namespace thread_monitor
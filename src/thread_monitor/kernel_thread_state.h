@@ -0,0 +1,87 @@
+// Author: Andrew Shuvalov
+//
+// Documentation: https://github.com/shuvalov-mdb/thread-liveness-monitor
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace thread_monitor {
+
+/**
+ * Kernel view of one thread, read from `/proc/self/task/<tid>/stat`,
+ * `schedstat` and `status`. Reading it costs several syscalls, thus it is
+ * only done on the slow path when a thread is already reported as stale.
+ */
+struct KernelThreadState {
+    pid_t tid = 0;
+    // Scheduler state letter: R (running), S (sleeping), D (uninterruptible), etc.
+    char state = '?';
+    // Total CPU time consumed by the thread, user and kernel.
+    std::chrono::nanoseconds cpuTime{0};
+    // Time spent runnable on a run queue waiting for a CPU.
+    std::chrono::nanoseconds runQueueWaitTime{0};
+    uint64_t voluntaryContextSwitches = 0;
+    uint64_t involuntaryContextSwitches = 0;
+    // CPU the thread last executed on.
+    int lastCpu = -1;
+};
+
+/**
+ * Best guess of why a stale thread does not make progress, derived from two
+ * samples of `KernelThreadState` taken some interval apart.
+ */
+enum class ThreadStallDiagnosis {
+    kUnknown,
+    // Consuming CPU without reaching a checkpoint: livelock or endless loop.
+    kSpinning,
+    // Sleeping in the kernel: deadlock, lock wait or I/O.
+    kBlocked,
+    // Runnable but not getting CPU time: starvation.
+    kStarved,
+};
+
+struct KernelThreadStateReport {
+    KernelThreadState state;
+    // Deltas between the first and the second sample.
+    std::chrono::nanoseconds samplingInterval{0};
+    std::chrono::nanoseconds cpuTimeDelta{0};
+    std::chrono::nanoseconds runQueueWaitDelta{0};
+    uint64_t voluntaryContextSwitchesDelta = 0;
+    uint64_t involuntaryContextSwitchesDelta = 0;
+    ThreadStallDiagnosis diagnosis = ThreadStallDiagnosis::kUnknown;
+    // False if the thread exited or /proc is not available.
+    bool valid = false;
+};
+
+/**
+ * Reads the kernel state of a thread of this process. Returns false if the
+ * thread does not exist or the platform does not support it.
+ */
+bool readKernelThreadState(pid_t tid, KernelThreadState* state);
+
+/**
+ * Samples all 'tids' in one batch, waits for 'interval' and samples them again
+ * to compute the deltas. The result is in the same order as 'tids'.
+ */
+std::vector<KernelThreadStateReport> sampleKernelThreadStates(
+    const std::vector<pid_t>& tids, std::chrono::system_clock::duration interval);
+
+const char* toString(ThreadStallDiagnosis diagnosis);
+
+void printKernelThreadStateReport(const KernelThreadStateReport& report);
+
+namespace details {
+
+/**
+ * Kernel thread id of the calling thread, cached in a thread local after
+ * the first call. Returns 0 on platforms without kernel thread ids.
+ */
+pid_t currentKernelThreadId();
+
+}  // namespace details
+}  // namespace thread_monitor
@@ -0,0 +1,125 @@
+#include "thread_monitor/monitor_simulation.h"
+
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <mutex>
+
+namespace thread_monitor {
+
+#ifndef THREAD_MONITOR_DISABLED
+SimulatedMonitor::SimulatedMonitor(MonitorDomain& domain,
+                                   const char* const name,
+                                   std::thread::id threadId,
+                                   uint32_t firstCheckpointId)
+    : Storage(),
+      ThreadMonitorBase(&domain,
+                        name,
+                        Storage::records(),
+                        Storage::payloads(),
+                        Storage::encodedHistory(),
+                        Storage::leasesThreadHistory(),
+                        checkpointImplFor<history_layout::Compact>(),
+                        kSimulatedMonitorHistoryDepth,
+                        firstCheckpointId,
+                        true,
+                        threadId) {}
+
+#ifdef THREAD_MONITOR_VIRTUAL_CLOCK
+namespace {
+
+// Ids of 'count' threads alive at the same time, thus distinct.
+std::vector<std::thread::id> distinctThreadIds(uint32_t count) {
+    std::mutex mutex;
+    std::condition_variable cv;
+    uint32_t started = 0;
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < count; ++i) {
+        threads.emplace_back([&] {
+            std::unique_lock<std::mutex> lock(mutex);
+            ++started;
+            cv.notify_all();
+            cv.wait(lock, [&] { return started == count; });
+        });
+    }
+    std::vector<std::thread::id> ids;
+    for (auto& t : threads) {
+        ids.push_back(t.get_id());
+        t.join();
+    }
+    return ids;
+}
+
+}  // namespace
+
+MonitorSimulation::MonitorSimulation(const Options& options)
+    : _threadIds(distinctThreadIds(std::max(options.threadIds, 1u))) {
+    // The real and the virtual time points must not mix.
+    assert(details::liveMonitorCount() == 0);
+    VirtualClock::install(std::chrono::system_clock::now());
+    ThreadMonitorCentralRepository::DomainOptions domainOptions;
+    domainOptions.name = options.name;
+    domainOptions.withMonitorThread = false;
+    domainOptions.sharding = options.sharding;
+    _domain = std::make_unique<ThreadMonitorCentralRepository>(domainOptions);
+    _domain->setThreadTimeout(options.threadTimeout);
+    _domain->setReportingInterval(options.reportingInterval);
+    // The simulated threads have no kernel thread to sample.
+    _domain->setKernelStateSamplingInterval(std::chrono::system_clock::duration::zero());
+}
+
+MonitorSimulation::~MonitorSimulation() {
+    _monitors.clear();
+    _domain.reset();
+    VirtualClock::uninstall();
+}
+
+std::chrono::system_clock::time_point MonitorSimulation::now() const {
+    return VirtualClock::now();
+}
+
+void MonitorSimulation::advance(std::chrono::system_clock::duration duration) {
+    VirtualClock::advance(duration);
+}
+
+size_t MonitorSimulation::addMonitors(size_t count, uint32_t firstCheckpointId) {
+    const size_t first = _monitors.size();
+    _monitors.reserve(first + count);
+    for (size_t i = first; i < first + count; ++i) {
+        _monitors.push_back(std::make_unique<SimulatedMonitor>(
+            *_domain, "simulated", _threadIds[i % _threadIds.size()], firstCheckpointId));
+    }
+    return first;
+}
+
+void MonitorSimulation::removeMonitors(size_t first, size_t count) {
+    const size_t end = std::min(first + count, _monitors.size());
+    for (size_t i = first; i < end; ++i) {
+        _monitors[i].reset();
+    }
+}
+
+void MonitorSimulation::checkpoint(size_t first, size_t count, uint32_t checkpointId) {
+    const size_t end = std::min(first + count, _monitors.size());
+    for (size_t i = first; i < end; ++i) {
+        if (_monitors[i] != nullptr) {
+            _monitors[i]->checkpoint(checkpointId);
+        }
+    }
+}
+
+MonitorSimulation::CycleResult MonitorSimulation::runMonitorCycle() {
+    const uint32_t errors = _domain->getLivenessErrorConditionDetectedCount();
+    const auto start = std::chrono::steady_clock::now();
+    CycleResult result;
+    result.garbageCollected = _domain->runMonitorCycle();
+    result.duration = std::chrono::steady_clock::now() - start;
+    result.livenessErrors = _domain->getLivenessErrorConditionDetectedCount() - errors;
+    // All garbage is collected, every monitor of the process must be in this domain.
+    assert(details::liveMonitorCount() <= _domain->threadCount());
+    return result;
+}
+#endif  // THREAD_MONITOR_VIRTUAL_CLOCK
+#endif  // THREAD_MONITOR_DISABLED
+
+}  // namespace thread_monitor
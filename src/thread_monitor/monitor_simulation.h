@@ -0,0 +1,123 @@
+// Author: Andrew Shuvalov
+//
+// Documentation: https://github.com/shuvalov-mdb/thread-liveness-monitor
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "thread_monitor/thread_monitor.h"
+#include "thread_monitor/virtual_clock.h"
+
+namespace thread_monitor {
+
+#ifndef THREAD_MONITOR_DISABLED
+// History depth of every `SimulatedMonitor`.
+static inline constexpr uint32_t kSimulatedMonitorHistoryDepth = 10;
+
+/**
+ * Monitor of a simulated thread: it is registered under the given thread id and
+ * its checkpoints are invoked explicitly, not bound to the calling thread, thus
+ * one thread drives any number of them. The kernel thread id is 0.
+ */
+class SimulatedMonitor
+    : private details::HistoryStorage<kSimulatedMonitorHistoryDepth, history_layout::Compact>,
+      public details::ThreadMonitorBase {
+public:
+    SimulatedMonitor(MonitorDomain& domain,
+                     const char* const name,
+                     std::thread::id threadId,
+                     uint32_t firstCheckpointId);
+
+    void checkpoint(uint32_t checkpointId, uint64_t payload = 0) {
+        checkpointInternalImpl(checkpointId, payload);
+    }
+
+private:
+    using Storage =
+        details::HistoryStorage<kSimulatedMonitorHistoryDepth, history_layout::Compact>;
+};
+
+#ifdef THREAD_MONITOR_VIRTUAL_CLOCK
+/**
+ * Deterministic simulation of a domain with any number of monitors on the
+ * `VirtualClock`, e.g. 100k monitors with timeouts of hours, in milliseconds of
+ * the wall time. The domain has no monitor thread, the test advances the time,
+ * visits the checkpoints and runs the monitor cycles, which are timed with the
+ * real clock as a model of the cycle cost. Only one simulation can exist at a
+ * time and no monitors outside of its domain should be used meanwhile, which is
+ * asserted in debug builds.
+ */
+class MonitorSimulation {
+public:
+    struct Options {
+        const char* name = "simulation";
+        std::chrono::system_clock::duration threadTimeout = MonitorDomain::kDefaultThreadTimeout;
+        std::chrono::system_clock::duration reportingInterval =
+            MonitorDomain::kDefaultReportingInterval;
+        // The monitors are spread over this many distinct thread ids, which pick
+        // the shards as the threads of a real process would.
+        uint32_t threadIds = 64;
+        ThreadMonitorCentralRepository::ShardingOptions sharding;
+    };
+
+    struct CycleResult {
+        unsigned int garbageCollected;
+        // Liveness errors detected by this cycle.
+        uint32_t livenessErrors;
+        // Wall time of the cycle.
+        std::chrono::nanoseconds duration;
+    };
+
+    // Installs the virtual clock at the current time.
+    explicit MonitorSimulation(const Options& options);
+    // Destroys the monitors and the domain, uninstalls the virtual clock.
+    ~MonitorSimulation();
+
+    MonitorSimulation(const MonitorSimulation&) = delete;
+    MonitorSimulation& operator=(const MonitorSimulation&) = delete;
+
+    ThreadMonitorCentralRepository& domain() {
+        return *_domain;
+    }
+
+    std::chrono::system_clock::time_point now() const;
+    void advance(std::chrono::system_clock::duration duration);
+
+    /**
+     * Creates 'count' monitors at the current time and returns the index of the
+     * first. The indexes are never reused.
+     */
+    size_t addMonitors(size_t count, uint32_t firstCheckpointId = 1);
+
+    /**
+     * Destroys the monitors with indexes in [first, first + count), which leaves
+     * their registrations to the garbage collection of the next cycle.
+     */
+    void removeMonitors(size_t first, size_t count);
+
+    /**
+     * Visits 'checkpointId' by the live monitors in [first, first + count).
+     */
+    void checkpoint(size_t first, size_t count, uint32_t checkpointId);
+
+    size_t monitorCount() const {
+        return _monitors.size();
+    }
+
+    CycleResult runMonitorCycle();
+
+private:
+    std::vector<std::thread::id> _threadIds;
+    std::unique_ptr<ThreadMonitorCentralRepository> _domain;
+    // Destroyed monitors are nullptr.
+    std::vector<std::unique_ptr<SimulatedMonitor>> _monitors;
+};
+#endif  // THREAD_MONITOR_VIRTUAL_CLOCK
+#endif  // THREAD_MONITOR_DISABLED
+
+}  // namespace thread_monitor
@@ -0,0 +1,156 @@
+#include "thread_monitor/monitor_stats.h"
+
+#include <cstring>
+#include <string>
+#include <thread>
+#include <type_traits>
+
+namespace thread_monitor {
+
+static_assert(std::is_trivially_copyable<MonitorStats>::value,
+              "The stats are published as raw words");
+
+namespace {
+
+// The label values escape the backslash, the double quote and the line feed.
+std::string escapeLabelValue(const char* value) {
+    std::string escaped;
+    for (const char* c = value; *c != '\0'; ++c) {
+        switch (*c) {
+            case '\\':
+                escaped += "\\\\";
+                break;
+            case '"':
+                escaped += "\\\"";
+                break;
+            case '\n':
+                escaped += "\\n";
+                break;
+            default:
+                escaped += *c;
+        }
+    }
+    return escaped;
+}
+
+double toSeconds(std::chrono::system_clock::duration d) {
+    return std::chrono::duration<double>(d).count();
+}
+
+template <typename Bound, typename ToValue>
+void writeHistogram(std::ostream& out,
+                    const char* metric,
+                    const char* help,
+                    const char* domain,
+                    const std::array<Bound, MonitorStats::kHistogramBuckets - 1>& bounds,
+                    const std::array<uint32_t, MonitorStats::kHistogramBuckets>& counts,
+                    double sum,
+                    ToValue toValue) {
+    out << "# HELP " << metric << " " << help << "\n";
+    out << "# TYPE " << metric << " histogram\n";
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < MonitorStats::kHistogramBuckets; ++i) {
+        cumulative += counts[i];
+        out << metric << "_bucket{domain=\"" << domain << "\",le=\"";
+        if (i < bounds.size()) {
+            out << toValue(bounds[i]);
+        } else {
+            out << "+Inf";
+        }
+        out << "\"} " << cumulative << "\n";
+    }
+    out << metric << "_sum{domain=\"" << domain << "\"} " << sum << "\n";
+    out << metric << "_count{domain=\"" << domain << "\"} " << cumulative << "\n";
+}
+
+template <typename Value>
+void writeMetric(std::ostream& out,
+                 const char* metric,
+                 const char* type,
+                 const char* help,
+                 const char* domain,
+                 Value value) {
+    out << "# HELP " << metric << " " << help << "\n";
+    out << "# TYPE " << metric << " " << type << "\n";
+    out << metric << "{domain=\"" << domain << "\"} " << value << "\n";
+}
+
+}  // namespace
+
+void writePrometheusText(std::ostream& out, const MonitorStats& stats, const char* domainName) {
+    const std::string label = escapeLabelValue(domainName);
+    const char* const domain = label.c_str();
+    writeMetric(out, "thread_monitor_threads", "gauge",
+                "Registrations seen by the last monitor cycle.", domain, stats.threads);
+    writeHistogram(out, "thread_monitor_staleness_seconds",
+                   "Time since the thread last updated its liveness timestamp.", domain,
+                   MonitorStats::kStalenessBounds, stats.staleness, toSeconds(stats.stalenessSum),
+                   [](std::chrono::system_clock::duration bound) {
+                       return std::chrono::duration<double>(bound).count();
+                   });
+    writeHistogram(out, "thread_monitor_thread_checkpoints_per_second",
+                   "Checkpoint rate of the threads.", domain, MonitorStats::kCheckpointRateBounds,
+                   stats.checkpointRate, static_cast<double>(stats.checkpointRateSum),
+                   [](uint64_t bound) { return bound; });
+    writeMetric(out, "thread_monitor_cycles_total", "counter", "Completed monitor cycles.", domain,
+                stats.cycles);
+    writeMetric(out, "thread_monitor_last_cycle_seconds", "gauge",
+                "Duration of the last monitor cycle.", domain,
+                toSeconds(stats.lastCycleDuration));
+    writeMetric(out, "thread_monitor_cycle_seconds_total", "counter",
+                "Total duration of the monitor cycles.", domain,
+                toSeconds(stats.cycleDurationSum));
+    writeMetric(out, "thread_monitor_last_cycle_garbage_collected", "gauge",
+                "Deleted registrations collected by the last monitor cycle.", domain,
+                stats.lastCycleGarbageCollected);
+    writeMetric(out, "thread_monitor_garbage_collected_total", "counter",
+                "Deleted registrations collected.", domain, stats.garbageCollected);
+    writeMetric(out, "thread_monitor_last_cycle_max_shard_lock_wait_seconds", "gauge",
+                "Longest shard lock acquisition of the last monitor cycle.", domain,
+                toSeconds(stats.lastCycleMaxShardLockWait));
+    writeMetric(out, "thread_monitor_shard_lock_wait_seconds_total", "counter",
+                "Time the monitor cycles spent acquiring the shard locks.", domain,
+                toSeconds(stats.shardLockWaitSum));
+    writeMetric(out, "thread_monitor_liveness_errors_total", "counter",
+                "Liveness errors detected.", domain, stats.livenessErrors);
+    writeMetric(out, "thread_monitor_livelocks_total", "counter",
+                "Liveness errors that were livelocks.", domain, stats.livelocks);
+}
+
+namespace details {
+
+void MonitorStatsCell::publish(const MonitorStats& stats) {
+    uint64_t words[kWords] = {};
+    std::memcpy(words, &stats, sizeof(stats));
+    const uint64_t sequence = _sequence.load(std::memory_order_relaxed);
+    _sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < kWords; ++i) {
+        _words[i].store(words[i], std::memory_order_relaxed);
+    }
+    _sequence.store(sequence + 2, std::memory_order_release);
+}
+
+MonitorStats MonitorStatsCell::load() const {
+    uint64_t words[kWords];
+    while (true) {
+        const uint64_t before = _sequence.load(std::memory_order_acquire);
+        if (before % 2 != 0) {
+            std::this_thread::yield();
+            continue;
+        }
+        for (size_t i = 0; i < kWords; ++i) {
+            words[i] = _words[i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (_sequence.load(std::memory_order_relaxed) == before) {
+            break;
+        }
+    }
+    MonitorStats stats;
+    std::memcpy(&stats, words, sizeof(stats));
+    return stats;
+}
+
+}  // namespace details
+}  // namespace thread_monitor
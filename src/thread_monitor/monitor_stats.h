@@ -0,0 +1,114 @@
+// Author: Andrew Shuvalov
+//
+// Documentation: https://github.com/shuvalov-mdb/thread-liveness-monitor
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+namespace thread_monitor {
+
+/**
+ * Snapshot of a monitor domain computed by the monitor cycle while it scans the
+ * registrations anyway, thus it costs no additional pass. The histograms cover
+ * the threads seen by the last complete cycle, the totals are since the start.
+ */
+struct MonitorStats {
+    static inline constexpr size_t kHistogramBuckets = 8;
+    // Upper bounds of the buckets, the last bucket is unbounded.
+    static inline constexpr std::array<std::chrono::system_clock::duration, kHistogramBuckets - 1>
+        kStalenessBounds{{std::chrono::milliseconds{1},
+                          std::chrono::milliseconds{10},
+                          std::chrono::milliseconds{100},
+                          std::chrono::seconds{1},
+                          std::chrono::seconds{10},
+                          std::chrono::minutes{1},
+                          std::chrono::minutes{5}}};
+    static inline constexpr std::array<uint64_t, kHistogramBuckets - 1> kCheckpointRateBounds{
+        {1, 10, 100, 1000, 10000, 100000, 1000000}};
+
+    // When the last complete cycle finished, zero before the first one.
+    std::chrono::system_clock::time_point timestamp;
+    uint32_t threads = 0;
+
+    // Time since the last liveness timestamp update, which is stale to the
+    // reporting interval. The counts are per bucket, not cumulative.
+    std::array<uint32_t, kHistogramBuckets> staleness{};
+    std::chrono::system_clock::duration stalenessSum{0};
+
+    // Checkpoints per second of every thread between its last two liveness
+    // timestamp updates.
+    std::array<uint32_t, kHistogramBuckets> checkpointRate{};
+    uint64_t checkpointRateSum = 0;
+
+    // The monitor itself. A cooperative cycle is the sum of its slices.
+    uint64_t cycles = 0;
+    std::chrono::system_clock::duration lastCycleDuration{0};
+    std::chrono::system_clock::duration cycleDurationSum{0};
+    uint32_t lastCycleGarbageCollected = 0;
+    uint64_t garbageCollected = 0;
+    // Time spent acquiring the shard locks, the maximum is of the last cycle.
+    std::chrono::system_clock::duration lastCycleMaxShardLockWait{0};
+    std::chrono::system_clock::duration shardLockWaitSum{0};
+
+    uint32_t livenessErrors = 0;
+    uint32_t livelocks = 0;
+
+    /**
+     * Counts one registration of the cycle, inlined in the monitor cycle scan.
+     */
+    void addThread(std::chrono::system_clock::duration threadStaleness,
+                   uint32_t checkpointsPerSecond) {
+        ++threads;
+        size_t bucket = 0;
+        while (bucket < kStalenessBounds.size() && threadStaleness > kStalenessBounds[bucket]) {
+            ++bucket;
+        }
+        ++staleness[bucket];
+        stalenessSum += threadStaleness;
+
+        bucket = 0;
+        while (bucket < kCheckpointRateBounds.size() &&
+               checkpointsPerSecond > kCheckpointRateBounds[bucket]) {
+            ++bucket;
+        }
+        ++checkpointRate[bucket];
+        checkpointRateSum += checkpointsPerSecond;
+    }
+};
+
+/**
+ * Writes the 'stats' in the Prometheus text exposition format, every sample is
+ * labeled with the 'domain' name, escaped as a Prometheus label value.
+ */
+void writePrometheusText(std::ostream& out, const MonitorStats& stats, const char* domain);
+
+namespace details {
+
+/**
+ * Publishes the `MonitorStats` from the monitor cycle to any count of readers
+ * without locking: a sequence lock over atomic words, the readers retry while
+ * a publication is in progress.
+ */
+class MonitorStatsCell {
+public:
+    // Only one thread publishes at a time.
+    void publish(const MonitorStats& stats);
+
+    MonitorStats load() const;
+
+private:
+    static inline constexpr size_t kWords = (sizeof(MonitorStats) + 7) / 8;
+
+    // Odd while the words are being written.
+    std::atomic<uint64_t> _sequence{0};
+    std::array<std::atomic<uint64_t>, kWords> _words{};
+};
+
+}  // namespace details
+}  // namespace thread_monitor
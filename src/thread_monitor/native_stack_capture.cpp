@@ -0,0 +1,230 @@
+#include "thread_monitor/native_stack_capture.h"
+
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#ifdef __linux__
+#include <execinfo.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <ucontext.h>
+#include <unistd.h>
+#endif
+
+namespace thread_monitor {
+
+namespace {
+
+#ifdef __linux__
+enum SlotState : int {
+    kFree = 0,
+    // Waiting for the target thread to run the handler.
+    kArmed,
+    // The handler is writing the frames.
+    kCapturing,
+    kDone,
+};
+
+// Slots are static and never freed: a handler that runs after its capture timed
+// out can only find the slot not armed for it, it never touches freed memory.
+struct CaptureSlot {
+    std::atomic<int> state{kFree};
+    std::atomic<pid_t> tid{0};
+    int depth = 0;
+    void* frames[kMaxStackCaptureFrames];
+};
+
+std::array<CaptureSlot, kMaxStackCaptures> captureSlots;
+
+// Only one batch capture at a time, the slots are shared.
+std::mutex captureMutex;
+
+// Copies one word of this process memory with a syscall, which fails with EFAULT
+// instead of crashing on an unmapped address. Async-signal-safe.
+bool safeReadWord(uintptr_t address, uintptr_t* value) {
+    iovec local{value, sizeof(*value)};
+    iovec remote{reinterpret_cast<void*>(address), sizeof(*value)};
+    return ::syscall(SYS_process_vm_readv, ::getpid(), &local, 1, &remote, 1, 0) ==
+           static_cast<long>(sizeof(*value));
+}
+
+// Walks the frame pointer chain of the interrupted code: the program counter,
+// then the return address stored above every saved frame pointer. Unlike
+// backtrace() it neither allocates nor takes the loader locks. Code built
+// without frame pointers ends the walk early.
+int walkFramePointers(const ucontext_t* context, void** frames, int maxFrames) {
+#if defined(__x86_64__)
+    uintptr_t pc = context->uc_mcontext.gregs[REG_RIP];
+    uintptr_t fp = context->uc_mcontext.gregs[REG_RBP];
+#elif defined(__aarch64__)
+    uintptr_t pc = context->uc_mcontext.pc;
+    uintptr_t fp = context->uc_mcontext.regs[29];
+#else
+    return 0;
+#endif
+    int depth = 0;
+    frames[depth++] = reinterpret_cast<void*>(pc);
+    while (depth < maxFrames && fp != 0 && fp % sizeof(uintptr_t) == 0) {
+        uintptr_t next = 0;
+        uintptr_t returnAddress = 0;
+        if (!safeReadWord(fp, &next) || !safeReadWord(fp + sizeof(uintptr_t), &returnAddress) ||
+            returnAddress == 0) {
+            break;
+        }
+        frames[depth++] = reinterpret_cast<void*>(returnAddress);
+        // The stack grows down, the caller frames are above.
+        if (next <= fp) {
+            break;
+        }
+        fp = next;
+    }
+    return depth;
+}
+
+void captureSignalHandler(int, siginfo_t* info, void* context) {
+    const int savedErrno = errno;
+    auto* slot = static_cast<CaptureSlot*>(info->si_value.sival_ptr);
+    const pid_t self = static_cast<pid_t>(::syscall(SYS_gettid));
+    int expected = kArmed;
+    if (slot != nullptr && slot->tid.load() == self &&
+        slot->state.compare_exchange_strong(expected, kCapturing)) {
+        slot->depth = walkFramePointers(static_cast<const ucontext_t*>(context), slot->frames,
+                                        kMaxStackCaptureFrames);
+        slot->state.store(kDone);
+    }
+    errno = savedErrno;
+}
+
+bool installHandler() {
+    const int signal = SIGRTMIN + kStackCaptureSignalOffset;
+    struct sigaction existing {};
+    if (::sigaction(signal, nullptr, &existing) != 0) {
+        return false;
+    }
+    const bool hasHandler = (existing.sa_flags & SA_SIGINFO) != 0
+                                ? existing.sa_sigaction != nullptr
+                                : existing.sa_handler != SIG_DFL;
+    if (hasHandler) {
+        std::cerr << "Native stack capture disabled, the application handles signal "
+                  << signal << std::endl;
+        return false;
+    }
+    struct sigaction action {};
+    action.sa_sigaction = &captureSignalHandler;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    return ::sigaction(signal, &action, nullptr) == 0;
+}
+
+bool sendCaptureSignal(pid_t tid, CaptureSlot* slot) {
+    siginfo_t info{};
+    info.si_signo = SIGRTMIN + kStackCaptureSignalOffset;
+    info.si_code = SI_QUEUE;
+    info.si_pid = ::getpid();
+    info.si_uid = ::getuid();
+    info.si_value.sival_ptr = slot;
+    // Same as tgkill() but also carries the slot pointer to the handler.
+    return ::syscall(SYS_rt_tgsigqueueinfo, ::getpid(), tid, info.si_signo, &info) == 0;
+}
+
+void collectSlot(CaptureSlot* slot, NativeStackTrace* stack) {
+    stack->captured = true;
+    stack->frames.assign(slot->frames, slot->frames + slot->depth);
+    slot->state.store(kFree);
+}
+#endif
+
+}  // namespace
+
+std::vector<NativeStackTrace> captureNativeStacks(const std::vector<pid_t>& tids,
+                                                  std::chrono::system_clock::duration timeout) {
+    std::vector<NativeStackTrace> stacks(tids.size());
+    for (size_t i = 0; i < tids.size(); ++i) {
+        stacks[i].tid = tids[i];
+    }
+#ifdef __linux__
+    static const bool handlerInstalled = installHandler();
+    if (!handlerInstalled) {
+        return stacks;
+    }
+    std::lock_guard<std::mutex> lock(captureMutex);
+
+    // Arm one slot per thread and signal it.
+    std::vector<CaptureSlot*> slots(tids.size(), nullptr);
+    size_t nextSlot = 0;
+    for (size_t i = 0; i < tids.size(); ++i) {
+        while (nextSlot < captureSlots.size() && captureSlots[nextSlot].state.load() != kFree) {
+            ++nextSlot;
+        }
+        if (nextSlot >= captureSlots.size()) {
+            break;
+        }
+        CaptureSlot* slot = &captureSlots[nextSlot++];
+        slot->tid.store(tids[i]);
+        slot->state.store(kArmed);
+        if (!sendCaptureSignal(tids[i], slot)) {
+            slot->state.store(kFree);  // Thread exited.
+            continue;
+        }
+        slots[i] = slot;
+    }
+
+    // Wait for the handlers, bounded by the timeout.
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    for (size_t i = 0; i < slots.size(); ++i) {
+        if (slots[i] == nullptr) {
+            continue;
+        }
+        while (slots[i]->state.load() != kDone && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::microseconds{100});
+        }
+        int expected = kArmed;
+        if (slots[i]->state.compare_exchange_strong(expected, kFree)) {
+            continue;  // Timed out before the handler started.
+        }
+        // The handler is running or done, it is short and will finish.
+        while (slots[i]->state.load() != kDone) {
+            std::this_thread::yield();
+        }
+        collectSlot(slots[i], &stacks[i]);
+    }
+#endif
+    return stacks;
+}
+
+std::vector<std::string> symbolizeNativeStack(const NativeStackTrace& stack) {
+    std::vector<std::string> symbols;
+#ifdef __linux__
+    if (stack.frames.empty()) {
+        return symbols;
+    }
+    char** strings = ::backtrace_symbols(stack.frames.data(), static_cast<int>(stack.frames.size()));
+    if (strings == nullptr) {
+        return symbols;
+    }
+    symbols.assign(strings, strings + stack.frames.size());
+    std::free(strings);
+#endif
+    return symbols;
+}
+
+void printNativeStack(const NativeStackTrace& stack) {
+    if (!stack.captured) {
+        std::cerr << "Native stack: tid: " << stack.tid << " not captured" << std::endl;
+        return;
+    }
+    std::cerr << "Native stack: tid: " << stack.tid << std::endl;
+    const auto symbols = symbolizeNativeStack(stack);
+    for (size_t i = 0; i < symbols.size(); ++i) {
+        std::cerr << "  #" << i << " " << symbols[i] << std::endl;
+    }
+}
+
+}  // namespace thread_monitor
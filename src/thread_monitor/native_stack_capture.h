@@ -0,0 +1,55 @@
+// Author: Andrew Shuvalov
+//
+// Documentation: https://github.com/shuvalov-mdb/thread-liveness-monitor
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace thread_monitor {
+
+// The real-time signal used for the capture is `SIGRTMIN + kStackCaptureSignalOffset`.
+static inline constexpr int kStackCaptureSignalOffset = 7;
+// How many threads can be captured in one batch, each has a preallocated slot.
+static inline constexpr size_t kMaxStackCaptures = 64;
+// Frames deeper than this are truncated.
+static inline constexpr int kMaxStackCaptureFrames = 48;
+
+/**
+ * Raw native stack of one thread captured by the signal handler.
+ * The frames are return addresses, they are only symbolized on demand
+ * with `symbolizeNativeStack()` because symbolization allocates.
+ */
+struct NativeStackTrace {
+    pid_t tid = 0;
+    // False if the thread did not handle the signal within the timeout,
+    // exited or the capture is not supported on this platform.
+    bool captured = false;
+    std::vector<void*> frames;
+};
+
+/**
+ * Sends the capture signal to every thread in 'tids' of this process and waits
+ * up to 'timeout' for all of them to run the handler. A thread that is blocked in
+ * the kernel uninterruptibly or masks the signal is reported as not captured.
+ * The result is in the same order as 'tids'. Only the first `kMaxStackCaptures`
+ * threads are signalled, the rest are reported as not captured.
+ *
+ * The handler is installed on the first call, unless the application already
+ * handles the signal, then nothing is captured. It walks the frame pointers of
+ * the interrupted code into a preallocated slot, thus there is no cost until this
+ * is invoked. The stacks are complete only for code built with frame pointers
+ * (`-fno-omit-frame-pointer`), elsewhere they end at the first frame without one.
+ */
+std::vector<NativeStackTrace> captureNativeStacks(const std::vector<pid_t>& tids,
+                                                  std::chrono::system_clock::duration timeout);
+
+std::vector<std::string> symbolizeNativeStack(const NativeStackTrace& stack);
+
+void printNativeStack(const NativeStackTrace& stack);
+
+}  // namespace thread_monitor
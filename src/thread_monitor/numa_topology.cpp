@@ -0,0 +1,110 @@
+#include "thread_monitor/numa_topology.h"
+
+#include <new>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#endif
+
+namespace thread_monitor {
+namespace details {
+
+namespace {
+
+#ifdef __linux__
+// Same value as in <numaif.h>, which is a part of libnuma.
+constexpr int kMpolPreferred = 1;
+
+// Parses the last node of a list like "0" or "0-1,3".
+uint32_t readNodeCount() {
+    const int fd = ::open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 1;
+    }
+    char buffer[256];
+    const ssize_t size = ::read(fd, buffer, sizeof(buffer) - 1);
+    ::close(fd);
+    if (size <= 0) {
+        return 1;
+    }
+    buffer[size] = '\0';
+    uint32_t lastNode = 0;
+    for (const char* p = buffer; *p != '\0';) {
+        char* end;
+        const long node = std::strtol(p, &end, 10);
+        if (end == p) {
+            ++p;
+            continue;
+        }
+        lastNode = static_cast<uint32_t>(node);
+        p = end;
+    }
+    return lastNode + 1;
+}
+#endif
+
+}  // namespace
+
+uint32_t numaNodeCount() {
+#ifdef __linux__
+    static const uint32_t count = readNodeCount();
+    return count;
+#else
+    return 1;
+#endif
+}
+
+uint32_t currentNumaNode() {
+#ifdef __linux__
+    unsigned int cpu = 0;
+    unsigned int node = 0;
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 29)
+    // Served by the vDSO, no system call.
+    if (::getcpu(&cpu, &node) != 0) {
+        return 0;
+    }
+#else
+    if (::syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) {
+        return 0;
+    }
+#endif
+    return node < numaNodeCount() ? node : 0;
+#else
+    return 0;
+#endif
+}
+
+void* allocateOnNumaNode(size_t size, uint32_t node) {
+#ifdef __linux__
+    void* memory =
+        ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+    if (numaNodeCount() > 1 && node < 64) {
+        // The pages are not touched yet, they will be faulted in on the node.
+        const unsigned long nodeMask = 1ul << node;
+        ::syscall(SYS_mbind, memory, size, kMpolPreferred, &nodeMask, sizeof(nodeMask) * 8 + 1, 0);
+    }
+    return memory;
+#else
+    return ::operator new(size, std::align_val_t{64});
+#endif
+}
+
+void freeOnNumaNode(void* memory, size_t size) {
+#ifdef __linux__
+    ::munmap(memory, size);
+#else
+    ::operator delete(memory, std::align_val_t{64});
+#endif
+}
+
+}  // namespace details
+}  // namespace thread_monitor
@@ -0,0 +1,31 @@
+// Author: Andrew Shuvalov
+//
+// Documentation: https://github.com/shuvalov-mdb/thread-liveness-monitor
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace thread_monitor {
+namespace details {
+
+/**
+ * Count of NUMA nodes, 1 if unknown or not supported. Read once.
+ */
+uint32_t numaNodeCount();
+
+/**
+ * The NUMA node of the CPU the calling thread runs on, 0 if unknown.
+ */
+uint32_t currentNumaNode();
+
+/**
+ * Maps 'size' bytes preferably placed on the NUMA 'node'. Falls back to the heap
+ * on other platforms.
+ */
+void* allocateOnNumaNode(size_t size, uint32_t node);
+void freeOnNumaNode(void* memory, size_t size);
+
+}  // namespace details
+}  // namespace thread_monitor
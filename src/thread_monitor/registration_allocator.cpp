@@ -0,0 +1,94 @@
+#include "thread_monitor/registration_allocator.h"
+
+#include <algorithm>
+#include <iterator>
+
+#include "thread_monitor/huge_page_memory.h"
+
+namespace thread_monitor {
+namespace details {
+
+namespace {
+
+// Blocks carved from the region start on separate cache lines.
+constexpr size_t kBlockAlignment = 64;
+
+size_t alignUp(size_t size) {
+    return (size + kBlockAlignment - 1) / kBlockAlignment * kBlockAlignment;
+}
+
+}  // namespace
+
+RegistrationArena::~RegistrationArena() {
+    for (const auto& region : _regions) {
+        unmapHugePageMemory(region.begin, region.end - region.begin);
+    }
+}
+
+void RegistrationArena::reserve(size_t bytes) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    size_t available = 0;
+    for (const auto& region : _regions) {
+        available += region.end - region.cursor;
+    }
+    if (available >= bytes) {
+        return;
+    }
+    bytes = (bytes - available + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+    auto* begin = static_cast<char*>(mapHugePageMemory(bytes));
+    const Region region{begin, begin + bytes, begin};
+    _regions.insert(std::upper_bound(_regions.begin(),
+                                     _regions.end(),
+                                     region,
+                                     [](const Region& a, const Region& b) {
+                                         return a.begin < b.begin;
+                                     }),
+                    region);
+    _reserved = true;
+}
+
+void* RegistrationArena::allocate(size_t bytes) {
+    if (_reserved.load(std::memory_order_relaxed)) {
+        const size_t size = alignUp(bytes);
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _freeBlocks.find(size);
+        if (it != _freeBlocks.end()) {
+            void* memory = it->second;
+            _freeBlocks.erase(it);
+            return memory;
+        }
+        // Carve from the first region with room, the tails of the older regions
+        // are not wasted.
+        for (auto& region : _regions) {
+            if (static_cast<size_t>(region.end - region.cursor) >= size) {
+                void* memory = region.cursor;
+                region.cursor += size;
+                return memory;
+            }
+        }
+    }
+    return ::operator new(bytes);
+}
+
+void RegistrationArena::deallocate(void* memory, size_t bytes) {
+    if (_reserved.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_isReserved(memory)) {
+            _freeBlocks.emplace(alignUp(bytes), memory);
+            return;
+        }
+    }
+    ::operator delete(memory);
+}
+
+bool RegistrationArena::_isReserved(void* memory) const {
+    // The last region starting at or before 'memory'.
+    auto it = std::upper_bound(_regions.begin(),
+                               _regions.end(),
+                               static_cast<char*>(memory),
+                               [](char* address, const Region& r) { return address < r.begin; });
+    return it != _regions.begin() && memory < std::prev(it)->end;
+}
+
+}  // namespace details
+}  // namespace thread_monitor
@@ -0,0 +1,107 @@
+// Author: Andrew Shuvalov
+//
+// Documentation: https://github.com/shuvalov-mdb/thread-liveness-monitor
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+namespace thread_monitor {
+namespace details {
+
+/**
+ * Registration memory of one monitor domain. Until `reserve()` the colony blocks
+ * are allocated on the heap without locking. Afterwards they are carved from the
+ * reserved huge page regions until those are exhausted, then they are allocated
+ * on the heap again. The released reserved blocks are kept for reuse by the
+ * blocks of the same size. The regions are unmapped with the arena, after all
+ * the colonies of the domain are destroyed.
+ */
+class RegistrationArena {
+public:
+    RegistrationArena() = default;
+    ~RegistrationArena();
+    RegistrationArena(const RegistrationArena&) = delete;
+    RegistrationArena& operator=(const RegistrationArena&) = delete;
+
+    /**
+     * Makes at least 'bytes' available for the following blocks. The space left
+     * in the regions counts, only the remainder is mapped as a new huge page
+     * region.
+     */
+    void reserve(size_t bytes);
+
+    void* allocate(size_t bytes);
+    void deallocate(void* memory, size_t bytes);
+
+private:
+    struct Region {
+        char* begin;
+        char* end;
+        // Bump pointer, the blocks are carved below it.
+        char* cursor;
+    };
+
+    // Precondition: invoked under '_mutex'.
+    bool _isReserved(void* memory) const;
+
+    // Only set after the first reservation.
+    std::atomic<bool> _reserved{false};
+    std::mutex _mutex;
+    // Sorted by the address.
+    std::vector<Region> _regions;
+    // Released blocks by size.
+    std::multimap<size_t, void*> _freeBlocks;
+};
+
+/**
+ * Colony allocator for `ThreadRegistration` blocks of the domain 'arena', the
+ * heap if it is nullptr. The allocators of the same arena are equal, thus the
+ * blocks can be spliced between the colonies of the domain.
+ */
+template <typename T>
+struct RegistrationAllocator {
+    using value_type = T;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    explicit RegistrationAllocator(RegistrationArena* registrationArena = nullptr) noexcept
+        : arena(registrationArena) {}
+    template <typename U>
+    RegistrationAllocator(const RegistrationAllocator<U>& other) noexcept : arena(other.arena) {}
+
+    T* allocate(size_t n) {
+        if (arena != nullptr) {
+            return static_cast<T*>(arena->allocate(n * sizeof(T)));
+        }
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n) noexcept {
+        if (arena != nullptr) {
+            arena->deallocate(p, n * sizeof(T));
+        } else {
+            ::operator delete(p);
+        }
+    }
+
+    template <typename U>
+    bool operator==(const RegistrationAllocator<U>& other) const noexcept {
+        return arena == other.arena;
+    }
+    template <typename U>
+    bool operator!=(const RegistrationAllocator<U>& other) const noexcept {
+        return arena != other.arena;
+    }
+
+    RegistrationArena* arena;
+};
+
+}  // namespace details
+}  // namespace thread_monitor
@@ -0,0 +1,171 @@
+// Author: Andrew Shuvalov
+//
+// Documentation: https://github.com/shuvalov-mdb/thread-liveness-monitor
+
+#pragma once
+
+#include <time.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <thread>
+
+// The colony clears itself up to its allocators with offsetof(), which GCC and
+// Clang support for the non-standard-layout colony of a stateful allocator.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winvalid-offsetof"
+#include "third_party/plf_colony/plf_colony.h"
+#pragma GCC diagnostic pop
+#include "thread_monitor/registration_allocator.h"
+#include "thread_monitor/virtual_clock.h"
+
+namespace thread_monitor {
+
+/**
+ * Compile-time policies of `BasicThreadMonitorCentralRepository`. The defaults
+ * in `DefaultRepositoryPolicy` are the production choice, the others exist to
+ * measure the trade-offs on the target hardware, see the benchmarks.
+ */
+namespace policy {
+
+/**
+ * Clock of the monitor cycle: the scan start, the staleness thresholds and the
+ * fault rate limit. The monitors always stamp the checkpoints with
+ * `std::chrono::system_clock`, thus the clocks must return its time points.
+ * Both clocks follow the `VirtualClock` when it is built and installed.
+ */
+struct SystemClock {
+    static std::chrono::system_clock::time_point now() {
+        return details::clockNow();
+    }
+};
+
+/**
+ * The kernel tick resolution (1-4 ms) without the TSC read, which is plenty for
+ * the timeouts measured in seconds. The monitor cycle compares it with the
+ * checkpoint timestamps taken with the fine clock, thus it can lag behind the
+ * last checkpoint by a tick; the cycle clamps the negative staleness to zero.
+ */
+struct CoarseSystemClock {
+    static std::chrono::system_clock::time_point now() {
+#ifdef THREAD_MONITOR_VIRTUAL_CLOCK
+        if (details::virtualClockState.installed.load(std::memory_order_relaxed)) {
+            return details::virtualClockState.now.load(std::memory_order_relaxed);
+        }
+#endif
+#ifdef CLOCK_REALTIME_COARSE
+        struct timespec ts;
+        ::clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+        return std::chrono::system_clock::time_point(
+            std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                std::chrono::seconds{ts.tv_sec} + std::chrono::nanoseconds{ts.tv_nsec}));
+#else
+        return std::chrono::system_clock::now();
+#endif
+    }
+};
+
+/**
+ * Shard lock that spins instead of parking the thread, the shard critical
+ * sections are short except for the monitor cycle scan.
+ */
+class SpinLock {
+public:
+    void lock() {
+        while (_locked.exchange(true, std::memory_order_acquire)) {
+            while (_locked.load(std::memory_order_relaxed)) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    bool try_lock() {
+        return !_locked.load(std::memory_order_relaxed) &&
+            !_locked.exchange(true, std::memory_order_acquire);
+    }
+
+    void unlock() {
+        _locked.store(false, std::memory_order_release);
+    }
+
+private:
+    std::atomic<bool> _locked{false};
+};
+
+/**
+ * No shard locking at all. Only valid when the repository has no monitor
+ * thread and is used by a single thread, e.g. in unit tests and simulations.
+ */
+struct NoLock {
+    void lock() {}
+    bool try_lock() {
+        return true;
+    }
+    void unlock() {}
+};
+
+/**
+ * Shard container of the registrations, must keep the element pointers stable.
+ * `plf::colony` allocates the registrations in blocks and reuses the erased slots.
+ */
+struct ColonyContainer {
+    template <typename T>
+    using Type = plf::colony<T, details::RegistrationAllocator<T>>;
+
+    // Skipfield entry per element.
+    static inline constexpr size_t kElementOverhead = sizeof(uint16_t);
+};
+
+/**
+ * A node per registration, every registration allocates. The adapter provides
+ * the subset of the colony interface used by the repository.
+ */
+struct ListContainer {
+    template <typename T>
+    class Type : public std::list<T, details::RegistrationAllocator<T>> {
+    public:
+        using Base = std::list<T, details::RegistrationAllocator<T>>;
+        using Base::Base;
+
+        template <typename... Args>
+        typename Base::iterator emplace(Args&&... args) {
+            return Base::emplace(Base::end(), std::forward<Args>(args)...);
+        }
+
+        // Always full, the registration allocates the node outside of the lock.
+        size_t capacity() const {
+            return Base::size();
+        }
+
+        void reserve(size_t) {}
+        void trim() {}
+
+        void splice(Type& other) {
+            Base::splice(Base::end(), other);
+        }
+    };
+
+    // Previous and next pointers.
+    static inline constexpr size_t kElementOverhead = 2 * sizeof(void*);
+};
+
+}  // namespace policy
+
+/**
+ * Bundles the policies as one template argument.
+ */
+template <typename ClockPolicy, typename ShardLockPolicy, typename ContainerPolicy>
+struct RepositoryPolicy {
+    using Clock = ClockPolicy;
+    using ShardLock = ShardLockPolicy;
+    using Container = ContainerPolicy;
+};
+
+using DefaultRepositoryPolicy =
+    RepositoryPolicy<policy::SystemClock, std::mutex, policy::ColonyContainer>;
+
+}  // namespace thread_monitor
@@ -0,0 +1,158 @@
+#include "thread_monitor/thread_counters.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace thread_monitor {
+
+namespace {
+
+#ifdef __linux__
+int openCounter(pid_t tid, uint32_t type, uint64_t config) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    // Required with the default `perf_event_paranoid` of 2.
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return static_cast<int>(::syscall(SYS_perf_event_open, &attr, tid, -1, -1,
+                                      PERF_FLAG_FD_CLOEXEC));
+}
+
+// Without the PMU, e.g. in most VMs, the hardware counter is not retried.
+std::atomic<bool> hardwareCounterUnsupported{false};
+
+uint64_t readCounter(int fd) {
+    uint64_t value = 0;
+    if (fd < 0 || ::read(fd, &value, sizeof(value)) != sizeof(value)) {
+        return 0;
+    }
+    return value;
+}
+#endif
+
+}  // namespace
+
+const char* toString(ThreadActivity activity) {
+    switch (activity) {
+        case ThreadActivity::kUnknown:
+            return "unknown";
+        case ThreadActivity::kSpinning:
+            return "spinning";
+        case ThreadActivity::kStalled:
+            return "stalled";
+        case ThreadActivity::kIdle:
+            return "idle";
+    }
+    return "unknown";
+}
+
+void printThreadCounterReport(const ThreadCounterReport& report) {
+    if (report.activity == ThreadActivity::kUnknown) {
+        return;
+    }
+    std::cerr << "Activity: " << toString(report.activity) << " cpu: "
+              << std::chrono::duration_cast<std::chrono::microseconds>(report.cpuTimeDelta).count()
+              << " us of "
+              << std::chrono::duration_cast<std::chrono::microseconds>(report.interval).count()
+              << " us";
+    if (report.hardware) {
+        std::cerr << " instructions: " << report.instructionsDelta;
+    }
+    std::cerr << std::endl;
+}
+
+namespace details {
+
+ThreadActivity classifyThreadActivity(std::chrono::nanoseconds interval,
+                                      std::chrono::nanoseconds cpuTimeDelta,
+                                      uint64_t instructionsDelta,
+                                      bool hardware) {
+    if (interval <= std::chrono::nanoseconds::zero()) {
+        return ThreadActivity::kUnknown;
+    }
+    if (cpuTimeDelta.count() < interval.count() * ThreadCounters::kIdleCpuShare) {
+        return ThreadActivity::kIdle;
+    }
+    if (hardware &&
+        instructionsDelta < cpuTimeDelta.count() * ThreadCounters::kStalledInstructionsPerNano) {
+        return ThreadActivity::kStalled;
+    }
+    return ThreadActivity::kSpinning;
+}
+
+std::unique_ptr<ThreadCounters> ThreadCounters::open(pid_t tid,
+                                                     std::chrono::system_clock::time_point now) {
+#ifdef __linux__
+    if (tid == 0) {
+        return nullptr;  // Would count the calling thread.
+    }
+    const int taskClockFd = openCounter(tid, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK);
+    if (taskClockFd < 0) {
+        return nullptr;
+    }
+    int instructionsFd = -1;
+    if (!hardwareCounterUnsupported.load(std::memory_order_relaxed)) {
+        instructionsFd = openCounter(tid, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        if (instructionsFd < 0 && (errno == ENOENT || errno == EOPNOTSUPP)) {
+            hardwareCounterUnsupported = true;
+        }
+    }
+    return std::unique_ptr<ThreadCounters>(new ThreadCounters(taskClockFd, instructionsFd, now));
+#else
+    return nullptr;
+#endif
+}
+
+ThreadCounters::ThreadCounters(int taskClockFd,
+                               int instructionsFd,
+                               std::chrono::system_clock::time_point now)
+    : _taskClockFd(taskClockFd), _instructionsFd(instructionsFd), _readAt(now) {}
+
+ThreadCounters::~ThreadCounters() {
+#ifdef __linux__
+    ::close(_taskClockFd);
+    if (_instructionsFd >= 0) {
+        ::close(_instructionsFd);
+    }
+#endif
+}
+
+ThreadCounterReport ThreadCounters::read(std::chrono::system_clock::time_point now) {
+#ifdef __linux__
+    if (now - _readAt < kMinReadInterval) {
+        return lastReport();
+    }
+    // The syscalls are outside of the report lock.
+    const uint64_t taskClock = readCounter(_taskClockFd);
+    const uint64_t instructions = readCounter(_instructionsFd);
+    ThreadCounterReport report;
+    report.interval = now - _readAt;
+    report.cpuTimeDelta = std::chrono::nanoseconds{taskClock - _taskClock};
+    report.instructionsDelta = instructions - _instructions;
+    report.hardware = hasHardwareCounter();
+    report.activity = classifyThreadActivity(report.interval, report.cpuTimeDelta,
+                                             report.instructionsDelta, report.hardware);
+    _taskClock = taskClock;
+    _instructions = instructions;
+    _readAt = now;
+    std::lock_guard<std::mutex> lock(_reportMutex);
+    _report = report;
+    return report;
+#else
+    return lastReport();
+#endif
+}
+
+}  // namespace details
+}  // namespace thread_monitor
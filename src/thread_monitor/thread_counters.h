@@ -0,0 +1,112 @@
+// Author: Andrew Shuvalov
+//
+// Documentation: https://github.com/shuvalov-mdb/thread-liveness-monitor
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+namespace thread_monitor {
+
+/**
+ * What a stale thread was doing between two reads of its counters.
+ */
+enum class ThreadActivity {
+    // Never read, or the counters are not available.
+    kUnknown,
+    // On the CPU and retiring instructions: livelock or endless loop.
+    kSpinning,
+    // On the CPU but retiring almost no user space instructions: the time goes
+    // to the kernel, page faults or memory stalls. Only with the hardware counter.
+    kStalled,
+    // Off the CPU: deadlock, lock wait or I/O.
+    kIdle,
+};
+
+struct ThreadCounterReport {
+    ThreadActivity activity = ThreadActivity::kUnknown;
+    // Since the previous read, or since the registration.
+    std::chrono::nanoseconds interval{0};
+    std::chrono::nanoseconds cpuTimeDelta{0};
+    // User space instructions retired, only with the hardware counter.
+    uint64_t instructionsDelta = 0;
+    bool hardware = false;
+};
+
+const char* toString(ThreadActivity activity);
+
+void printThreadCounterReport(const ThreadCounterReport& report);
+
+namespace details {
+
+/**
+ * Per thread `perf_event_open` counters, opened when the thread registers with a
+ * domain with the counters enabled: the task clock, a software counter available
+ * without the PMU access, and the user space instructions retired when the PMU
+ * is accessible. The counters run in the kernel, nothing is read on the
+ * checkpoint path. The monitor cycle reads them only for the stale threads.
+ */
+class ThreadCounters {
+public:
+    // Below this share of the interval on the CPU the thread is idle.
+    static inline constexpr double kIdleCpuShare = 0.05;
+    // Below this many instructions per nanosecond on the CPU the thread is stalled.
+    static inline constexpr double kStalledInstructionsPerNano = 0.05;
+    // The shorter reads are skipped, the previous report is kept.
+    static inline constexpr auto kMinReadInterval = std::chrono::milliseconds{10};
+
+    /**
+     * Opens the counters of the thread 'tid' of this process. Returns nullptr if
+     * even the software counter is not available, e.g. with the
+     * `perf_event_paranoid` of 3 or under seccomp.
+     */
+    static std::unique_ptr<ThreadCounters> open(pid_t tid,
+                                                std::chrono::system_clock::time_point now);
+
+    ~ThreadCounters();
+
+    ThreadCounters(const ThreadCounters&) = delete;
+    ThreadCounters& operator=(const ThreadCounters&) = delete;
+
+    bool hasHardwareCounter() const {
+        return _instructionsFd >= 0;
+    }
+
+    /**
+     * Reads the counters and updates the report with the deltas since the
+     * previous read, unless it was less than `kMinReadInterval` ago.
+     * Precondition: the reads are serialized by the domain owning the counters,
+     * the report may be taken concurrently.
+     */
+    ThreadCounterReport read(std::chrono::system_clock::time_point now);
+
+    ThreadCounterReport lastReport() const {
+        std::lock_guard<std::mutex> lock(_reportMutex);
+        return _report;
+    }
+
+private:
+    ThreadCounters(int taskClockFd, int instructionsFd, std::chrono::system_clock::time_point now);
+
+    const int _taskClockFd;
+    const int _instructionsFd;
+    uint64_t _taskClock = 0;
+    uint64_t _instructions = 0;
+    std::chrono::system_clock::time_point _readAt;
+    // Guards the report published by `read()`.
+    mutable std::mutex _reportMutex;
+    ThreadCounterReport _report;
+};
+
+ThreadActivity classifyThreadActivity(std::chrono::nanoseconds interval,
+                                      std::chrono::nanoseconds cpuTimeDelta,
+                                      uint64_t instructionsDelta,
+                                      bool hardware);
+
+}  // namespace details
+}  // namespace thread_monitor
@@ -0,0 +1,85 @@
+#include "thread_monitor/thread_history_arena.h"
+
+#include <algorithm>
+#include <new>
+
+#include "thread_monitor/huge_page_memory.h"
+#include "thread_monitor/virtual_clock.h"
+
+namespace thread_monitor {
+namespace details {
+
+namespace {
+
+// Slots start on separate cache lines, the rings are written by different threads.
+constexpr size_t kSlotAlignment = 64;
+
+size_t alignUp(size_t size, size_t alignment) {
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+}  // namespace
+
+ThreadHistorySlot* ThreadHistoryArena::acquire(pid_t tid, uint32_t bytes) {
+    ThreadHistorySlot* slot = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = std::find_if(_freeSlots.begin(), _freeSlots.end(), [bytes](auto* s) {
+            return s->ring.size() == bytes;
+        });
+        if (it != _freeSlots.end()) {
+            slot = *it;
+            _freeSlots.erase(it);
+        } else {
+            void* memory = _allocate(alignUp(sizeof(ThreadHistorySlot), kSlotAlignment) +
+                                     alignUp(bytes, kSlotAlignment));
+            auto* ringBytes = reinterpret_cast<std::atomic<uint8_t>*>(
+                static_cast<char*>(memory) + alignUp(sizeof(ThreadHistorySlot), kSlotAlignment));
+            slot = new (memory) ThreadHistorySlot(ringBytes, bytes);
+            _slots.push_back(slot);
+        }
+    }
+    // The previous owner has exited, this thread is the only writer now.
+    slot->ring.clear();
+    slot->epoch = clockNow();
+    slot->tid = tid;
+    return slot;
+}
+
+void ThreadHistoryArena::release(ThreadHistorySlot* slot) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    slot->tid = 0;
+    _freeSlots.push_back(slot);
+}
+
+std::vector<ThreadHistorySlot*> ThreadHistoryArena::slots() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _slots;
+}
+
+size_t ThreadHistoryArena::mappedBytes() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _mappedBytes;
+}
+
+void* ThreadHistoryArena::_allocate(size_t size) {
+    if (size > kChunkSize) {
+        // Very deep history, the slot gets its own mapping.
+        const size_t mapped = alignUp(size, kChunkSize);
+        _mappedBytes += mapped;
+        return mapHugePageMemory(mapped);
+    }
+    if (size > _chunkRemaining) {
+        // The tail of the previous chunk is wasted.
+        _chunkCursor = static_cast<char*>(mapHugePageMemory(kChunkSize));
+        _chunkRemaining = kChunkSize;
+        _mappedBytes += kChunkSize;
+    }
+    void* memory = _chunkCursor;
+    _chunkCursor += size;
+    _chunkRemaining -= size;
+    return memory;
+}
+
+}  // namespace details
+}  // namespace thread_monitor
@@ -0,0 +1,84 @@
+// Author: Andrew Shuvalov
+//
+// Documentation: https://github.com/shuvalov-mdb/thread-liveness-monitor
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+#include "thread_monitor/encoded_history_ring.h"
+
+namespace thread_monitor {
+namespace details {
+
+/**
+ * History ring of one OS thread, leased from `ThreadHistoryArena`. All monitors
+ * created by the thread append to the same ring, thus the history of the
+ * previous monitor is still there when the next one reports a fault.
+ * The slot memory is never freed, any thread can decode the ring at any time.
+ */
+struct ThreadHistorySlot {
+    ThreadHistorySlot(std::atomic<uint8_t>* bytes, uint32_t size) : ring(bytes, size) {}
+
+    // Kernel id of the owner thread, 0 if the slot is free. A free slot keeps
+    // the history of the exited thread until it is leased again.
+    std::atomic<pid_t> tid{0};
+    // The ring times are durations from this timestamp.
+    std::atomic<std::chrono::system_clock::time_point> epoch;
+    EncodedHistoryRing ring;
+};
+
+/**
+ * Allocates `ThreadHistorySlot` instances from 2 MB chunks mapped with huge pages
+ * when available. The chunks are never unmapped, the released slots are reused
+ * by new threads with the same ring size.
+ */
+class ThreadHistoryArena {
+public:
+    static inline constexpr size_t kChunkSize = 2 * 1024 * 1024;  // One huge page.
+
+    ThreadHistoryArena() = default;
+    ThreadHistoryArena(const ThreadHistoryArena&) = delete;
+    ThreadHistoryArena& operator=(const ThreadHistoryArena&) = delete;
+
+    /**
+     * Leases a slot with a ring of 'bytes' to the thread 'tid'. The ring is empty
+     * and its epoch is now.
+     */
+    ThreadHistorySlot* acquire(pid_t tid, uint32_t bytes);
+
+    /**
+     * Returns the slot to the free list, the history is kept until it is leased again.
+     */
+    void release(ThreadHistorySlot* slot);
+
+    /**
+     * All slots ever allocated, leased and free.
+     */
+    std::vector<ThreadHistorySlot*> slots() const;
+
+    /**
+     * Total size of the mapped chunks.
+     */
+    size_t mappedBytes() const;
+
+private:
+    // Precondition: invoked under '_mutex'.
+    void* _allocate(size_t size);
+
+    mutable std::mutex _mutex;
+    char* _chunkCursor = nullptr;
+    size_t _chunkRemaining = 0;
+    size_t _mappedBytes = 0;
+    std::vector<ThreadHistorySlot*> _slots;
+    std::vector<ThreadHistorySlot*> _freeSlots;
+};
+
+}  // namespace details
+}  // namespace thread_monitor
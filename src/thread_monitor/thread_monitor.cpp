@@ -1,5 +1,6 @@
 #include "thread_monitor/thread_monitor.h"
 
+#include <algorithm>
 #include <cassert>
 #include <iomanip>
 #include <iostream>
@@ -12,49 +13,149 @@ namespace details {
 // too many very close checkpoints.
 static constexpr auto kHistoryResolution = std::chrono::microseconds{10};
 
+// The scope records pair up and the progress checkpoints are looked for by the
+// livelock detection, neither is replaced by a close checkpoint nor replaces one.
+constexpr bool isMergeableCheckpoint(uint32_t id) {
+    return !isScopeCheckpoint(id) && !isProgressCheckpoint(id);
+}
+
 #ifndef NDEBUG
 std::atomic<uint64_t> ThreadMonitorBase::_globalSequence;
+
+namespace {
+// See `liveMonitorCount()`.
+std::atomic<uint32_t> liveMonitors{0};
+}  // namespace
+#endif
+
+MonitoringSwitch monitoringSwitch;
+
+uint32_t liveMonitorCount() {
+#ifndef NDEBUG
+    return liveMonitors.load();
+#else
+    return 0;
 #endif
+}
 
+#ifndef THREAD_MONITOR_DISABLED
 namespace {
 thread_local ThreadMonitorBase* threadLocalPtr = nullptr;
+
+// Returns the history slot to the arena when the thread exits.
+struct ThreadHistoryLease {
+    ThreadHistorySlot* slot = nullptr;
+
+    ~ThreadHistoryLease() {
+        if (slot != nullptr) {
+            ThreadMonitorCentralRepository::threadHistoryArena().release(slot);
+        }
+    }
+};
+thread_local ThreadHistoryLease threadHistoryLease;
+
+// Count of the live `CheckpointScope` instances of this thread.
+thread_local uint32_t scopeNesting = 0;
 }  // namespace
 
-ThreadMonitorBase::ThreadMonitorBase(const char* const name,
+ThreadHistorySlot* currentThreadHistorySlot() {
+    const uint32_t bytes =
+        ThreadMonitorCentralRepository::threadHistoryDepth() * kEncodedBytesPerRecord;
+    auto& lease = threadHistoryLease;
+    // Only the outermost monitor of the thread leases, thus no other monitor
+    // writes to the slot and it can be replaced when the depth has changed.
+    if (lease.slot != nullptr && lease.slot->ring.size() == bytes) {
+        return lease.slot;
+    }
+    auto& arena = ThreadMonitorCentralRepository::threadHistoryArena();
+    if (lease.slot != nullptr) {
+        arena.release(lease.slot);
+    }
+    lease.slot = arena.acquire(currentKernelThreadId(), bytes);
+    return lease.slot;
+}
+
+ThreadMonitorBase::ThreadMonitorBase(MonitorDomain* domain,
+                                     const char* const name,
                                      InternalHistoryRecord* historyPtr,
+                                     std::atomic<uint64_t>* payloadPtr,
+                                     EncodedHistoryRing* encodedHistory,
+                                     bool leasesThreadHistory,
+                                     CheckpointImpl checkpointImpl,
                                      uint32_t historyDepth,
                                      uint32_t firstCheckpointId,
-                                     bool enabled)
-    : _name(name ? name : "default"), _historyPtr(historyPtr),
-      _historyDepth(historyDepth), _enabled(enabled) {
+                                     bool enabled,
+                                     std::thread::id simulatedThreadId)
+    : _name(name ? name : "default"), _historyPtr(historyPtr), _payloadPtr(payloadPtr),
+      _encodedHistory(encodedHistory), _historyDepth(historyDepth),
+      _checkpointImpl(checkpointImpl),
+      _simulated(simulatedThreadId != std::thread::id()),
+      _threadId(_simulated ? simulatedThreadId : std::this_thread::get_id()),
+      _enabled(enabled) {
     if (!_enabled) {
         return;  // Initially disabled.
     }
-    _maybeRegisterThreadLocal();
+    if (!_simulated) {
+        _maybeRegisterThreadLocal();
+    }
     if (!_enabled) {
         return;  // Another instance exists up the stack.
     }
-    checkpointInternalImpl(firstCheckpointId);
-    auto* const centralRepo = ThreadMonitorCentralRepository::instance();
-    _registration = centralRepo->registerThread(
-        _threadId, this, _creationTimestamp + _historyPtr[0].durationFromCreation.load());
+    if (leasesThreadHistory) {
+        _threadHistory = currentThreadHistorySlot();
+        _encodedHistory = &_threadHistory->ring;
+        _historyDepth = _threadHistory->ring.size() / kEncodedBytesPerRecord;
+        _historyEpoch = _threadHistory->epoch.load();
+    }
+    if (_encodedHistory != nullptr) {
+        // Never merged, the arena ring may end with the previous monitor checkpoints.
+        _encodedHistory->append(firstCheckpointId, _creationTimestamp - _historyEpoch);
+    } else {
+        checkpointInternalImpl(firstCheckpointId);
+    }
+    MonitorDomain* const centralRepo =
+        domain != nullptr ? domain : ThreadMonitorCentralRepository::instance();
+    // The first checkpoint is at the creation time.
+    _registration = centralRepo->registerThread(_threadId,
+                                                _simulated ? 0 : currentKernelThreadId(),
+                                                this,
+                                                _threadHistory,
+                                                _creationTimestamp);
     _centralRepoUpdateInterval = centralRepo->reportingInterval();
+    if (centralRepo->isCooperative()) {
+        _cooperativeDomain = centralRepo;
+    }
+#ifndef NDEBUG
+    liveMonitors.fetch_add(1, std::memory_order_relaxed);
+#endif
 }
 
 ThreadMonitorBase::~ThreadMonitorBase() {
     if (!_enabled) {
         return;
     }
-    // Invariant: we are in the same thread where the registration happened.
-    assert(threadLocalPtr == this);
-
-    threadLocalPtr = nullptr;
+    if (!_simulated) {
+        // Invariant: we are in the same thread where the registration happened.
+        assert(threadLocalPtr == this);
+        threadLocalPtr = nullptr;
+    }
 
-    std::lock_guard<std::mutex> lock(_registration->monitorDeletionMutex);
     // The registration garbage collector will pick up the deleted registration.
-    _registration->monitor = nullptr;
-    _registration->lastSeenAlive = std::chrono::system_clock::time_point::max();
+    MonitorDomain::deregisterThread(_registration);
+#ifndef NDEBUG
+    liveMonitors.fetch_sub(1, std::memory_order_relaxed);
+#endif
+}
+
+void ThreadMonitorBase::_maybeRegisterThreadLocal() {
+    if (threadLocalPtr != nullptr) {
+        _enabled = false;
+        return;  // Not registering, previously registered up-stack.
+    }
+    threadLocalPtr = this;
+    _enabled = true;
 }
+#endif  // THREAD_MONITOR_DISABLED
 
 bool ThreadMonitorBase::isEnabled() const {
     return _enabled;
@@ -68,28 +169,34 @@ unsigned int ThreadMonitorBase::depth() const {
     return _historyDepth;
 }
 
-void ThreadMonitorBase::_maybeRegisterThreadLocal() {
-    if (threadLocalPtr != nullptr) {
-        _enabled = false;
-        return;  // Not registering, previously registered up-stack.
+void ThreadMonitorBase::setProgressWindow(std::chrono::system_clock::duration window) {
+    if (!_enabled) {
+        return;
     }
-    threadLocalPtr = this;
-    _enabled = true;
+    _registration->progressWindow = window;
 }
 
-void ThreadMonitorBase::checkpointInternalImpl(uint32_t id) {
+void ThreadMonitorBase::checkpointInternalImpl(uint32_t id, uint64_t payload) {
     if (!_enabled) {
         return;
     }
 #ifndef NDEBUG
     // The thread ID is consistent (check only in debug mode).
-    assert(_threadId == std::this_thread::get_id());
+    assert(_simulated || _threadId == std::this_thread::get_id());
 #endif
+    ++_checkpointCount;
+    (this->*_checkpointImpl)(id, payload);
+}
 
+template <bool WithPayload>
+void ThreadMonitorBase::_recordCheckpointImpl(uint32_t id, uint64_t payload) {
     if (_headHistoryRecord == _historyDepth) {
         // Very first checkpoint (inserted from constructor).
         _historyPtr[0].checkpointId = id;
         _historyPtr[0].durationFromCreation = std::chrono::system_clock::duration::zero();
+        if constexpr (WithPayload) {
+            _payloadPtr[0].store(payload, std::memory_order_relaxed);
+        }
 #ifndef NDEBUG
         _historyPtr[0].sequence = ++_globalSequence;
 #endif
@@ -98,13 +205,13 @@ void ThreadMonitorBase::checkpointInternalImpl(uint32_t id) {
         return;
     }
 
-    const auto now = std::chrono::system_clock::now();
-    if ((now - _creationTimestamp) -
-            _historyPtr[_tailHistoryRecord.load()].durationFromCreation.load() <
-        kHistoryResolution) {
+    const auto now = clockNow();
+    const InternalHistoryRecord& last = _historyPtr[_tailHistoryRecord.load()];
+    if ((now - _creationTimestamp) - last.durationFromCreation.load() < kHistoryResolution &&
+        isMergeableCheckpoint(id) && isMergeableCheckpoint(last.checkpointId.load())) {
         // We do not pollute the history with very close values. Instead, replace
         // the last one. This optimization did not affect the benchmarks.
-        writeCheckpointAtPosition(_tailHistoryRecord.load(), id, now);
+        writeCheckpointAtPosition<WithPayload>(_tailHistoryRecord.load(), id, payload, now);
         maybeUpdateCentralRepository(now);
         return;
     }
@@ -126,26 +233,54 @@ void ThreadMonitorBase::checkpointInternalImpl(uint32_t id) {
         }
     }
     // 2. Write next record without advancing the tail.
-    writeCheckpointAtPosition(nextIndex, id, now);
+    writeCheckpointAtPosition<WithPayload>(nextIndex, id, payload, now);
     // 3. Advance the tail to point to the new record.
     _tailHistoryRecord = nextIndex;
     maybeUpdateCentralRepository(now);
 }
 
+void ThreadMonitorBase::_encodedCheckpointImpl(uint32_t id, uint64_t) {
+    const auto now = clockNow();
+    const auto durationFromEpoch = now - _historyEpoch;
+    if (durationFromEpoch - _encodedHistory->lastDuration() < kHistoryResolution &&
+        isMergeableCheckpoint(id) && isMergeableCheckpoint(_encodedHistory->lastId())) {
+        _encodedHistory->replaceLast(id, durationFromEpoch);
+    } else {
+        _encodedHistory->append(id, durationFromEpoch);
+    }
+    maybeUpdateCentralRepository(now);
+}
+
+template <bool WithPayload>
 void ThreadMonitorBase::writeCheckpointAtPosition(uint32_t index,
                                                   uint32_t id,
+                                                  uint64_t payload,
                                                   std::chrono::system_clock::time_point timestamp) {
     assert(index >= 0);
     assert(index < _historyDepth);
     InternalHistoryRecord& r = *(_historyPtr + index);
     r.checkpointId = id;
     r.durationFromCreation = timestamp - _creationTimestamp;
+    // Same write discipline as the record: outside of the head-tail interval.
+    if constexpr (WithPayload) {
+        _payloadPtr[index].store(payload, std::memory_order_relaxed);
+    }
 #ifndef NDEBUG
     r.sequence = ++_globalSequence;  // Only in debug mode, very expensive.
 #endif
 }
 
+// Taken by `checkpointImplFor()` in the translation units of the monitors.
+template void ThreadMonitorBase::_recordCheckpointImpl<false>(uint32_t id, uint64_t payload);
+template void ThreadMonitorBase::_recordCheckpointImpl<true>(uint32_t id, uint64_t payload);
+
 ThreadMonitorBase::History ThreadMonitorBase::getHistory() const {
+    if (!_enabled) {
+        return {};  // Nothing was recorded.
+    }
+    if (_encodedHistory != nullptr) {
+        return decodeHistory(*_encodedHistory, _historyEpoch);
+    }
     ThreadMonitorBase::History history;
     // This code is not atomic. It is only guaranteed that the thread
     // monitor is protected from deletion.
@@ -157,6 +292,7 @@ ThreadMonitorBase::History ThreadMonitorBase::getHistory() const {
         InternalHistoryRecord& r = *(_historyPtr + index);
         h.checkpointId = r.checkpointId;
         h.timestamp = _creationTimestamp + r.durationFromCreation.load();
+        h.payload = _payloadPtr != nullptr ? _payloadPtr[index].load(std::memory_order_relaxed) : 0;
 #ifndef NDEBUG
         h.sequence = r.sequence;
 #endif
@@ -180,13 +316,28 @@ ThreadMonitorBase::History ThreadMonitorBase::getHistory() const {
 }
 
 std::chrono::system_clock::time_point ThreadMonitorBase::lastCheckpointTime() const {
+    return lastCheckpoint().timestamp;
+}
+
+ThreadMonitorBase::HistoryRecord ThreadMonitorBase::lastCheckpoint() const {
+    HistoryRecord h{};
+    if (!_enabled) {
+        return h;
+    }
+    if (_encodedHistory != nullptr) {
+        const auto last = _encodedHistory->last();
+        h.checkpointId = last.checkpointId;
+        h.timestamp = _historyEpoch + last.durationFromCreation;
+        return h;
+    }
     while (true) {
         const auto initialTail = _tailHistoryRecord.load();
-        const auto timestamp =
-            _creationTimestamp + _historyPtr[initialTail].durationFromCreation.load();
+        const InternalHistoryRecord& r = _historyPtr[initialTail];
+        h.checkpointId = r.checkpointId.load();
+        h.timestamp = _creationTimestamp + r.durationFromCreation.load();
         // Subtle race - is the tail still there?
         if (initialTail == _tailHistoryRecord.load()) {
-            return timestamp;
+            return h;
         }
     }
 }
@@ -197,7 +348,11 @@ void ThreadMonitorBase::maybeUpdateCentralRepository(
         return;
     }
     _lastCentralRepoUpdateTimestamp = timestamp;
+    _registration->checkpointCount.store(_checkpointCount, std::memory_order_relaxed);
     _registration->lastSeenAlive = timestamp;
+    if (_cooperativeDomain != nullptr) {
+        _cooperativeDomain->maybeRunMonitorSlice(timestamp);
+    }
 }
 
 void ThreadMonitorBase::printHistory() const {
@@ -206,30 +361,123 @@ void ThreadMonitorBase::printHistory() const {
 }
 
 void ThreadMonitorBase::printHistory(const ThreadMonitorBase::History& history) {
+    printHistory(history, std::cerr);
+}
+
+void ThreadMonitorBase::printHistory(const ThreadMonitorBase::History& history,
+                                     std::ostream& out) {
     std::chrono::system_clock::time_point previous =
         history.empty() ? std::chrono::system_clock::time_point::min() : history[0].timestamp;
+    // The records before the first scope record are nested as deep as it implies,
+    // the enter records of the outer scopes are already evicted.
+    uint32_t nesting = 0;
     for (const auto& h : history) {
+        if (isScopeCheckpoint(h.checkpointId)) {
+            nesting = scopeDepth(h.checkpointId) + ((h.checkpointId & kScopeExitBit) ? 1 : 0);
+            break;
+        }
+    }
+    // The descriptor registry is locked once for the whole history.
+    std::vector<uint32_t> checkpointIds;
+    checkpointIds.reserve(history.size());
+    for (const auto& h : history) {
+        checkpointIds.push_back(h.checkpointId);
+    }
+    const auto descriptors = findCheckpointDescriptors(checkpointIds);
+    // Enter records of the open scopes, by depth.
+    const HistoryRecord* enters[kMaxScopeDepth + 1] = {};
+    for (size_t i = 0; i < history.size(); ++i) {
+        const HistoryRecord& h = history[i];
+        const CheckpointDescriptor* const descriptor = descriptors[i];
+        const bool enter = (h.checkpointId & kScopeEnterBit) != 0;
+        const bool exit = (h.checkpointId & kScopeExitBit) != 0;
+        if (enter || exit) {
+            nesting = scopeDepth(h.checkpointId);
+        }
         auto microsecs =
             std::chrono::duration_cast<std::chrono::microseconds>(h.timestamp.time_since_epoch()) %
             1000000;
         auto in_time_t = std::chrono::system_clock::to_time_t(h.timestamp);
-        std::cerr << "Checkpoint: " << h.checkpointId
-                  << " \tat: " << std::put_time(std::localtime(&in_time_t), "%Y-%m-%d %X") << "."
-                  << microsecs.count();
-        std::cerr
-            << "\tdelta: "
+        out << "Checkpoint: " << std::string(nesting * 2, ' ')
+            << checkpointName(h.checkpointId, descriptor)
+            << (enter ? " enter" : "") << (exit ? " exit" : "")
+            << (isProgressCheckpoint(h.checkpointId) ? " progress" : "")
+            << " \tat: " << std::put_time(std::localtime(&in_time_t), "%Y-%m-%d %X") << "."
+            << microsecs.count();
+        out << "\tdelta: "
             << std::chrono::duration_cast<std::chrono::microseconds>(h.timestamp - previous).count()
             << " us";
 #ifndef NDEBUG
-        std::cerr << h.sequence;
+        out << h.sequence;
+#endif
+        if (h.payload != 0) {
+            out << "\tpayload: 0x" << std::hex << h.payload << std::dec;
+        }
+        if (enter) {
+            // The scopes from `kMaxScopeDepth` on share the saturated depth,
+            // their records are not paired.
+            enters[nesting] = nesting < kMaxScopeDepth ? &h : nullptr;
+            ++nesting;
+        } else if (exit) {
+            const HistoryRecord* const e = enters[nesting];
+            if (e != nullptr &&
+                scopeCheckpointId(e->checkpointId) == scopeCheckpointId(h.checkpointId)) {
+                out << "\tscope: "
+                    << std::chrono::duration_cast<std::chrono::microseconds>(h.timestamp -
+                                                                             e->timestamp)
+                           .count()
+                    << " us";
+            }
+            enters[nesting] = nullptr;
+        }
+        if (descriptor != nullptr) {
+            out << "\t" << descriptor->file << ":" << descriptor->line << " "
+                << descriptor->function;
+        }
+        out << std::endl;
+    }
+}
+
+ThreadMonitorBase::History decodeHistory(const EncodedHistoryRing& ring,
+                                         std::chrono::system_clock::time_point epoch) {
+    ThreadMonitorBase::History history;
+    const auto records = ring.decode();
+    history.reserve(records.size());
+    for (const auto& r : records) {
+        ThreadMonitorBase::HistoryRecord h;
+        h.checkpointId = r.checkpointId;
+        h.timestamp = epoch + r.durationFromCreation;
+        h.payload = 0;
+#ifndef NDEBUG
+        h.sequence = 0;
 #endif
-        std::cerr << std::endl;
+        history.push_back(h);
+    }
+    return history;
+}
+
+uint32_t findRepeatingCycle(const ThreadMonitorBase::History& history) {
+    const auto size = history.size();
+    for (size_t period = 1; period * 2 <= size; ++period) {
+        bool repeats = true;
+        for (size_t i = 0; i < size && repeats; ++i) {
+            repeats = !isProgressCheckpoint(history[i].checkpointId) &&
+                (i + period >= size || history[i].checkpointId == history[i + period].checkpointId);
+        }
+        if (repeats) {
+            return period;
+        }
     }
+    return 0;
 }
 
 }  // namespace details
 
+#ifndef THREAD_MONITOR_DISABLED
 void threadMonitorCheckpoint(uint32_t checkpointId) {
+    if (!details::monitoringSwitch.enabled.load(std::memory_order_relaxed)) {
+        return;
+    }
     auto* ptr = details::threadLocalPtr;
     if (ptr == nullptr) {
         return;
@@ -237,4 +485,44 @@ void threadMonitorCheckpoint(uint32_t checkpointId) {
     ptr->checkpointInternalImpl(checkpointId);
 }
 
+void threadMonitorCheckpoint(uint32_t checkpointId, uint64_t payload) {
+    if (!details::monitoringSwitch.enabled.load(std::memory_order_relaxed)) {
+        return;
+    }
+    auto* ptr = details::threadLocalPtr;
+    if (ptr == nullptr) {
+        return;
+    }
+    ptr->checkpointInternalImpl(checkpointId, payload);
+}
+
+CheckpointScope::CheckpointScope(uint32_t checkpointId)
+    : _exitCheckpointId(checkpointId | kScopeExitBit |
+                        (std::min(details::scopeNesting++, kMaxScopeDepth) << kScopeDepthShift)) {
+    // The scope bits and the depth take the bits 24 to 29.
+    assert((checkpointId & ~(kProgressCheckpointBit | kDescriptorCheckpointBit)) <
+           (1u << kScopeDepthShift));
+    threadMonitorCheckpoint(_exitCheckpointId ^ kScopeExitBit ^ kScopeEnterBit);
+}
+
+CheckpointScope::~CheckpointScope() {
+    --details::scopeNesting;
+    threadMonitorCheckpoint(_exitCheckpointId);
+}
+
+void setThreadMonitoringEnabled(bool enabled) {
+    if (enabled && !details::monitoringSwitch.enabled.load()) {
+        // Published first, a monitor cycle seeing the switch enabled must not
+        // count the staleness accumulated while it was disabled.
+        details::monitoringSwitch.enabledSince.store(details::clockNow(),
+                                                     std::memory_order_relaxed);
+    }
+    details::monitoringSwitch.enabled.store(enabled, std::memory_order_release);
+}
+
+bool isThreadMonitoringEnabled() {
+    return details::monitoringSwitch.enabled.load(std::memory_order_acquire);
+}
+#endif  // THREAD_MONITOR_DISABLED
+
 }  // namespace thread_monitor
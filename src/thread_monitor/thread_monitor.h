@@ -26,25 +26,214 @@ SOFTWARE.
 #include <atomic>
 #include <chrono>
 #include <ctime>
+#include <ostream>
 #include <string>
 #include <thread>
+#include <type_traits>
 #include <vector>
 
+#include "thread_monitor/checkpoint_descriptor.h"
+#include "thread_monitor/encoded_history_ring.h"
 #include "thread_monitor/thread_monitor_central_repository.h"
+#include "thread_monitor/virtual_clock.h"
 
 namespace thread_monitor {
 
+// Building with `THREAD_MONITOR_DISABLED` defined (the CMake option
+// `THREAD_MONITOR_COMPILE_OUT`) compiles out the instrumentation: `ThreadMonitor`
+// is an empty class and the checkpoints are empty inline functions, there is
+// no thread local and no repository unless it is used directly.
+
+#ifdef THREAD_MONITOR_DISABLED
+inline void threadMonitorCheckpoint(uint32_t) {}
+inline void threadMonitorCheckpoint(uint32_t, uint64_t) {}
+inline void setThreadMonitoringEnabled(bool) {}
+inline bool isThreadMonitoringEnabled() {
+    return false;
+}
+#else
 /**
  * Method to instrument the code with checkpoints.
  * A thread is considered alive if it last called this method within the
  * 'thread timeout' in the past. This timeout can be configured with
  * `setThreadTimeout()` on the ThreadMonitorCentralRepository instance.
- * The default value is 5 minutes.
+ * The default value is 5 minutes. The ids picked by the user must fit in 24
+ * bits, the bits above are the progress, descriptor and scope bits.
  */
 void threadMonitorCheckpoint(uint32_t checkpointId);
 
+/**
+ * Same as above, also records a 64-bit 'payload' with the checkpoint, such as
+ * the request id or the lock address the thread is working on. The payload is
+ * only kept by monitors with the `history_layout::WithPayload` layout, other
+ * monitors record the checkpoint and drop the payload.
+ */
+void threadMonitorCheckpoint(uint32_t checkpointId, uint64_t payload);
+
+/**
+ * Global runtime switch of all domains, enabled by default. While disabled every
+ * checkpoint is a single predictable branch, the monitors are still registered
+ * and the monitor cycles still collect the garbage but detect nothing. The
+ * cooperative domains run their cycles from the checkpoints, thus they collect
+ * nothing while disabled unless `runMonitorCycle()` is called. Enabling
+ * re-arms the live monitors: the thread timeouts and the progress windows count
+ * from the moment of enabling, there is no re-registration.
+ */
+void setThreadMonitoringEnabled(bool enabled);
+bool isThreadMonitoringEnabled();
+#endif
+
+/**
+ * History layouts for the `ThreadMonitor` template.
+ */
+namespace history_layout {
+// Checkpoint id and timestamp only. This is the default.
+struct Compact {};
+// Also keeps a 64-bit payload per checkpoint, 8 more bytes per history record.
+struct WithPayload {};
+// Checkpoint id and time deltas as varints in the same number of bytes as
+// `Compact`, a typical record takes 3-4 bytes instead of 16, thus the history
+// keeps about 4 times more checkpoints. The payload is dropped.
+struct DeltaEncoded {};
+// Same encoding as `DeltaEncoded` in a ring leased by the OS thread from the
+// central repository arena, shared by all monitors of the thread. The history
+// of the previous monitors is kept and the monitor thread reads it without
+// locking against the monitor destruction. The `HistoryDepth` is ignored, the
+// depth is `ThreadMonitorCentralRepository::setThreadHistoryDepth()`.
+struct ThreadArena {};
+}  // namespace history_layout
+
+/**
+ * Checkpoint ids with this bit set are "progress" checkpoints. A monitor configured
+ * with `setProgressWindow()` must visit one of them within the window, otherwise
+ * the thread is reported as livelocked even if it keeps visiting other checkpoints.
+ * The bit is stored as a part of the id, so progress checkpoints cost the same.
+ */
+static inline constexpr uint32_t kProgressCheckpointBit = 1u << 31;
+
+constexpr uint32_t progressCheckpoint(uint32_t checkpointId) {
+    return checkpointId | kProgressCheckpointBit;
+}
+
+constexpr bool isProgressCheckpoint(uint32_t checkpointId) {
+    return (checkpointId & kProgressCheckpointBit) != 0;
+}
+
+/**
+ * Checkpoint with a descriptor of this call site: label, file, line and function.
+ * The descriptor id is assigned on the first visit of the site, after that the
+ * cost is the same as `threadMonitorCheckpoint(id)` with a constant id. Fault dumps show
+ * the label and location instead of the numeric id. The descriptor index takes
+ * 24 bits, which limits a process to 16M checkpoint sites.
+ *
+ *   TLM_CHECKPOINT("parse request");
+ *   TLM_PROGRESS_CHECKPOINT("request done");
+ */
+#define TLM_CHECKPOINT(label) TLM_CHECKPOINT_DETAILS(label, 0)
+#define TLM_PROGRESS_CHECKPOINT(label) \
+    TLM_CHECKPOINT_DETAILS(label, ::thread_monitor::kProgressCheckpointBit)
+
+#ifdef THREAD_MONITOR_DISABLED
+#define TLM_CHECKPOINT_DETAILS(checkpointLabel, flags) \
+    do {                                               \
+    } while (false)
+#else
+#define TLM_CHECKPOINT_DETAILS(checkpointLabel, flags)                                    \
+    do {                                                                                   \
+        static constexpr const char* tlmCheckpointFunction = __func__;                    \
+        struct TlmCheckpointSite {                                                         \
+            static ::thread_monitor::CheckpointDescriptor descriptor() {                   \
+                return {checkpointLabel, __FILE__, __LINE__, tlmCheckpointFunction};      \
+            }                                                                              \
+        };                                                                                 \
+        ::thread_monitor::threadMonitorCheckpoint(                                         \
+            ::thread_monitor::details::CheckpointSiteId<TlmCheckpointSite>::value() | (flags)); \
+    } while (false)
+#endif
+
+/**
+ * Writes an enter record when constructed and an exit record when destroyed,
+ * thus the history shows how long the scope took and what was visited within.
+ * The records carry the nesting depth of the scope in this thread and the fault
+ * dumps print the history as an indented tree. The cost is two checkpoints, the
+ * depth is a thread local counter. The 'checkpointId' must fit in 24 bits, not
+ * counting the progress and descriptor bits, as the scope bits and the depth take
+ * the bits 24 to 29; it is asserted in debug builds. The depth saturates at
+ * `kMaxScopeDepth`, the scopes from that depth on are printed without duration.
+ *
+ *   {
+ *       CheckpointScope scope(10);
+ *       parseRequest();  // Checkpoints here are printed nested in scope 10.
+ *   }
+ */
+#ifdef THREAD_MONITOR_DISABLED
+class CheckpointScope {
+public:
+    explicit CheckpointScope(uint32_t) {}
+
+    CheckpointScope(const CheckpointScope&) = delete;
+    CheckpointScope& operator=(const CheckpointScope&) = delete;
+};
+#else
+class CheckpointScope {
+public:
+    explicit CheckpointScope(uint32_t checkpointId);
+    ~CheckpointScope();
+
+    CheckpointScope(const CheckpointScope&) = delete;
+    CheckpointScope& operator=(const CheckpointScope&) = delete;
+
+private:
+    // With the exit bit and the depth.
+    const uint32_t _exitCheckpointId;
+};
+#endif
+
+/**
+ * `CheckpointScope` with a descriptor of this call site, see `TLM_CHECKPOINT()`.
+ * Lasts until the end of the enclosing block.
+ *
+ *   TLM_CHECKPOINT_SCOPE("parse request");
+ */
+#define TLM_CHECKPOINT_SCOPE(label) TLM_CHECKPOINT_SCOPE_DETAILS(label, __LINE__)
+#define TLM_CHECKPOINT_SCOPE_DETAILS(label, line) TLM_CHECKPOINT_SCOPE_AT_LINE(label, line)
+
+#ifdef THREAD_MONITOR_DISABLED
+#define TLM_CHECKPOINT_SCOPE_AT_LINE(checkpointLabel, line) static_cast<void>(0)
+#else
+#define TLM_CHECKPOINT_SCOPE_AT_LINE(checkpointLabel, line)                               \
+    static constexpr const char* tlmScopeFunction##line = __func__;                      \
+    struct TlmScopeSite##line {                                                           \
+        static ::thread_monitor::CheckpointDescriptor descriptor() {                      \
+            return {checkpointLabel, __FILE__, line, tlmScopeFunction##line};             \
+        }                                                                                 \
+    };                                                                                    \
+    ::thread_monitor::CheckpointScope tlmScope##line(                                     \
+        ::thread_monitor::details::CheckpointSiteId<TlmScopeSite##line>::value())
+#endif
+
 namespace details {
 
+/**
+ * The `setThreadMonitoringEnabled()` state, on its own cache line: it is read by
+ * every checkpoint and written only by the switch.
+ */
+struct alignas(64) MonitoringSwitch {
+    std::atomic<bool> enabled{true};
+    // When the monitoring was last enabled, the monitor cycles do not count the
+    // staleness before it.
+    std::atomic<std::chrono::system_clock::time_point> enabledSince{
+        std::chrono::system_clock::time_point::min()};
+};
+
+extern MonitoringSwitch monitoringSwitch;
+
+/**
+ * Registered monitors of all domains, only counted by the debug builds, thus
+ * `MonitorSimulation` asserts that no monitor is outside of its domain.
+ */
+uint32_t liveMonitorCount();
+
 /** Documentation: https://github.com/shuvalov-mdb/thread-liveness-monitor
  */
 class ThreadMonitorBase {
@@ -60,26 +249,18 @@ public:
 #endif
     };
 
-    /**
-     * Represents one checkpoint visited by this monitor.
-     */
-    struct HistoryRecord {
-        uint32_t checkpointId;
-        std::chrono::system_clock::time_point timestamp;
-
-#ifndef NDEBUG
-        // Sequence number is very expensive to generate and thus
-        // it should be used only with debug builds.
-        uint64_t sequence;
-#endif
-    };
-
-    using History = std::vector<HistoryRecord>;
+    // Declared with the repository, which reports the histories.
+    using HistoryRecord = details::HistoryRecord;
+    using History = details::History;
 
     bool isEnabled() const;
 
     const char* name() const;
 
+    /**
+     * The `HistoryDepth` of the monitor. With the `history_layout::DeltaEncoded`
+     * layout this is the memory budget and the history usually keeps more records.
+     */
     unsigned int depth() const;
 
     /**
@@ -96,15 +277,60 @@ public:
      */
     std::chrono::system_clock::time_point lastCheckpointTime() const;
 
+    /**
+     * Returns the id and the timestamp of the last checkpoint visited, the
+     * payload is not set.
+     */
+    HistoryRecord lastCheckpoint() const;
+
     void printHistory() const;
     static void printHistory(const History& history);
 
+    /**
+     * Prints one line per record. The records between the enter and the exit of
+     * a `CheckpointScope` are indented by the nesting depth and the exit record
+     * shows the scope duration, if its enter record is still in the history.
+     */
+    static void printHistory(const History& history, std::ostream& out);
+
+    /**
+     * Requires this thread to visit a progress checkpoint at least once per
+     * 'window', see `progressCheckpoint()`. Zero disables the check (default).
+     */
+    void setProgressWindow(std::chrono::system_clock::duration window);
+
 protected:
-    ThreadMonitorBase(const char* const name,
+    // The checkpoint implementation of the history layout.
+    using CheckpointImpl = void (ThreadMonitorBase::*)(uint32_t id, uint64_t payload);
+
+    /**
+     * Maps the history layout to its checkpoint implementation. The result is
+     * stored per monitor and every checkpoint calls it through the member
+     * pointer: one indirect call, predictable per thread, instead of a branch
+     * on the layout.
+     */
+    template <typename HistoryLayout>
+    static constexpr CheckpointImpl checkpointImplFor() {
+        if constexpr (std::is_same_v<HistoryLayout, history_layout::DeltaEncoded> ||
+                      std::is_same_v<HistoryLayout, history_layout::ThreadArena>) {
+            return &ThreadMonitorBase::_encodedCheckpointImpl;
+        } else {
+            return &ThreadMonitorBase::_recordCheckpointImpl<
+                std::is_same_v<HistoryLayout, history_layout::WithPayload>>;
+        }
+    }
+
+    ThreadMonitorBase(MonitorDomain* domain,
+                      const char* const name,
                       InternalHistoryRecord* historyPtr,
+                      std::atomic<uint64_t>* payloadPtr,
+                      EncodedHistoryRing* encodedHistory,
+                      bool leasesThreadHistory,
+                      CheckpointImpl checkpointImpl,
                       uint32_t historyDepth,
                       uint32_t firstCheckpointId,
-                      bool enabled);
+                      bool enabled,
+                      std::thread::id simulatedThreadId = std::thread::id());
     // The inheritance is non-virtual as the instance of this class can exist
     // only on the stack and the destructor by the pointer of the base class
     // cannot be invoked.
@@ -118,10 +344,12 @@ protected:
      * This is internal implementation to be accessed from
      * threadMonitorCheckpoint().
      */
-    void checkpointInternalImpl(uint32_t id);
+    void checkpointInternalImpl(uint32_t id, uint64_t payload = 0);
 
+    template <bool WithPayload>
     void writeCheckpointAtPosition(uint32_t index,
                                    uint32_t id,
+                                   uint64_t payload,
                                    std::chrono::system_clock::time_point timestamp);
 
     // We only update the central repository once in a while, for performance.
@@ -129,17 +357,39 @@ protected:
 
 private:
     friend void ::thread_monitor::threadMonitorCheckpoint(uint32_t checkpointId);
+    friend void ::thread_monitor::threadMonitorCheckpoint(uint32_t checkpointId,
+                                                          uint64_t payload);
 
     void _maybeRegisterThreadLocal();
 
+    // The circular list of records, 'WithPayload' also writes '_payloadPtr'.
+    template <bool WithPayload>
+    void _recordCheckpointImpl(uint32_t id, uint64_t payload);
+
+    // The delta encoded ring, the payload is dropped.
+    void _encodedCheckpointImpl(uint32_t id, uint64_t payload);
+
     // Thread name, the pointer should remain valid for the lifetime.
     const char* const _name;
     InternalHistoryRecord* const _historyPtr;
-    const uint32_t _historyDepth;
-
-    const std::chrono::system_clock::time_point _creationTimestamp =
-        std::chrono::system_clock::now();
-    const std::thread::id _threadId = std::this_thread::get_id();
+    // Parallel to '_historyPtr', nullptr if the layout does not keep payloads.
+    std::atomic<uint64_t>* const _payloadPtr;
+    // Leased from the arena with the `ThreadArena` layout once the monitor is
+    // enabled, otherwise nullptr. The nested monitors do not lease.
+    ThreadHistorySlot* _threadHistory = nullptr;
+    // Replaces '_historyPtr' with the delta encoded layouts, otherwise nullptr.
+    EncodedHistoryRing* _encodedHistory;
+    // With the `ThreadArena` layout it is set from the leased slot.
+    uint32_t _historyDepth;
+    // Called indirectly by `checkpoint()`, see `checkpointImplFor()`.
+    const CheckpointImpl _checkpointImpl;
+
+    const std::chrono::system_clock::time_point _creationTimestamp = clockNow();
+    // The encoded history times are durations from this timestamp.
+    std::chrono::system_clock::time_point _historyEpoch = _creationTimestamp;
+    // Not bound to the calling thread, see `SimulatedMonitor`.
+    const bool _simulated;
+    const std::thread::id _threadId;
 
     // Thread monitor is disabled if there is another instance up the stack.
     bool _enabled = false;
@@ -154,13 +404,123 @@ private:
     // Prorate updates to central repository to avoid cache misses.
     std::chrono::system_clock::time_point _lastCentralRepoUpdateTimestamp = _creationTimestamp;
     std::chrono::system_clock::duration _centralRepoUpdateInterval;
+    // Published with the liveness timestamp, the monitor cycle derives the rate.
+    uint64_t _checkpointCount = 0;
 
     ThreadMonitorCentralRepository::ThreadRegistration* _registration;
+    // The domain if it is cooperative, the monitor then runs the monitor cycle slices.
+    MonitorDomain* _cooperativeDomain = nullptr;
 
 #ifndef NDEBUG
     static std::atomic<uint64_t> _globalSequence;
 #endif
 };
+
+/**
+ * Returns the period of the repeating sequence of non-progress checkpoint ids
+ * that fills the whole 'history' at least twice, or 0 if there is none.
+ * For example, 2 3 4 2 3 4 2 has period 3.
+ */
+uint32_t findRepeatingCycle(const ThreadMonitorBase::History& history);
+
+/**
+ * Decodes the history snapshot of a delta encoded ring with times from 'epoch'.
+ * Safe to invoke from any thread.
+ */
+ThreadMonitorBase::History decodeHistory(const EncodedHistoryRing& ring,
+                                         std::chrono::system_clock::time_point epoch);
+
+/**
+ * Byte budget per record of the delta encoded rings, the size of the `Compact`
+ * record in release builds. It is fixed, thus the rings keep the same number of
+ * records in the debug builds, where the `Compact` record has a sequence number.
+ */
+static inline constexpr uint32_t kEncodedBytesPerRecord = 16;
+
+/**
+ * Returns the history slot of the current OS thread, leasing it on the first call.
+ * The slot is returned to the arena when the thread exits. Invoked by the
+ * outermost enabled monitor of the thread only.
+ */
+ThreadHistorySlot* currentThreadHistorySlot();
+
+// Storage of the history circular list for every layout. The payloads are a
+// separate array so the records are the same for all layouts.
+template <uint32_t HistoryDepth, typename HistoryLayout>
+struct HistoryStorage;
+
+template <uint32_t HistoryDepth>
+struct HistoryStorage<HistoryDepth, history_layout::Compact> {
+    ThreadMonitorBase::InternalHistoryRecord historyRecords[HistoryDepth];
+
+    ThreadMonitorBase::InternalHistoryRecord* records() {
+        return historyRecords;
+    }
+    std::atomic<uint64_t>* payloads() {
+        return nullptr;
+    }
+    EncodedHistoryRing* encodedHistory() {
+        return nullptr;
+    }
+    bool leasesThreadHistory() const {
+        return false;
+    }
+};
+
+template <uint32_t HistoryDepth>
+struct HistoryStorage<HistoryDepth, history_layout::WithPayload> {
+    ThreadMonitorBase::InternalHistoryRecord historyRecords[HistoryDepth];
+    std::atomic<uint64_t> payloadValues[HistoryDepth];
+
+    ThreadMonitorBase::InternalHistoryRecord* records() {
+        return historyRecords;
+    }
+    std::atomic<uint64_t>* payloads() {
+        return payloadValues;
+    }
+    EncodedHistoryRing* encodedHistory() {
+        return nullptr;
+    }
+    bool leasesThreadHistory() const {
+        return false;
+    }
+};
+
+template <uint32_t HistoryDepth>
+struct HistoryStorage<HistoryDepth, history_layout::DeltaEncoded> {
+    std::atomic<uint8_t> bytes[HistoryDepth * kEncodedBytesPerRecord];
+    EncodedHistoryRing ring{bytes, sizeof(bytes)};
+
+    ThreadMonitorBase::InternalHistoryRecord* records() {
+        return nullptr;
+    }
+    std::atomic<uint64_t>* payloads() {
+        return nullptr;
+    }
+    EncodedHistoryRing* encodedHistory() {
+        return &ring;
+    }
+    bool leasesThreadHistory() const {
+        return false;
+    }
+};
+
+template <uint32_t HistoryDepth>
+struct HistoryStorage<HistoryDepth, history_layout::ThreadArena> {
+    ThreadMonitorBase::InternalHistoryRecord* records() {
+        return nullptr;
+    }
+    std::atomic<uint64_t>* payloads() {
+        return nullptr;
+    }
+    EncodedHistoryRing* encodedHistory() {
+        return nullptr;
+    }
+    bool leasesThreadHistory() const {
+        return true;
+    }
+};
+
 }  // namespace details
 
 /**
@@ -170,14 +530,50 @@ private:
  * `threadMonitorCheckpoint()` anywhere in the code.
  * 
  * `HistoryDepth` is how many checkpoints are stored on this class.
+ * `HistoryLayout` is one of `history_layout` types, selecting what is stored
+ * with every checkpoint.
  * 
  * Important: ThreadMonitor is designed to be used as automatic instance within
  * a method scope. It must be deleted by the same thread that created it, otherwise
  * it will not deregister the thread local variable pointing to it and will
  * corrupt memory.
  */
-template <uint32_t HistoryDepth = 10>
-class ThreadMonitor : public details::ThreadMonitorBase {
+#ifdef THREAD_MONITOR_DISABLED
+template <uint32_t HistoryDepth = 10, typename HistoryLayout = history_layout::Compact>
+class ThreadMonitor {
+public:
+    ThreadMonitor(const char* const name, uint32_t, bool = true) : _name(name) {}
+    ThreadMonitor(MonitorDomain&, const char* const name, uint32_t, bool = true)
+        : _name(name) {}
+
+    ThreadMonitor(const ThreadMonitor&) = delete;
+    ThreadMonitor& operator=(const ThreadMonitor&) = delete;
+
+    bool isEnabled() const {
+        return false;
+    }
+    const char* name() const {
+        return _name ? _name : "default";
+    }
+    unsigned int depth() const {
+        return HistoryDepth;
+    }
+    details::ThreadMonitorBase::History getHistory() const {
+        return {};
+    }
+    std::chrono::system_clock::time_point lastCheckpointTime() const {
+        return {};
+    }
+    void printHistory() const {}
+    void setProgressWindow(std::chrono::system_clock::duration) {}
+
+private:
+    const char* const _name;
+};
+#else
+template <uint32_t HistoryDepth = 10, typename HistoryLayout = history_layout::Compact>
+class ThreadMonitor : private details::HistoryStorage<HistoryDepth, HistoryLayout>,
+                      public details::ThreadMonitorBase {
 public:
     /**
      * @param name Thread name, the pointer should remain valid for the lifetime.
@@ -188,15 +584,52 @@ public:
                   uint32_t firstCheckpointId,
                   bool enabled = true);
 
+    /**
+     * Same as above, registers with the monitor 'domain' instead of the default one.
+     */
+    ThreadMonitor(MonitorDomain& domain,
+                  const char* const name,
+                  uint32_t firstCheckpointId,
+                  bool enabled = true);
+
 private:
-    // The actual history circular list is stored on stack.
-    InternalHistoryRecord _history[HistoryDepth];
+    // The actual history circular list is stored on stack. It is a base class
+    // to be constructed before `ThreadMonitorBase` writes the first checkpoint.
+    using Storage = details::HistoryStorage<HistoryDepth, HistoryLayout>;
 };
 
-template <uint32_t HistoryDepth>
-ThreadMonitor<HistoryDepth>::ThreadMonitor(const char* const name,
-                                           uint32_t firstCheckpointId,
-                                           bool enabled)
-    : ThreadMonitorBase(name, _history, HistoryDepth, firstCheckpointId, enabled) {}
+template <uint32_t HistoryDepth, typename HistoryLayout>
+ThreadMonitor<HistoryDepth, HistoryLayout>::ThreadMonitor(const char* const name,
+                                                          uint32_t firstCheckpointId,
+                                                          bool enabled)
+    : Storage(),
+      ThreadMonitorBase(nullptr,
+                        name,
+                        Storage::records(),
+                        Storage::payloads(),
+                        Storage::encodedHistory(),
+                        Storage::leasesThreadHistory(),
+                        checkpointImplFor<HistoryLayout>(),
+                        HistoryDepth,
+                        firstCheckpointId,
+                        enabled) {}
+
+template <uint32_t HistoryDepth, typename HistoryLayout>
+ThreadMonitor<HistoryDepth, HistoryLayout>::ThreadMonitor(MonitorDomain& domain,
+                                                          const char* const name,
+                                                          uint32_t firstCheckpointId,
+                                                          bool enabled)
+    : Storage(),
+      ThreadMonitorBase(&domain,
+                        name,
+                        Storage::records(),
+                        Storage::payloads(),
+                        Storage::encodedHistory(),
+                        Storage::leasesThreadHistory(),
+                        checkpointImplFor<HistoryLayout>(),
+                        HistoryDepth,
+                        firstCheckpointId,
+                        enabled) {}
+#endif  // THREAD_MONITOR_DISABLED
 
 }  // namespace thread_monitor
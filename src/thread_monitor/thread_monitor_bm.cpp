@@ -1,14 +1,43 @@
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
 
 #include <benchmark/benchmark.h>
 
+#include "thread_monitor/benchmark_support.h"
+#include "thread_monitor/kernel_thread_state.h"
+#include "thread_monitor/monitor_simulation.h"
 #include "thread_monitor/thread_monitor.h"
+#include "thread_monitor/thread_monitor_central_repository_impl.h"
 
 namespace thread_monitor {
+
+// The benchmarked policies which are not instantiated by the library.
+template class BasicThreadMonitorCentralRepository<
+    RepositoryPolicy<policy::SystemClock, policy::NoLock, policy::ColonyContainer>>;
+template class BasicThreadMonitorCentralRepository<
+    RepositoryPolicy<policy::SystemClock, std::mutex, policy::ListContainer>>;
+template class BasicThreadMonitorCentralRepository<
+    RepositoryPolicy<policy::SystemClock, policy::SpinLock, policy::ListContainer>>;
+template class BasicThreadMonitorCentralRepository<
+    RepositoryPolicy<policy::SystemClock, policy::NoLock, policy::ListContainer>>;
+template class BasicThreadMonitorCentralRepository<
+    RepositoryPolicy<policy::CoarseSystemClock, policy::NoLock, policy::ColonyContainer>>;
+template class BasicThreadMonitorCentralRepository<
+    RepositoryPolicy<policy::CoarseSystemClock, std::mutex, policy::ListContainer>>;
+template class BasicThreadMonitorCentralRepository<
+    RepositoryPolicy<policy::CoarseSystemClock, policy::SpinLock, policy::ListContainer>>;
+template class BasicThreadMonitorCentralRepository<
+    RepositoryPolicy<policy::CoarseSystemClock, policy::NoLock, policy::ListContainer>>;
+
 namespace {
 
 static void BM_ConcurrentCreateDelete(benchmark::State& state) {
-    if (state.thread_index == 0) {
+    if (state.thread_index() == 0) {
         ThreadMonitorCentralRepository::instance()->runMonitorCycle();
     }
     for (auto _ : state) {
@@ -26,8 +55,40 @@ BENCHMARK(BM_ConcurrentCreateDelete)->Threads(64)->MinTime(5)->UseRealTime();
 BENCHMARK(BM_ConcurrentCreateDelete)->Threads(128)->MinTime(5)->UseRealTime();
 BENCHMARK(BM_ConcurrentCreateDelete)->Threads(1024)->MinTime(5)->UseRealTime();
 
+// Monitor constructor and destructor in a domain opening the thread counters,
+// range(0) = 1, against the same domain without them. The counters are closed
+// by the garbage collection outside of the measured time.
+static void BM_CreateDeleteWithThreadCounters(benchmark::State& state) {
+    ThreadMonitorCentralRepository::DomainOptions options;
+    options.name = "counters";
+    options.withMonitorThread = false;
+    ThreadMonitorCentralRepository domain(options);
+    domain.setThreadCountersEnabled(state.range(0) == 1);
+    int64_t iteration = 0;
+    for (auto _ : state) {
+        {
+            ThreadMonitor<> monitor(domain, "test", 1);
+        }
+        if (++iteration % 1024 == 0) {
+            state.PauseTiming();
+            domain.runMonitorCycle();
+            state.ResumeTiming();
+        }
+    }
+    const auto counters = details::ThreadCounters::open(details::currentKernelThreadId(),
+                                                        std::chrono::system_clock::now());
+    state.counters["hardware"] = counters != nullptr && counters->hasHardwareCounter();
+}
+
+BENCHMARK(BM_CreateDeleteWithThreadCounters)
+    ->ArgNames({"counters"})
+    ->Arg(0)
+    ->Arg(1)
+    ->MinTime(1)
+    ->UseRealTime();
+
 static void BM_Checkpoint(benchmark::State& state) {
-    if (state.thread_index == 0) {
+    if (state.thread_index() == 0) {
         ThreadMonitorCentralRepository::instance()->runMonitorCycle();
     }
     ThreadMonitor<> monitor("test", 1);
@@ -45,8 +106,125 @@ BENCHMARK(BM_Checkpoint)->Threads(64)->MinTime(1)->UseRealTime();
 BENCHMARK(BM_Checkpoint)->Threads(128)->MinTime(1)->UseRealTime();
 BENCHMARK(BM_Checkpoint)->Threads(1024)->MinTime(1)->UseRealTime();
 
+// The checkpoint with the monitoring disabled at runtime, only the switch is loaded.
+static void BM_CheckpointDisabled(benchmark::State& state) {
+    ThreadMonitor<> monitor("test", 1);
+    setThreadMonitoringEnabled(false);
+    for (auto _ : state) {
+        threadMonitorCheckpoint(2);
+    }
+    setThreadMonitoringEnabled(true);
+}
+
+BENCHMARK(BM_CheckpointDisabled)->MinTime(1)->UseRealTime();
+
+// Enter and exit records of a scope, compare with two `BM_Checkpoint` iterations.
+static void BM_CheckpointScope(benchmark::State& state) {
+    ThreadMonitor<> monitor("test", 1);
+    for (auto _ : state) {
+        CheckpointScope scope(2);
+    }
+}
+
+BENCHMARK(BM_CheckpointScope)->Threads(1)->MinTime(1)->UseRealTime();
+BENCHMARK(BM_CheckpointScope)->Threads(8)->MinTime(1)->UseRealTime();
+
+// Compares the history layouts, with and without the payload.
+template <typename HistoryLayout>
+static void BM_CheckpointWithPayload(benchmark::State& state) {
+    if (state.thread_index() == 0) {
+        ThreadMonitorCentralRepository::instance()->runMonitorCycle();
+    }
+    ThreadMonitor<10, HistoryLayout> monitor("test", 1);
+    uint64_t payload = 0;
+    for (auto _ : state) {
+        threadMonitorCheckpoint(2, ++payload);
+    }
+}
+
+BENCHMARK_TEMPLATE(BM_CheckpointWithPayload, history_layout::Compact)
+    ->Threads(1)->MinTime(1)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_CheckpointWithPayload, history_layout::Compact)
+    ->Threads(8)->MinTime(1)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_CheckpointWithPayload, history_layout::Compact)
+    ->Threads(64)->MinTime(1)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_CheckpointWithPayload, history_layout::WithPayload)
+    ->Threads(1)->MinTime(1)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_CheckpointWithPayload, history_layout::WithPayload)
+    ->Threads(8)->MinTime(1)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_CheckpointWithPayload, history_layout::WithPayload)
+    ->Threads(64)->MinTime(1)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_CheckpointWithPayload, history_layout::DeltaEncoded)
+    ->Threads(1)->MinTime(1)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_CheckpointWithPayload, history_layout::DeltaEncoded)
+    ->Threads(8)->MinTime(1)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_CheckpointWithPayload, history_layout::DeltaEncoded)
+    ->Threads(64)->MinTime(1)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_CheckpointWithPayload, history_layout::ThreadArena)
+    ->Threads(1)->MinTime(1)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_CheckpointWithPayload, history_layout::ThreadArena)
+    ->Threads(8)->MinTime(1)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_CheckpointWithPayload, history_layout::ThreadArena)
+    ->Threads(64)->MinTime(1)->UseRealTime();
+
+// Encoding cost alone, every checkpoint is appended as a new record.
+static void BM_EncodedHistoryAppend(benchmark::State& state) {
+    std::atomic<uint8_t> bytes[160];
+    details::EncodedHistoryRing ring(bytes, sizeof(bytes));
+    uint32_t i = 0;
+    for (auto _ : state) {
+        ++i;
+        ring.append(i % 8, std::chrono::microseconds{i * 50});
+    }
+}
+
+BENCHMARK(BM_EncodedHistoryAppend)->MinTime(1);
+
+// Decoding cost of one history snapshot of a full history.
+template <typename HistoryLayout>
+static void BM_GetHistory(benchmark::State& state) {
+    ThreadMonitor<10, HistoryLayout> monitor("test", 1);
+    for (int i = 0; i < 200; ++i) {
+        std::this_thread::sleep_for(std::chrono::microseconds{20});
+        threadMonitorCheckpoint(2 + i % 4);
+    }
+    size_t records = 0;
+    for (auto _ : state) {
+        auto history = monitor.getHistory();
+        records += history.size();
+        benchmark::DoNotOptimize(history);
+    }
+    state.counters["records"] =
+        benchmark::Counter(records, benchmark::Counter::kAvgIterations);
+}
+
+BENCHMARK_TEMPLATE(BM_GetHistory, history_layout::Compact)->MinTime(1);
+BENCHMARK_TEMPLATE(BM_GetHistory, history_layout::DeltaEncoded)->MinTime(1);
+BENCHMARK_TEMPLATE(BM_GetHistory, history_layout::ThreadArena)->MinTime(1);
+
+template <typename HistoryLayout>
+static void BM_CreateDeleteLayout(benchmark::State& state) {
+    if (state.thread_index() == 0) {
+        ThreadMonitorCentralRepository::instance()->runMonitorCycle();
+    }
+    for (auto _ : state) {
+        ThreadMonitor<100, HistoryLayout> monitor("test", 1);
+    }
+}
+
+BENCHMARK_TEMPLATE(BM_CreateDeleteLayout, history_layout::Compact)
+    ->Threads(1)->MinTime(1)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_CreateDeleteLayout, history_layout::WithPayload)
+    ->Threads(1)->MinTime(1)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_CreateDeleteLayout, history_layout::DeltaEncoded)
+    ->Threads(1)->MinTime(1)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_CreateDeleteLayout, history_layout::ThreadArena)
+    ->Threads(1)->MinTime(1)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_CreateDeleteLayout, history_layout::ThreadArena)
+    ->Threads(8)->MinTime(1)->UseRealTime();
+
 static void BM_FullCycle(benchmark::State& state) {
-    if (state.thread_index == 0) {
+    if (state.thread_index() == 0) {
         ThreadMonitorCentralRepository::instance()->runMonitorCycle();
     }
     for (auto _ : state) {
@@ -101,6 +279,303 @@ BENCHMARK(BM_GCAndMonitor)->Threads(256)->MinTime(1)->UseRealTime();
 BENCHMARK(BM_GCAndMonitor)->Threads(512)->MinTime(1)->UseRealTime();
 BENCHMARK(BM_GCAndMonitor)->Threads(1024)->MinTime(1)->UseRealTime();
 
+// Startup burst: all threads register at once, the registration latency is
+// measured with range(1) = 0 no reservation, 1 `reserve()`, 2 `reserve()` on huge pages.
+static void BM_StartupBurst(benchmark::State& state) {
+    auto* const centralRepo = ThreadMonitorCentralRepository::instance();
+    const int threadCount = state.range(0);
+    std::vector<int64_t> latencies;
+    for (auto _ : state) {
+        state.PauseTiming();
+        centralRepo->runMonitorCycle();
+        centralRepo->trim();
+        if (state.range(1) > 0) {
+            centralRepo->reserve(threadCount, state.range(1) == 2);
+        }
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool start = false;
+        int registered = 0;
+        std::vector<int64_t> burstLatencies(threadCount);
+        std::vector<std::thread> threads;
+        for (int i = 0; i < threadCount; ++i) {
+            threads.emplace_back([&, i] {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cv.wait(lock, [&] { return start; });
+                }
+                const auto before = std::chrono::steady_clock::now();
+                ThreadMonitor<> monitor("burst", 1);
+                burstLatencies[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                        std::chrono::steady_clock::now() - before)
+                                        .count();
+                // Keep registered until the burst is over.
+                std::unique_lock<std::mutex> lock(mutex);
+                if (++registered == threadCount) {
+                    cv.notify_all();
+                }
+                cv.wait(lock, [&] { return registered == threadCount; });
+            });
+        }
+        state.ResumeTiming();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            start = true;
+        }
+        cv.notify_all();
+        for (auto& t : threads) {
+            t.join();
+        }
+        latencies.insert(latencies.end(), burstLatencies.begin(), burstLatencies.end());
+    }
+    benchmark_support::reportLatencies(state, &latencies);
+}
+
+BENCHMARK(BM_StartupBurst)
+    ->ArgsProduct({{1000, 4000}, {0, 1, 2}})
+    ->Iterations(5)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+// Registration and GC contention with 'range(0)' shards, range(1) is the placement.
+static void BM_ShardedRegistration(benchmark::State& state) {
+    static ThreadMonitorCentralRepository* repo;
+    if (state.thread_index() == 0) {
+        ThreadMonitorCentralRepository::DomainOptions options;
+        options.withMonitorThread = false;
+        options.sharding = {
+            static_cast<uint32_t>(state.range(0)),
+            static_cast<ThreadMonitorCentralRepository::ShardPlacement>(state.range(1))};
+        repo = new ThreadMonitorCentralRepository(options);
+    }
+    const pid_t tid = details::currentKernelThreadId();
+    for (auto _ : state) {
+        auto* r = repo->registerThread(
+            std::this_thread::get_id(), tid, nullptr, nullptr, std::chrono::system_clock::now());
+        MonitorDomain::deregisterThread(r);
+        if (state.thread_index() == 0) {
+            repo->runMonitorCycle();
+        }
+    }
+    if (state.thread_index() == 0) {
+        state.counters["shards"] = repo->shardCount();
+        delete repo;
+    }
+}
+
+BENCHMARK(BM_ShardedRegistration)
+    ->ArgsProduct({{8, 36}, {0, 1}})
+    ->Threads(1)
+    ->Threads(8)
+    ->Threads(32)
+    ->MinTime(1)
+    ->UseRealTime();
+
+// Monitor cycle of a domain with 'range(0)' live registrations, a subsystem
+// with its own domain only scans its own threads.
+static void BM_DomainMonitorCycle(benchmark::State& state) {
+    ThreadMonitorCentralRepository::DomainOptions options;
+    options.withMonitorThread = false;
+    ThreadMonitorCentralRepository domain(options);
+    const pid_t tid = details::currentKernelThreadId();
+    for (int i = 0; i < state.range(0); ++i) {
+        // Never stale, the cycle only visits the registrations.
+        domain.registerThread(
+            std::this_thread::get_id(), tid, nullptr, nullptr, std::chrono::system_clock::now());
+    }
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(domain.runMonitorCycle());
+    }
+}
+
+BENCHMARK(BM_DomainMonitorCycle)->Arg(100)->Arg(1000)->Arg(10000)->MinTime(1);
+
+// Lock-free read of the stats published by the monitor cycle, range(0) = 1
+// also formats them as Prometheus text.
+static void BM_MonitorStats(benchmark::State& state) {
+    ThreadMonitorCentralRepository::DomainOptions options;
+    options.withMonitorThread = false;
+    ThreadMonitorCentralRepository domain(options);
+    for (int i = 0; i < 1000; ++i) {
+        domain.registerThread(
+            std::this_thread::get_id(), 0, nullptr, nullptr, std::chrono::system_clock::now());
+    }
+    domain.runMonitorCycle();
+    for (auto _ : state) {
+        const auto stats = domain.stats();
+        if (state.range(0) == 1) {
+            std::ostringstream text;
+            writePrometheusText(text, stats, domain.name());
+            benchmark::DoNotOptimize(text.str());
+        } else {
+            benchmark::DoNotOptimize(stats.cycles);
+        }
+    }
+}
+
+BENCHMARK(BM_MonitorStats)->Arg(0)->Arg(1);
+
+// Amortized checkpoint cost when the instrumented threads run the monitor
+// cycle slices, range(0) = 1, compared to the monitor thread, range(0) = 0.
+// The domain has range(1) more registrations to scan.
+static void BM_CooperativeCheckpoint(benchmark::State& state) {
+    // The benchmark threads start and stop their monitors outside of the
+    // measured loop.
+    const bool cooperative = state.range(0) == 1;
+    const int64_t idle = state.range(1);
+    auto* const domain = benchmark_support::leakedDomain(
+        "cooperative/" + std::to_string(state.range(0)) + "/" + std::to_string(idle), [&] {
+            ThreadMonitorCentralRepository::DomainOptions options;
+            options.cooperative = cooperative;
+            auto* d = new ThreadMonitorCentralRepository(options);
+            d->setReportingInterval(std::chrono::milliseconds{1});
+            d->setMonitoringInterval(std::chrono::milliseconds{10});
+            // Idle monitors, far from the thread timeout, leaked with the domain.
+            for (int64_t i = 0; i < idle; ++i) {
+                new SimulatedMonitor(*d, "idle", std::this_thread::get_id(), 1);
+            }
+            return d;
+        });
+    ThreadMonitor<> monitor(*domain, "cooperative", 1);
+    uint32_t id = 0;
+    for (auto _ : state) {
+        threadMonitorCheckpoint(++id % 16 + 2);
+    }
+}
+
+BENCHMARK(BM_CooperativeCheckpoint)
+    ->ArgsProduct({{0, 1}, {100, 10000}})
+    ->Threads(1)
+    ->Threads(8)
+    ->MinTime(1)
+    ->UseRealTime();
+
+// Monitor churn and monitor cycles with every policy combination, the
+// monitor cycle runs on the thread 0 every 64 iterations. `NoLock` is single
+// threaded only.
+template <typename Clock, typename ShardLock, typename Container>
+static void BM_RepositoryPolicy(benchmark::State& state) {
+    using Repository =
+        BasicThreadMonitorCentralRepository<RepositoryPolicy<Clock, ShardLock, Container>>;
+    static Repository* repo;
+    if (state.thread_index() == 0) {
+        ThreadMonitorCentralRepository::DomainOptions options;
+        options.withMonitorThread = false;
+        repo = new Repository(options);
+    }
+    int64_t iteration = 0;
+    for (auto _ : state) {
+        ThreadMonitor<> monitor(*repo, "policy", 1);
+        threadMonitorCheckpoint(2);
+        if (state.thread_index() == 0 && ++iteration % 64 == 0) {
+            repo->runMonitorCycle();
+        }
+    }
+    if (state.thread_index() == 0) {
+        delete repo;
+    }
+}
+
+// Every container with every shard lock for the 'Clock', `NoLock` single threaded.
+#define BM_REPOSITORY_POLICIES(Clock)                                                   \
+    BENCHMARK_TEMPLATE(BM_RepositoryPolicy, Clock, std::mutex, policy::ColonyContainer) \
+        ->Threads(1)                                                                    \
+        ->Threads(8)                                                                    \
+        ->MinTime(1)                                                                    \
+        ->UseRealTime();                                                                \
+    BENCHMARK_TEMPLATE(BM_RepositoryPolicy, Clock, policy::SpinLock, policy::ColonyContainer) \
+        ->Threads(1)                                                                    \
+        ->Threads(8)                                                                    \
+        ->MinTime(1)                                                                    \
+        ->UseRealTime();                                                                \
+    BENCHMARK_TEMPLATE(BM_RepositoryPolicy, Clock, policy::NoLock, policy::ColonyContainer) \
+        ->Threads(1)                                                                    \
+        ->MinTime(1)                                                                    \
+        ->UseRealTime();                                                                \
+    BENCHMARK_TEMPLATE(BM_RepositoryPolicy, Clock, std::mutex, policy::ListContainer)   \
+        ->Threads(1)                                                                    \
+        ->Threads(8)                                                                    \
+        ->MinTime(1)                                                                    \
+        ->UseRealTime();                                                                \
+    BENCHMARK_TEMPLATE(BM_RepositoryPolicy, Clock, policy::SpinLock, policy::ListContainer) \
+        ->Threads(1)                                                                    \
+        ->Threads(8)                                                                    \
+        ->MinTime(1)                                                                    \
+        ->UseRealTime();                                                                \
+    BENCHMARK_TEMPLATE(BM_RepositoryPolicy, Clock, policy::NoLock, policy::ListContainer) \
+        ->Threads(1)                                                                    \
+        ->MinTime(1)                                                                    \
+        ->UseRealTime()
+
+BM_REPOSITORY_POLICIES(policy::SystemClock);
+BM_REPOSITORY_POLICIES(policy::CoarseSystemClock);
+
+// Garbage collection throughput: every cycle reclaims range(0) registrations
+// retired since the previous one, the registrations reuse the reclaimed slots.
+static void BM_BulkGarbageCollection(benchmark::State& state) {
+    ThreadMonitorCentralRepository::DomainOptions options;
+    options.withMonitorThread = false;
+    ThreadMonitorCentralRepository domain(options);
+    const pid_t tid = details::currentKernelThreadId();
+    std::vector<MonitorDomain::ThreadRegistration*> registrations(state.range(0));
+    for (auto _ : state) {
+        state.PauseTiming();
+        for (auto& r : registrations) {
+            r = domain.registerThread(
+                std::this_thread::get_id(), tid, nullptr, nullptr, std::chrono::system_clock::now());
+        }
+        for (auto* r : registrations) {
+            MonitorDomain::deregisterThread(r);
+        }
+        state.ResumeTiming();
+        benchmark::DoNotOptimize(domain.runMonitorCycle());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+BENCHMARK(BM_BulkGarbageCollection)->Arg(1000)->Arg(100000)->UseRealTime();
+
+// Monitor churn while another thread runs the monitor cycles back to back: the
+// registration latency percentiles, the deregistrations and the garbage
+// collection per second.
+static void BM_ChurnWithMonitor(benchmark::State& state) {
+    static ThreadMonitorCentralRepository* domain;
+    static std::atomic<bool> stop;
+    static std::atomic<uint64_t> garbageCollected;
+    static std::thread* monitorThread;
+    if (state.thread_index() == 0) {
+        ThreadMonitorCentralRepository::DomainOptions options;
+        options.withMonitorThread = false;
+        domain = new ThreadMonitorCentralRepository(options);
+        stop = false;
+        garbageCollected = 0;
+        monitorThread = new std::thread([] {
+            while (!stop) {
+                garbageCollected += domain->runMonitorCycle();
+            }
+        });
+    }
+    benchmark_support::LatencyHistogram latency;
+    for (auto _ : state) {
+        const auto start = std::chrono::steady_clock::now();
+        ThreadMonitor<> monitor(*domain, "churn", 1);
+        latency.record(benchmark_support::elapsedNanos(start, std::chrono::steady_clock::now()));
+    }
+    static benchmark_support::HistogramMerger latencies;
+    latencies.report(state, latency, "register_");
+    state.SetItemsProcessed(state.iterations());
+    if (state.thread_index() == 0) {
+        stop = true;
+        monitorThread->join();
+        delete monitorThread;
+        state.counters["gc_per_s"] =
+            benchmark::Counter(garbageCollected, benchmark::Counter::kIsRate);
+        delete domain;
+    }
+}
+
+BENCHMARK(BM_ChurnWithMonitor)->Threads(1)->Threads(4)->Threads(8)->MinTime(1)->UseRealTime();
+
 }  // namespace
 }  // namespace thread_monitor
 
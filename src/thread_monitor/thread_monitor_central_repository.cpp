@@ -1,241 +1,147 @@
 #include "thread_monitor/thread_monitor_central_repository.h"
 
-#include "thread_monitor/thread_monitor.h"
-
-#include <iostream>
+#include "thread_monitor/thread_monitor_central_repository_impl.h"
 
 namespace thread_monitor {
 
-ThreadMonitorCentralRepository* ThreadMonitorCentralRepository::_staticInstance(
-    bool withMonitorThread) {
-    static ThreadMonitorCentralRepository* inst =
-        new ThreadMonitorCentralRepository(withMonitorThread);
-    return inst;
+namespace {
+std::atomic<uint32_t>& threadHistoryDepthSetting() {
+    static std::atomic<uint32_t> depth{MonitorDomain::kDefaultThreadHistoryDepth};
+    return depth;
 }
 
-ThreadMonitorCentralRepository::ThreadMonitorCentralRepository(bool withMonitorThread) {
-    if (withMonitorThread) {
-        auto* t = new std::thread([this] {
-            std::this_thread::sleep_for(std::chrono::milliseconds{1});
-            while (!_terminating) {
-                // This does both GC and frozen thread detection.
-                // In steady production load with up to 1k threads this cycle takes
-                // about 1 microsec, so not much over head to run every few millis.
-                const auto garbageCollected = runMonitorCycle();
-                // Decides how long to sleep depending on GC count.
-                if (garbageCollected > 500) {
-                    // Heavy GC, repeat soon.
-                    std::this_thread::sleep_for(std::chrono::microseconds{200});
-                    continue;
-                }
-                if (garbageCollected > 100) {
-                    std::this_thread::sleep_for(std::chrono::milliseconds{5});
-                    continue;
-                }
-                if (garbageCollected > 10) {
-                    std::this_thread::sleep_for(std::chrono::milliseconds{100});
-                    continue;
-                }
-                std::this_thread::sleep_for(_monitoringInterval.load());
-            }
-        });
-        _monitorThread = std::unique_ptr<std::thread>(t);
-    }
-}
+}  // namespace
 
-ThreadMonitorCentralRepository::~ThreadMonitorCentralRepository() {
-    _terminating = true;
-    if (_monitorThread) {
-        _monitorThread->join();
-    }
-}
+namespace details {
 
-ThreadMonitorCentralRepository* ThreadMonitorCentralRepository::instance() {
-    return _staticInstance(true);
+bool isLivelocked(MonitorDomain::ThreadRegistration& r,
+                  const details::ThreadMonitorBase::History& history,
+                  std::chrono::system_clock::time_point now) {
+    if (history.empty()) {
+        return false;
+    }
+    for (auto h = history.rbegin(); h != history.rend(); ++h) {
+        if (isProgressCheckpoint(h->checkpointId)) {
+            r.lastProgressObserved = std::max(r.lastProgressObserved, h->timestamp);
+            break;
+        }
+    }
+    // If the ring was completely overwritten since the previous check a progress
+    // checkpoint could be lost. Unless the history is a repeating cycle, which means
+    // the same loop most likely kept running, assume the progress was there.
+    if (history.front().timestamp > r.lastObservedCheckpoint &&
+        details::findRepeatingCycle(history) == 0) {
+        r.lastProgressObserved = std::max(r.lastProgressObserved, history.front().timestamp);
+    }
+    r.lastObservedCheckpoint = history.back().timestamp;
+    return now - r.lastProgressObserved > r.progressWindow.load();
 }
 
-bool ThreadMonitorCentralRepository::instantiateWithoutMonitorThreadForTests() {
-    _staticInstance(false);
+bool snapshotMonitor(MonitorDomain::ThreadRegistration& r,
+                     details::ThreadMonitorBase::History* history,
+                     std::string* name) {
+    if (r.historySlot != nullptr) {
+        *history = details::decodeHistory(r.historySlot->ring, r.historySlot->epoch.load());
+    }
+    // Any access to r.monitor must be guarded.
+    std::lock_guard<std::mutex> elementLock(r.monitorDeletionMutex);
+    if (r.monitor == nullptr) {
+        return false;
+    }
+    if (r.historySlot == nullptr) {
+        *history = r.monitor->getHistory();
+    }
+    *name = r.monitor->name();
     return true;
 }
 
-void ThreadMonitorCentralRepository::setThreadTimeout(std::chrono::system_clock::duration timeout) {
-    _threadTimeout = timeout;
-}
-
-std::chrono::system_clock::duration ThreadMonitorCentralRepository::reportingInterval() const {
-    return _reportingInterval;
-}
-
-void ThreadMonitorCentralRepository::setReportingInterval(
-    std::chrono::system_clock::duration interval) {
-    _reportingInterval = interval;
+bool lastMonitorCheckpoint(MonitorDomain::ThreadRegistration& r,
+                           details::ThreadMonitorBase::HistoryRecord* last) {
+    std::lock_guard<std::mutex> elementLock(r.monitorDeletionMutex);
+    if (r.monitor == nullptr) {
+        return false;
+    }
+    *last = r.monitor->lastCheckpoint();
+    return true;
 }
 
-void ThreadMonitorCentralRepository::setLivenessErrorConditionDetectedCallback(
-    std::function<void()> cb) {
-    _frozenConditionCallback = cb;
+MonitorDomain::ThreadLivenessState livenessState(const MonitorDomain::ThreadRegistration& r) {
+    MonitorDomain::ThreadLivenessState state;
+    state.lastSeenAliveTimestamp = r.lastSeenAlive.load();
+    state.threadId = r.threadId;
+    state.tid = r.tid;
+    state.checkpointsPerSecond = r.checkpointRate.load(std::memory_order_relaxed);
+    state.activity =
+        r.counters != nullptr ? r.counters->lastReport().activity : ThreadActivity::kUnknown;
+    return state;
 }
 
-void ThreadMonitorCentralRepository::setMonitoringInterval(
-    std::chrono::system_clock::duration interval) {
-
+void writeSeparator(std::ostream& out, bool* first) {
+    if (!*first) {
+        out << ",";
+    }
+    *first = false;
 }
 
+}  // namespace details
 
-ThreadMonitorCentralRepository::ThreadRegistration* ThreadMonitorCentralRepository::registerThread(
-    std::thread::id threadId,
-    details::ThreadMonitorBase* monitor,
-    std::chrono::system_clock::time_point now) {
-    const int shard = std::hash<std::thread::id>{}(threadId) % kShards;
-    std::lock_guard<std::mutex> lock(std::get<2>(_registrations[shard]));
-
-    plf::colony<ThreadRegistration>& coll = std::get<0>(_registrations[shard]);
-    auto it = coll.emplace(threadId, monitor, now);
-    ThreadRegistration& r = *it;
-    return &r;
+uint32_t MonitorDomain::defaultShardCount() {
+    const uint32_t nodes = details::numaNodeCount();
+    const uint32_t shards = std::max(kMinShards, std::thread::hardware_concurrency() * 3 / 4);
+    return (shards + nodes - 1) / nodes * nodes;
 }
 
-uint32_t ThreadMonitorCentralRepository::threadCount() const {
-    uint32_t size = 0;
-    for (int shard = 0; shard < kShards; ++shard) {
-        std::lock_guard<std::mutex> lock(const_cast<std::mutex&>(std::get<2>(_registrations[shard])));
-        size += std::get<0>(_registrations[shard]).size();
-    }
-    return size;
+void MonitorDomain::setThreadHistoryDepth(uint32_t depth) {
+    threadHistoryDepthSetting() = depth;
 }
 
-std::vector<ThreadMonitorCentralRepository::ThreadLivenessState>
-ThreadMonitorCentralRepository::getAllThreadLivenessStates() const {
-    std::vector<ThreadLivenessState> states;
-    for (int shard = 0; shard < kShards; ++shard) {
-        std::lock_guard<std::mutex> lock(const_cast<std::mutex&>(std::get<2>(_registrations[shard])));
-        for (const auto& r : std::get<0>(_registrations[shard])) {
-            ThreadLivenessState state;
-            state.lastSeenAliveTimestamp = r.lastSeenAlive.load();
-            state.threadId = r.threadId;
-            states.emplace_back(std::move(state));
-        }
-    }
-    return states;
+uint32_t MonitorDomain::threadHistoryDepth() {
+    return threadHistoryDepthSetting();
 }
 
-uint32_t ThreadMonitorCentralRepository::getLivenessErrorConditionDetectedCount() const {
-    return _frozenConditionsDetected;
+details::ThreadHistoryArena& MonitorDomain::threadHistoryArena() {
+    // Leaked, the thread exit handlers release the slots after the static destruction.
+    static auto* arena = new details::ThreadHistoryArena();
+    return *arena;
 }
 
-unsigned int ThreadMonitorCentralRepository::runMonitorCycle() {
-    const auto methodStart = std::chrono::system_clock::now();
-    const auto oldestAliveTimestampThreshold = methodStart - _threadTimeout.load();
-    ThreadRegistration* frozenThread = nullptr;
-    details::ThreadMonitorBase::History frozenThreadHistory;
-    std::thread::id frozenThreadId;
-    std::string frozenThreadName;
-    unsigned int garbageCollected = 0;
-
-    for (int shard = 0; shard < kShards; ++shard) {
-        LockableColony& registration = _registrations[shard];
-        std::lock_guard<std::mutex> lock(const_cast<std::mutex&>(std::get<2>(registration)));
-        for (auto it = std::get<0>(registration).begin();
-             it != std::get<0>(registration).end();) {
-            // If the item is deleted garbage collect it.
-            const bool wasErased = _maybeGarbageCollectRecord(std::get<0>(registration), it);
-            if (wasErased) {
-                ++garbageCollected;
-                continue;  // Do not ++it, it was updated by GC.
-            }
-
-            // The 'methodStart' is slightly stale but it's not important.
-            if (it->lastSeenAlive.load() < oldestAliveTimestampThreshold) {
-                // Check the actual thread structure to be sure.
-                {
-                    // Any access to it->monitor must be guarded.
-                    std::lock_guard<std::mutex> elementLock(it->monitorDeletionMutex);
-                    if (it->monitor) {
-                        const auto lastSeen = it->monitor->lastCheckpointTime();
-                        if (std::chrono::system_clock::now() - lastSeen > _threadTimeout.load()) {
-                            frozenThread = &(*it);
-                            frozenThreadHistory = it->monitor->getHistory();
-                            frozenThreadId = it->threadId;
-                            frozenThreadName = it->monitor->name();
-                            break;
-                        }
-                    }
-                }
-            }
-
-            ++it;
-        }
-        if (frozenThread != nullptr) {
-            break;
-        }
+void MonitorDomain::deregisterThread(ThreadRegistration* registration) {
+    {
+        std::lock_guard<std::mutex> lock(registration->monitorDeletionMutex);
+        registration->monitor = nullptr;
+        registration->lastSeenAlive = std::chrono::system_clock::time_point::max();
     }
-
-    if (frozenThread != nullptr && methodStart - _lastTimeOfFaultAction > _threadTimeout.load()) {
-        _lastTimeOfFaultAction = methodStart;
-        _frozenConditionsDetected.fetch_add(1);
-        std::cerr << "Frozen thread: " << frozenThreadName << " id: " << frozenThreadId << std::endl;
-        details::ThreadMonitorBase::printHistory(frozenThreadHistory);
-        _frozenThreadAction();
+    // The registration can be reused as soon as it is pushed, thus the deletion
+    // mutex must be released before.
+    std::atomic<ThreadRegistration*>& head = *registration->retireList;
+    registration->nextRetired = head.load(std::memory_order_relaxed);
+    while (!head.compare_exchange_weak(registration->nextRetired,
+                                       registration,
+                                       std::memory_order_release,
+                                       std::memory_order_relaxed)) {
     }
-    return garbageCollected;
 }
 
-void ThreadMonitorCentralRepository::_frozenThreadAction() {
-    // Print all threads that are stale for more than configured value to
-    // avoid unnecessary verbosity.
-    std::cerr << "All stale threads:" << std::endl;
-    for (int shard = 0; shard < kShards; ++shard) {
-        const auto shardStart = std::chrono::system_clock::now();
-        std::lock_guard<std::mutex> lock(const_cast<std::mutex&>(std::get<2>(_registrations[shard])));
-        for (auto it = std::get<0>(_registrations[shard]).begin(); it != std::get<0>(_registrations[shard]).end();
-             ++it) {
-            auto lastSeenAlive = it->lastSeenAlive.load();
-            if (lastSeenAlive == std::chrono::system_clock::time_point::max() ||
-                shardStart - lastSeenAlive < kStaleThreadThreshold) {
-                continue;
-            }
-            // Need to obtain more fresh history under lock.
-            details::ThreadMonitorBase::History threadHistory;
-            std::thread::id threadId;
-            {
-                // Any access to it->monitor must be guarded.
-                std::lock_guard<std::mutex> elementLock(it->monitorDeletionMutex);
-                if (it->monitor) {
-                    threadHistory = it->monitor->getHistory();
-                    if (threadHistory.empty()) {
-                        continue;
-                    }
-                    threadId = it->threadId;
-                    lastSeenAlive = threadHistory[threadHistory.size() - 1].timestamp;
-                    if (shardStart - lastSeenAlive < kStaleThreadThreshold) {
-                        continue;
-                    }
-                    it->monitor->printHistory();
-                }
-            }
-        }
+void MonitorDomain::maybeRunMonitorSlice(std::chrono::system_clock::time_point now) {
+    if (now < _nextMonitorSlice.load(std::memory_order_relaxed) ||
+        _monitorSliceRunning.load(std::memory_order_relaxed) ||
+        _monitorSliceRunning.exchange(true, std::memory_order_acquire)) {
+        return;
     }
-
-    if (_frozenConditionCallback) {
-        _frozenConditionCallback();
+    // Another thread could finish a slice after the deadline was read.
+    if (now >= _nextMonitorSlice.load(std::memory_order_relaxed)) {
+        _nextMonitorSlice.store(_runMonitorSlice(now), std::memory_order_relaxed);
     }
+    _monitorSliceRunning.store(false, std::memory_order_release);
 }
 
-inline bool ThreadMonitorCentralRepository::_maybeGarbageCollectRecord(
-    plf::colony<ThreadRegistration>& collection, plf::colony<ThreadRegistration>::iterator& it) {
-
-    if (it->lastSeenAlive.load() == std::chrono::system_clock::time_point::max()) {
-        {
-            // Need to lock the deletion mutex to avoid deleting the element while
-            // its destructor is holding the mutex.
-            std::lock_guard<std::mutex> elementLock(it->monitorDeletionMutex);
-            assert(it->monitor == nullptr);
-        }
-        it = collection.erase(it);
-        return true;
-    }
-    return false;
-}
+// The production policies, see thread_monitor_central_repository_impl.h.
+template class BasicThreadMonitorCentralRepository<DefaultRepositoryPolicy>;
+template class BasicThreadMonitorCentralRepository<
+    RepositoryPolicy<policy::SystemClock, policy::SpinLock, policy::ColonyContainer>>;
+template class BasicThreadMonitorCentralRepository<
+    RepositoryPolicy<policy::CoarseSystemClock, std::mutex, policy::ColonyContainer>>;
+template class BasicThreadMonitorCentralRepository<
+    RepositoryPolicy<policy::CoarseSystemClock, policy::SpinLock, policy::ColonyContainer>>;
 
 }  // namespace thread_monitor
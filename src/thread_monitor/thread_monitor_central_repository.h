@@ -6,20 +6,41 @@
 
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <functional>
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <ostream>
+#include <string>
 #include <thread>
+#include <type_traits>
 #include <vector>
 
-#include "third_party/plf_colony/plf_colony.h"
+#include "thread_monitor/history_record.h"
+#include "thread_monitor/kernel_thread_state.h"
+#include "thread_monitor/monitor_stats.h"
+#include "thread_monitor/native_stack_capture.h"
+#include "thread_monitor/repository_policies.h"
+#include "thread_monitor/thread_counters.h"
+#include "thread_monitor/thread_history_arena.h"
 
 namespace thread_monitor {
 
+class ChromeTraceWriter;
+
 namespace details {
+class IntrospectionServer;
+struct StaleThreadReport;
 class ThreadMonitorBase;
 }  // namespace details
 
-class ThreadMonitorCentralRepository {
+/**
+ * The part of the repository independent of the policies, `ThreadMonitor`
+ * registers with any repository through this interface.
+ */
+class MonitorDomain {
 public:
     static inline constexpr auto kDefaultThreadTimeout = std::chrono::minutes{5};
     // How stale a thread should be to be reported in the summary when the liveness error
@@ -39,6 +60,12 @@ public:
     // the monitor cycle takes about 1 microsec.
     // The monitor is using adaptive intervals to spin more often when busy.
     static inline constexpr auto kIdleMonitorCycleInterval = std::chrono::milliseconds{500};
+    // When a liveness error is detected, the kernel state of stale threads is
+    // sampled twice with this interval to tell spinning from blocked threads.
+    static inline constexpr auto kDefaultKernelStateSamplingInterval = std::chrono::milliseconds{10};
+    // History depth of the threads using the `history_layout::ThreadArena` layout,
+    // same meaning as the `HistoryDepth` of the `history_layout::DeltaEncoded` layout.
+    static inline constexpr uint32_t kDefaultThreadHistoryDepth = 100;
 
 #pragma pack(push, 1)
     struct ThreadRegistration {
@@ -53,35 +80,326 @@ public:
         // In destructor, the monitor clears this pointer.
         details::ThreadMonitorBase* monitor;
         std::thread::id threadId;
+        // Set by the monitor when the thread must visit progress checkpoints,
+        // zero if livelock detection is disabled for this thread.
+        std::atomic<std::chrono::system_clock::duration> progressWindow;
+        // Owned by the monitor cycle: when the progress was last observed and the
+        // newest checkpoint seen by the previous cycle.
+        std::chrono::system_clock::time_point lastProgressObserved;
+        std::chrono::system_clock::time_point lastObservedCheckpoint;
+        // The history leased from the arena if the monitor uses the
+        // `history_layout::ThreadArena` layout, otherwise nullptr. It outlives
+        // the monitor and is read without the deletion mutex.
+        details::ThreadHistorySlot* historySlot;
+        // Checkpoints visited by the monitor, published with 'lastSeenAlive'.
+        std::atomic<uint64_t> checkpointCount;
+        // Owned by the monitor cycle: the publication the rate was computed from.
+        uint64_t sampledCheckpointCount;
+        std::chrono::system_clock::time_point sampledAt;
+        // Kernel thread id, used to read the scheduler state on the slow path.
+        pid_t tid;
+        // Checkpoints per second between the last two publications, set by the
+        // monitor cycle. The struct is packed, its size must remain a multiple of 8
+        // to keep the mutex and the atomics of the next element in the colony aligned.
+        std::atomic<uint32_t> checkpointRate;
+        // The retire list of the shard, see `deregisterThread()`.
+        std::atomic<ThreadRegistration*>* retireList;
+        // Links the retired registrations, then the free slots of the shard.
+        ThreadRegistration* nextRetired;
+        // Owned, nullptr unless the domain opens the thread counters. Read by the
+        // monitor cycle under the shard lock, closed when the registration is reclaimed.
+        details::ThreadCounters* counters;
 
         ThreadRegistration(std::thread::id threadId,
+                           pid_t tid,
                            details::ThreadMonitorBase* monitor,
-                           std::chrono::system_clock::time_point now) noexcept
-            : threadId(threadId), lastSeenAlive(now), monitor(monitor) {}
+                           details::ThreadHistorySlot* historySlot,
+                           std::chrono::system_clock::time_point now,
+                           std::atomic<ThreadRegistration*>* retireList,
+                           details::ThreadCounters* counters) noexcept
+            : lastSeenAlive(now), monitor(monitor), threadId(threadId),
+              progressWindow(std::chrono::system_clock::duration::zero()),
+              lastProgressObserved(now), lastObservedCheckpoint(now), historySlot(historySlot),
+              checkpointCount(0), sampledCheckpointCount(0), sampledAt(now), tid(tid),
+              checkpointRate(0), retireList(retireList), nextRetired(nullptr),
+              counters(counters) {}
+
+        ~ThreadRegistration() {
+            delete counters;
+        }
     };
 #pragma pack(pop)
+    static_assert(sizeof(ThreadRegistration) % 8 == 0,
+                  "Misaligned atomics in the next registration cause split locks");
+
+    enum class ShardPlacement {
+        // The shard is picked by the thread id hash. This is the default.
+        kThreadIdHash,
+        // The shard is picked by the thread id hash among the shards of the NUMA
+        // node the thread runs on at registration, the shards of every node are
+        // allocated on the node.
+        kNumaNode,
+    };
+
+    struct ShardingOptions {
+        // Zero picks `defaultShardCount()`.
+        uint32_t shardCount = 0;
+        ShardPlacement placement = ShardPlacement::kThreadIdHash;
+    };
+
+    struct DomainOptions {
+        // Printed in the fault reports, the pointer should remain valid for the lifetime.
+        const char* name = "default";
+        // Without the monitor thread, `runMonitorCycle()` is invoked by the owner.
+        bool withMonitorThread = true;
+        // The instrumented threads run the monitor cycle in slices instead of the
+        // monitor thread, which is not started regardless of 'withMonitorThread'.
+        // The fault reports run on a report thread started by the first fault.
+        bool cooperative = false;
+        ShardingOptions sharding;
+        // If set, the domain serves the introspection requests on this Unix domain
+        // socket path, see `startIntrospectionServer()`.
+        const char* introspectionSocket = nullptr;
+    };
 
     struct ThreadLivenessState {
         std::thread::id threadId;
+        pid_t tid;
         std::chrono::system_clock::time_point lastSeenAliveTimestamp;
+        // As of the last monitor cycle.
+        uint32_t checkpointsPerSecond;
+        // As of the last read of the thread counters, see `setThreadCountersEnabled()`.
+        ThreadActivity activity;
     };
 
     /**
-     * Returns the singleton.
+     * Filters of `queryThreadLiveness()`, all set filters must match. The staleness
+     * is checked first and costs two atomic loads, the other filters and the
+     * histories lock the monitor against deletion and copy its name or history.
      */
-    static ThreadMonitorCentralRepository* instance();
+    struct LivenessQuery {
+        // Only the threads not seen alive for at least this long.
+        std::chrono::system_clock::duration minStaleness =
+            std::chrono::system_clock::duration::zero();
+        // Only the monitors with the name starting with this prefix.
+        std::string namePrefix;
+        // Only the threads whose last visited checkpoint has this id, the scope
+        // bits are ignored.
+        std::optional<uint32_t> lastCheckpointId;
+        // Copy the names and histories of the matching threads.
+        bool withHistory = false;
+    };
 
     /**
-     * Sets the internal property to not schedule the monitoring thread for tests.
-     * Returns a dummy boolean to instantiate as a static in tests.
+     * A thread matching `queryThreadLiveness()`. The 'name' and 'history' are
+     * empty unless the query asked for the histories.
      */
-    static bool instantiateWithoutMonitorThreadForTests();
+    struct LivenessMatch {
+        ThreadLivenessState state;
+        std::string name;
+        details::History history;
+    };
+
+    /**
+     * Reported by an escalation tier, see `addEscalationTier()`.
+     */
+    struct EscalationEvent {
+        const char* tier;
+        // Start of the monitor cycle that found the threads.
+        std::chrono::system_clock::time_point timestamp;
+        // The stale threads, at most 'maxThreads' of the tier, with the names and,
+        // if the tier asks for them, the histories.
+        std::vector<LivenessMatch> threads;
+        // Stale threads over 'maxThreads', judged by the liveness timestamp only.
+        uint32_t omittedThreads;
+    };
+
+    /**
+     * A soft escalation tier reports the threads stale for longer than its
+     * 'threshold' to its 'callback', without the fault procedures. For example,
+     * warn at 50 ms, dump the histories at 1 s, while the thread timeout fault
+     * remains at 5 minutes.
+     */
+    struct EscalationTier {
+        // Name passed with the events, the pointer should remain valid.
+        const char* name = "";
+        std::chrono::system_clock::duration threshold =
+            std::chrono::system_clock::duration::zero();
+        // The tier reports at most once per this interval, zero for every cycle.
+        std::chrono::system_clock::duration minInterval =
+            std::chrono::system_clock::duration::zero();
+        uint32_t maxThreads = 16;
+        bool withHistory = false;
+        // Invoked outside of the shard locks by the monitor cycle, or by the
+        // report thread of a cooperative domain, see `addEscalationTier()`.
+        std::function<void(const EscalationEvent&)> callback;
+    };
+
+    static inline constexpr uint32_t kMaxEscalationTiers = 8;
+
+    virtual ~MonitorDomain() = default;
+
+    /**
+     * 3/4 of the hardware concurrency, at least `kMinShards`, rounded up to
+     * a multiple of the NUMA node count.
+     */
+    static uint32_t defaultShardCount();
+
+    /**
+     * Sets the history depth for the threads using the `history_layout::ThreadArena`
+     * layout. A thread picks up the new depth with its next outermost monitor,
+     * losing the previous history. The history belongs to the OS thread, thus
+     * the depth is shared by all domains.
+     */
+    static void setThreadHistoryDepth(uint32_t depth);
+    static uint32_t threadHistoryDepth();
+
+    /**
+     * The arena with the per-thread histories of the `history_layout::ThreadArena`
+     * layout, shared by all domains.
+     */
+    static details::ThreadHistoryArena& threadHistoryArena();
 
     /**
      * Thread monitors do not update the central repository on every checkpoint,
      * this is too expensive. Instead, they use this interval to update.
      */
-    std::chrono::system_clock::duration reportingInterval() const;
+    virtual std::chrono::system_clock::duration reportingInterval() const = 0;
+
+    /**
+     * Internal method to register this thread monitor with central repository.
+     * This has to be done from the monitor constructor, the destructor invokes
+     * `deregisterThread()`.
+     */
+    virtual ThreadRegistration* registerThread(std::thread::id threadId,
+                                               pid_t tid,
+                                               details::ThreadMonitorBase* monitor,
+                                               details::ThreadHistorySlot* historySlot,
+                                               std::chrono::system_clock::time_point now) = 0;
+
+    /**
+     * Internal method invoked by the monitor destructor: clears the monitor pointer
+     * and pushes the registration to the lock-free retire list of its shard. The
+     * monitor cycle reclaims the retired registrations in bulk and the next
+     * registrations of the shard reuse them. The registration must not be accessed
+     * by the caller afterwards.
+     */
+    static void deregisterThread(ThreadRegistration* registration);
+
+    /**
+     * True if the instrumented threads run the monitor cycle, see `DomainOptions`.
+     */
+    bool isCooperative() const {
+        return _cooperative;
+    }
+
+    /**
+     * Internal method invoked by the monitors of a cooperative domain when they
+     * update the liveness timestamp. If the next slice of the monitor cycle is
+     * due and no other thread runs one, runs it on the calling thread. The fault
+     * report is not run there, it is handed off to the report thread of the domain.
+     */
+    void maybeRunMonitorSlice(std::chrono::system_clock::time_point now);
+
+protected:
+    explicit MonitorDomain(bool cooperative) : _cooperative(cooperative) {}
+
+    // Scans the next few shards and returns when the next slice is due.
+    virtual std::chrono::system_clock::time_point _runMonitorSlice(
+        std::chrono::system_clock::time_point now) = 0;
+
+    // Lock contention hits harder with lower count. In the benchmarks, 30 shards
+    // is about 30% faster than 20 shards, and 40 is already in the saturation
+    // zone, thus the default scales with the hardware concurrency, see
+    // `BM_ShardedRegistration` to measure it on the target machine.
+    static inline constexpr uint32_t kMinShards = 8;
+    // Smallest colony block allocated by the registration.
+    static inline constexpr size_t kMinRegistrationBlock = 8;
+    // Reclaimed registrations kept by a shard for its next registrations. After
+    // a burst the ones beyond are erased by the garbage collection, which also
+    // releases the emptied blocks.
+    static inline constexpr size_t kMaxFreeRegistrations = 256;
+    // Shards scanned by one slice of the cooperative monitor cycle.
+    static inline constexpr uint32_t kShardsPerMonitorSlice = 4;
+
+private:
+    const bool _cooperative;
+    std::atomic<std::chrono::system_clock::time_point> _nextMonitorSlice{
+        std::chrono::system_clock::time_point::min()};
+    // Try-lock, only one thread runs a slice.
+    std::atomic<bool> _monitorSliceRunning{false};
+};
+
+/**
+ * Registry of the thread monitors of one domain and the monitor cycle
+ * detecting the frozen threads. `Policy` is a `RepositoryPolicy` selecting the
+ * monitor cycle clock, the shard lock and the shard container, the
+ * repository is explicitly instantiated for the policies in
+ * `repository_policies.h`. `ThreadMonitorCentralRepository` is the default.
+ */
+template <typename Policy = DefaultRepositoryPolicy>
+class BasicThreadMonitorCentralRepository : public MonitorDomain {
+public:
+    using Clock = typename Policy::Clock;
+    using ShardLock = typename Policy::ShardLock;
+    using RegistrationColony =
+        typename Policy::Container::template Type<ThreadRegistration>;
+
+    // Only the default policy has the singleton and its monitor thread, the
+    // domains of the other policies are created explicitly.
+    template <typename P>
+    using IfDefaultPolicy = std::enable_if_t<std::is_same_v<P, DefaultRepositoryPolicy>>;
+
+    /**
+     * Returns the singleton, the default monitor domain.
+     */
+    template <typename P = Policy, typename = IfDefaultPolicy<P>>
+    static BasicThreadMonitorCentralRepository* instance() {
+        return _staticInstance(true, ShardingOptions(), nullptr);
+    }
+
+    /**
+     * Creates an independent monitor domain, e.g. per subsystem. A domain has
+     * its own registrations, monitor thread, timeouts and callbacks, the
+     * `ThreadMonitor` instances are bound to it with the constructor taking
+     * the domain. A thread can be monitored by only one domain at a time: the
+     * nested monitors are disabled regardless of their domain.
+     * The domain must outlive all monitors bound to it.
+     */
+    explicit BasicThreadMonitorCentralRepository(const DomainOptions& options);
+    ~BasicThreadMonitorCentralRepository();
+
+    BasicThreadMonitorCentralRepository(const BasicThreadMonitorCentralRepository&) = delete;
+    BasicThreadMonitorCentralRepository& operator=(const BasicThreadMonitorCentralRepository&) =
+        delete;
+
+    const char* name() const;
+
+    /**
+     * Sets the internal property to not schedule the monitoring thread for tests.
+     * Returns a dummy boolean to instantiate as a static in tests.
+     */
+    template <typename P = Policy, typename = IfDefaultPolicy<P>>
+    static bool instantiateWithoutMonitorThreadForTests() {
+        _staticInstance(false, ShardingOptions(), nullptr);
+        return true;
+    }
+
+    /**
+     * Instantiates the singleton with the 'sharding' options, must be invoked before
+     * the first `instance()` call. Returns false if the singleton already exists.
+     */
+    template <typename P = Policy, typename = IfDefaultPolicy<P>>
+    static bool instantiateWithSharding(const ShardingOptions& sharding) {
+        bool created = false;
+        _staticInstance(true, sharding, &created);
+        return created;
+    }
+
+    uint32_t shardCount() const;
+    ShardPlacement shardPlacement() const;
+
+    std::chrono::system_clock::duration reportingInterval() const override;
 
     /**
      * Changes how often the new thread monitors will need to update the liveness
@@ -108,6 +426,63 @@ public:
      */
     void setLivenessErrorConditionDetectedCallback(std::function<void()> cb);
 
+    /**
+     * Adds an escalation tier, evaluated by the same scan of the monitor cycle as
+     * the thread timeout. A thread is reported by every tier whose threshold it
+     * exceeds. The staleness is measured from the liveness timestamp, so keep the
+     * `reportingInterval()` well below the lowest threshold, and confirmed with the
+     * last checkpoint of the monitor. With the cooperative monitor the scan is
+     * split in slices, and the slices after a report wait for the next interval.
+     * The callbacks run on the thread of the monitor cycle: the monitor thread,
+     * the caller of `runMonitorCycle()`, or for the slices run by the checkpoints
+     * of a cooperative domain, its report thread. Returns false if there are
+     * `kMaxEscalationTiers` tiers already.
+     */
+    bool addEscalationTier(const EscalationTier& tier);
+
+    void clearEscalationTiers();
+
+    /**
+     * Sets the interval between the two kernel state samples taken for every stale
+     * thread when the liveness error is detected. Zero disables the sampling.
+     */
+    void setKernelStateSamplingInterval(std::chrono::system_clock::duration interval);
+
+    /**
+     * When the liveness error is detected, signal every stale thread to capture its
+     * native stack and wait up to 'timeout' for all of them. Zero (the default)
+     * disables the capture. The signal handler is installed on the first capture.
+     */
+    void setNativeStackCaptureTimeout(std::chrono::system_clock::duration timeout);
+
+    /**
+     * Opens the `details::ThreadCounters` of the threads registered afterwards, one
+     * or two `perf_event_open` syscalls per registration. The monitor cycle reads
+     * the counters of the threads stale for half of the thread timeout, and the
+     * reports classify the frozen threads as spinning, stalled or idle. The
+     * escalation events carry the activity of the last read. Disabled by default.
+     */
+    void setThreadCountersEnabled(bool enabled);
+
+    /**
+     * Capacity hint before a burst of thread registrations, e.g. at startup.
+     * Preallocates the registrations of every empty shard for 'expectedThreads'
+     * in total, so the registrations do not allocate; the shards which already
+     * have registrations keep growing by blocks allocated outside of the shard
+     * lock. With 'hugePages' the following blocks of this domain are carved from
+     * memory mapped with huge pages, which is only worth it for many thousands
+     * of threads. The unused capacity is kept until `trim()`, or until the garbage
+     * collection erases the free registrations of a shard beyond
+     * `kMaxFreeRegistrations` after a burst of thread exits.
+     */
+    void reserve(uint32_t expectedThreads, bool hugePages = false);
+
+    /**
+     * Releases the unused registration blocks, e.g. after the registrations from
+     * a burst were garbage collected.
+     */
+    void trim();
+
     /**
      * Approximate (stale) count of registered threads.
      * The count should sum several shards, each shard is locked separately.
@@ -119,6 +494,12 @@ public:
      */
     uint32_t getLivenessErrorConditionDetectedCount() const;
 
+    /**
+     * Returns how many of the liveness errors were livelocks: threads that kept
+     * visiting checkpoints but no progress checkpoint within their progress window.
+     */
+    uint32_t getLivelockDetectedCount() const;
+
     /**
      * Returns the snapshot of all instrumented threads with latest
      * liveness timestamp for every thread. Timestamps are stale to the
@@ -127,14 +508,82 @@ public:
     std::vector<ThreadLivenessState> getAllThreadLivenessStates() const;
 
     /**
-     * Internal method to register this thread monitor with central repository.
-     * This has to be done from the monitor constructor. There is no de-registration
-     * method. Instead, the monitor clears the pointer to itself and the repository garbage
-     * collects the removed monitors later.
+     * Streams the threads matching the 'query' to 'visit' without a snapshot of all
+     * threads. The registrations are filtered in batches under the shard lock, the
+     * matches of a batch are passed to 'visit' after the lock is released, thus
+     * neither the lock hold time nor the memory depends on the thread count.
+     * A thread registered or deregistered during the query can be skipped.
      */
+    void queryThreadLiveness(const LivenessQuery& query,
+                             const std::function<void(const LivenessMatch&)>& visit) const;
+
+    /**
+     * Same as `queryThreadLiveness()`, copies the matches to the output iterator
+     * 'out' of `LivenessMatch` and returns it.
+     */
+    template <typename OutputIt>
+    OutputIt copyThreadLiveness(const LivenessQuery& query, OutputIt out) const {
+        queryThreadLiveness(query, [&out](const LivenessMatch& match) { *out++ = match; });
+        return out;
+    }
+
+    /**
+     * Returns the stats of the last complete monitor cycle, without locking.
+     * Use `writePrometheusText()` to export them.
+     */
+    MonitorStats stats() const;
+
+    /**
+     * Writes the checkpoint histories of all registered threads as Chrome Trace
+     * Event JSON, see `ChromeTraceWriter`. The registrations are copied in small
+     * batches, thus neither the memory nor the shard lock hold time depends on
+     * the thread count.
+     */
+    void writeChromeTrace(std::ostream& out) const;
+
+    /**
+     * Starts appending the histories of all registered threads to the Chrome
+     * Trace Event JSON file at 'path' on every monitor cycle, for 'duration'.
+     * Every cycle writes the checkpoints visited since the previous one, unless
+     * the history depth was exceeded in between, thus reduce the monitoring
+     * interval for the capture. Returns false if a capture is already running
+     * or the file cannot be created.
+     */
+    bool startTraceCapture(const std::string& path, std::chrono::system_clock::duration duration);
+
+    /**
+     * Finishes the running capture, if any, and closes the file.
+     */
+    void stopTraceCapture();
+
+    bool isTraceCaptureActive() const;
+
+    /**
+     * Starts serving the snapshots of this domain on the Unix domain socket at
+     * 'path', for local debugging with `thread_monitor_cli`. A request is one
+     * command line, see `writeIntrospection()`. Returns false if the server is
+     * already running or the socket cannot be bound.
+     */
+    bool startIntrospectionServer(const std::string& path);
+
+    void stopIntrospectionServer();
+
+    /**
+     * Writes the response to an introspection 'command':
+     * `states` - JSON of `getAllThreadLivenessStates()`,
+     * `histories` - JSON of the checkpoint histories of all threads,
+     * `stats` - `stats()` in the Prometheus text format,
+     * `trace` - `writeChromeTrace()`.
+     * The registrations are copied in batches and serialized outside of the
+     * shard lock, thus the lock hold time does not depend on the thread count.
+     */
+    void writeIntrospection(const std::string& command, std::ostream& out) const;
+
     ThreadRegistration* registerThread(std::thread::id threadId,
+                                       pid_t tid,
                                        details::ThreadMonitorBase* monitor,
-                                       std::chrono::system_clock::time_point now);
+                                       details::ThreadHistorySlot* historySlot,
+                                       std::chrono::system_clock::time_point now) override;
 
     /**
      * Internal method to start a monitor cycle. Can be invoked directly in tests.
@@ -143,24 +592,83 @@ public:
      */
     unsigned int runMonitorCycle();
 
-protected:
-    ThreadMonitorCentralRepository(bool withMonitorThread = true);
-    ~ThreadMonitorCentralRepository();
-
 private:
-    // Lock contention hits harder with lower count.
-    // In the benchmarks, 30 shards is about 30% faster than 20 shards, and
-    // 40 is already in the saturation zone.
-    static inline constexpr int kShards = 36;
+    void _frozenThreadAction();
+
+    std::chrono::system_clock::time_point _runMonitorSlice(
+        std::chrono::system_clock::time_point now) override;
+
+    // Scans 'count' shards from 'firstShard', wrapping around. Returns the count
+    // of GC elements. From a checkpoint the fault report is handed off to the
+    // report thread, see `_postReport()`.
+    unsigned int _scanShards(uint32_t firstShard, uint32_t count, bool fromCheckpoint);
+
+    // Prints the frozen or livelocked thread and runs `_frozenThreadAction()`.
+    void _reportFrozenThread(const details::StaleThreadReport& frozen,
+                             bool livelocked,
+                             std::chrono::system_clock::duration noProgressDuration);
+
+    // Queues the 'report' for the report thread, which is started by the first one.
+    // Also runs the trace snapshots of the cooperative cycles.
+    void _postReport(std::function<void()> report);
+
+    // Publishes the stats of a full `runMonitorCycle()`. The stats of a cooperative
+    // 'slice' are added to the slices of the current cycle instead, which are
+    // published together when the slice ending with the last shard is scanned.
+    void _addCycleStats(const MonitorStats& scanned, bool slice, bool cycleComplete);
+
+    // Invokes 'visit' for every registration under the shard lock, releasing the
+    // lock and invoking 'endBatch' after every 'batchSize' registrations. The scan
+    // of the shard resumes by position, a registration can be skipped or visited
+    // twice if the shard changed while it was unlocked.
+    template <typename Visit, typename EndBatch>
+    void _visitRegistrations(uint32_t batchSize, Visit visit, EndBatch endBatch) const;
+
+    // Copies the histories of all registered threads to 'writer'.
+    void _writeTraceSnapshot(ChromeTraceWriter& writer) const;
+
+    // Appends the trace snapshot if a capture is running.
+    void _maybeCaptureTrace(std::chrono::system_clock::time_point now);
+
+    // Sleeps in the monitor thread, wakes up early on termination.
+    void _monitorSleep(std::chrono::system_clock::duration duration);
+
+    static BasicThreadMonitorCentralRepository* _staticInstance(bool withMonitorThread,
+                                                                const ShardingOptions& sharding,
+                                                                bool* created);
+
+    // The retired registrations reclaimed by the monitor cycle, reused by the next
+    // registrations of the shard. Guarded by the shard lock.
+    struct FreeSlots {
+        ThreadRegistration* head = nullptr;
+        size_t count = 0;
+    };
 
-    // Returns 'was deleted'. If deleted, changes iterator in place.
-    // Precondition: must be invoked under lock.
-    bool _maybeGarbageCollectRecord(plf::colony<ThreadRegistration>& collection,
-                                    plf::colony<ThreadRegistration>::iterator& it);
+    // The retire list head is on its own cache line, it is written by the
+    // deregistering threads without the shard lock.
+    using LockableColony = std::tuple<RegistrationColony,
+                                      char[16],
+                                      ShardLock,
+                                      FreeSlots,
+                                      char[64],
+                                      std::atomic<ThreadRegistration*>,
+                                      char[56]>;
 
-    void _frozenThreadAction();
+    // Moves the retired registrations of the 'shard' to its free slots under one
+    // short shard lock hold. Returns the count of reclaimed registrations.
+    unsigned int _reclaimRetired(LockableColony& shard);
+
+    // Erases the free slots of the 'shard' beyond the first 'keep' in one pass
+    // over the registrations and releases the emptied blocks. Under the shard lock.
+    void _eraseFreeSlots(LockableColony& shard, size_t keep);
+
+    LockableColony& _shard(uint32_t index) const;
 
-    static ThreadMonitorCentralRepository* _staticInstance(bool withMonitorThread);
+    details::RegistrationAllocator<ThreadRegistration> _registrationAllocator() {
+        return details::RegistrationAllocator<ThreadRegistration>(&_registrationArena);
+    }
+    // Picks the shard for the registration of the calling thread.
+    LockableColony& _shardForThread(std::thread::id threadId);
 
     std::atomic<std::chrono::system_clock::duration> _threadTimeout =
         std::chrono::duration_cast<std::chrono::system_clock::duration>(kDefaultThreadTimeout);
@@ -171,25 +679,93 @@ private:
     std::atomic<std::chrono::system_clock::duration> _monitoringInterval =
         std::chrono::duration_cast<std::chrono::system_clock::duration>(kIdleMonitorCycleInterval);
 
+    std::atomic<std::chrono::system_clock::duration> _kernelStateSamplingInterval =
+        std::chrono::duration_cast<std::chrono::system_clock::duration>(
+            kDefaultKernelStateSamplingInterval);
+
+    std::atomic<std::chrono::system_clock::duration> _nativeStackCaptureTimeout =
+        std::chrono::system_clock::duration::zero();
+
+    std::atomic<bool> _threadCountersEnabled{false};
+    // Held by the monitor cycle reading the counters of the stale threads after
+    // the shard lock is released, and while the reclaimed counters are closed.
+    std::mutex _countersMutex;
+
+    const char* const _name;
+
     // This is invoked when the thread liveness failure condition is detected.
     std::function<void()> _frozenConditionCallback;
 
-    std::chrono::system_clock::time_point _lastTimeOfFaultAction = std::chrono::system_clock::now();
+    struct EscalationTierState {
+        EscalationTier tier;
+        std::chrono::system_clock::time_point lastReport;
+    };
+    // Guards the tiers, taken once per scan.
+    std::mutex _escalationMutex;
+    std::vector<EscalationTierState> _escalationTiers;
+    // Read without the mutex to skip the tiers when there are none.
+    std::atomic<uint32_t> _escalationTierCount{0};
+
+    // Claimed by the scan that reports, the tests may run a cycle concurrently
+    // with the monitor thread.
+    std::atomic<std::chrono::system_clock::time_point> _lastTimeOfFaultAction{Clock::now()};
 
     std::atomic<bool> _terminating{false};
+    std::mutex _monitorSleepMutex;
+    std::condition_variable _monitorWakeup;
     std::unique_ptr<std::thread> _monitorThread;
+    // The fault reports and the trace snapshots of the cooperative slices, which
+    // must not run inside the checkpoint of an instrumented thread. Guarded by
+    // `_monitorSleepMutex`.
+    std::deque<std::function<void()>> _pendingReports;
+    std::unique_ptr<std::thread> _reportThread;
+
+    // The first shard of the next cooperative slice, owned by the slice runner.
+    uint32_t _nextSliceShard = 0;
 
     // Separates mostly constants above from frequently changind data below.
     char __dummyCacheLinePadding[64];
 
-    using LockableColony = std::tuple<plf::colony<ThreadRegistration>, char[16], std::mutex, char[64]>;
+    const uint32_t _numaNodes;
+    const uint32_t _shardsPerNode;
+    const uint32_t _shardCount;
+    const ShardPlacement _shardPlacement;
+    // The registration blocks of all shards, see `reserve()`.
+    details::RegistrationArena _registrationArena;
     // Keeps all thread registrations in the pointer-stable, continuous
     // collection. A non-locked shard is picked at registration time. Each shard
-    // has its own mutex.
-    std::array<LockableColony, kShards> _registrations;
+    // has its own mutex. The shards of every NUMA node are allocated on the node.
+    std::vector<LockableColony*> _nodeShards;
 
     // Stats.
-    std::atomic<uint32_t> _frozenConditionsDetected;
+    std::atomic<uint32_t> _frozenConditionsDetected{0};
+    std::atomic<uint32_t> _livelocksDetected{0};
+    // Guards the slices of the cooperative cycle in progress and the totals, the
+    // tests may run a full cycle concurrently with the slices or the monitor thread.
+    std::mutex _cycleStatsMutex;
+    MonitorStats _sliceStats;
+    MonitorStats _cycleTotals;
+    details::MonitorStatsCell _publishedStats;
+
+    struct TraceCapture;
+    std::atomic<bool> _traceCaptureActive{false};
+    std::mutex _traceCaptureMutex;
+    std::unique_ptr<TraceCapture> _traceCapture;
+
+    std::mutex _introspectionMutex;
+    std::unique_ptr<details::IntrospectionServer> _introspectionServer;
 };
 
+using ThreadMonitorCentralRepository = BasicThreadMonitorCentralRepository<>;
+
+// The production policies are instantiated by the library, the other policies by
+// the users of thread_monitor_central_repository_impl.h.
+extern template class BasicThreadMonitorCentralRepository<DefaultRepositoryPolicy>;
+extern template class BasicThreadMonitorCentralRepository<
+    RepositoryPolicy<policy::SystemClock, policy::SpinLock, policy::ColonyContainer>>;
+extern template class BasicThreadMonitorCentralRepository<
+    RepositoryPolicy<policy::CoarseSystemClock, std::mutex, policy::ColonyContainer>>;
+extern template class BasicThreadMonitorCentralRepository<
+    RepositoryPolicy<policy::CoarseSystemClock, policy::SpinLock, policy::ColonyContainer>>;
+
 }  // namespace thread_monitor
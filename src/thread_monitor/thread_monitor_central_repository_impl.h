@@ -0,0 +1,1222 @@
+// Author: Andrew Shuvalov
+//
+// Documentation: https://github.com/shuvalov-mdb/thread-liveness-monitor
+
+#pragma once
+
+// Member definitions of `BasicThreadMonitorCentralRepository`. The library only
+// instantiates the production policies, a translation unit using another policy,
+// e.g. a benchmark of `policy::NoLock`, includes this file and instantiates it.
+
+#include "thread_monitor/thread_monitor_central_repository.h"
+
+#include <algorithm>
+#include <array>
+#include <fstream>
+#include <iostream>
+
+#include "thread_monitor/chrome_trace_writer.h"
+#include "thread_monitor/introspection_server.h"
+#include "thread_monitor/numa_topology.h"
+#include "thread_monitor/thread_monitor.h"
+
+namespace thread_monitor {
+namespace details {
+
+// Collected under the shard lock and printed after the lock is released.
+struct StaleThreadReport {
+    std::string name;
+    std::thread::id threadId;
+    pid_t tid;
+    details::ThreadMonitorBase::History history;
+    ThreadCounterReport counters;
+};
+
+// Updates the progress observed for a thread that must visit progress checkpoints
+// from its full 'history' and returns true if it did not visit one within its window.
+// Only invoked when the last checkpoints seen by the cycles had no progress.
+// Precondition: invoked by the monitor cycle, which owns the progress fields.
+bool isLivelocked(MonitorDomain::ThreadRegistration& r,
+                  const details::ThreadMonitorBase::History& history,
+                  std::chrono::system_clock::time_point now);
+
+// Copies the history and the name of the registered monitor, returns false if
+// the monitor is deleted. The arena history outlives the monitor and is decoded
+// before taking the deletion mutex, which then only guards the name.
+bool snapshotMonitor(MonitorDomain::ThreadRegistration& r,
+                     details::ThreadMonitorBase::History* history,
+                     std::string* name);
+
+// Copies the last checkpoint of the registered monitor, returns false if the
+// monitor is deleted.
+bool lastMonitorCheckpoint(MonitorDomain::ThreadRegistration& r,
+                           details::ThreadMonitorBase::HistoryRecord* last);
+
+// Registrations copied under one shard lock hold by the trace snapshots.
+static inline constexpr uint32_t kTraceBatchRegistrations = 64;
+
+// Same for the introspection requests, the states are much smaller than histories.
+static inline constexpr uint32_t kIntrospectionStateBatch = 1024;
+
+MonitorDomain::ThreadLivenessState livenessState(const MonitorDomain::ThreadRegistration& r);
+
+// Writes the separator before every element of a JSON array but the first.
+void writeSeparator(std::ostream& out, bool* first);
+
+struct TraceRecord {
+    // Keys the trace track, the kernel thread ids can repeat.
+    const void* registration;
+    pid_t tid;
+    std::string name;
+    details::ThreadMonitorBase::History history;
+};
+
+// The escalation tiers due in one scan and the threads found for them.
+struct EscalationScan {
+    uint32_t count = 0;
+    // Index in the repository tiers and a copy of the settings.
+    std::array<uint32_t, MonitorDomain::kMaxEscalationTiers> tierIndex;
+    std::array<std::chrono::system_clock::duration, MonitorDomain::kMaxEscalationTiers>
+        threshold;
+    std::array<uint32_t, MonitorDomain::kMaxEscalationTiers> maxThreads;
+    std::array<bool, MonitorDomain::kMaxEscalationTiers> withHistory;
+    std::array<MonitorDomain::EscalationEvent, MonitorDomain::kMaxEscalationTiers> events;
+    // The registrations less stale than this are not checked further.
+    std::chrono::system_clock::duration minThreshold = std::chrono::system_clock::duration::max();
+
+    // Adds the registration stale for 'staleness' by the liveness timestamp to
+    // the events of all tiers it exceeds, after checking its last checkpoint.
+    void addThread(MonitorDomain::ThreadRegistration& r,
+                   std::chrono::system_clock::duration staleness,
+                   std::chrono::system_clock::time_point now,
+                   std::chrono::system_clock::time_point enabledSince) {
+        MonitorDomain::LivenessMatch match;
+        bool checked = false;
+        for (uint32_t i = 0; i < count; ++i) {
+            if (staleness < threshold[i]) {
+                continue;
+            }
+            if (events[i].threads.size() >= maxThreads[i]) {
+                ++events[i].omittedThreads;
+                continue;
+            }
+            if (!checked) {
+                checked = true;
+                std::lock_guard<std::mutex> elementLock(r.monitorDeletionMutex);
+                if (r.monitor == nullptr) {
+                    return;
+                }
+                staleness = now - std::max(r.monitor->lastCheckpointTime(), enabledSince);
+                match.name = r.monitor->name();
+                match.state = livenessState(r);
+            }
+            if (staleness < threshold[i]) {
+                continue;
+            }
+            events[i].threads.push_back(match);
+            if (withHistory[i]) {
+                std::string name;
+                snapshotMonitor(r, &events[i].threads.back().history, &name);
+            }
+        }
+    }
+};
+
+}  // namespace details
+
+template <typename Policy>
+struct BasicThreadMonitorCentralRepository<Policy>::TraceCapture {
+    std::ofstream file;
+    ChromeTraceWriter writer{file};
+    std::chrono::system_clock::time_point end;
+
+    explicit TraceCapture(const std::string& path) : file(path) {}
+};
+
+template <typename Policy>
+BasicThreadMonitorCentralRepository<Policy>*
+BasicThreadMonitorCentralRepository<Policy>::_staticInstance(
+    bool withMonitorThread, const ShardingOptions& sharding, bool* created) {
+    static BasicThreadMonitorCentralRepository* inst = [&] {
+        if (created != nullptr) {
+            *created = true;
+        }
+        DomainOptions options;
+        options.withMonitorThread = withMonitorThread;
+        options.sharding = sharding;
+        return new BasicThreadMonitorCentralRepository(options);
+    }();
+    return inst;
+}
+
+template <typename Policy>
+BasicThreadMonitorCentralRepository<Policy>::BasicThreadMonitorCentralRepository(
+    const DomainOptions& options)
+    : MonitorDomain(options.cooperative),
+      _name(options.name),
+      _numaNodes(details::numaNodeCount()),
+      _shardsPerNode(((options.sharding.shardCount > 0 ? options.sharding.shardCount
+                                                       : defaultShardCount()) +
+                      _numaNodes - 1) /
+                     _numaNodes),
+      _shardCount(_shardsPerNode * _numaNodes),
+      _shardPlacement(options.sharding.placement) {
+    for (uint32_t node = 0; node < _numaNodes; ++node) {
+        auto* shards = static_cast<LockableColony*>(
+            details::allocateOnNumaNode(_shardsPerNode * sizeof(LockableColony), node));
+        for (uint32_t i = 0; i < _shardsPerNode; ++i) {
+            new (shards + i) LockableColony(std::allocator_arg, _registrationAllocator());
+        }
+        _nodeShards.push_back(shards);
+    }
+    if (options.withMonitorThread && !options.cooperative) {
+        auto* t = new std::thread([this] {
+            _monitorSleep(std::chrono::milliseconds{1});
+            while (!_terminating) {
+                // This does both GC and frozen thread detection.
+                // In steady production load with up to 1k threads this cycle takes
+                // about 1 microsec, so not much over head to run every few millis.
+                const auto garbageCollected = runMonitorCycle();
+                // Decides how long to sleep depending on GC count.
+                if (garbageCollected > 500) {
+                    // Heavy GC, repeat soon.
+                    _monitorSleep(std::chrono::microseconds{200});
+                    continue;
+                }
+                if (garbageCollected > 100) {
+                    _monitorSleep(std::chrono::milliseconds{5});
+                    continue;
+                }
+                if (garbageCollected > 10) {
+                    _monitorSleep(std::chrono::milliseconds{100});
+                    continue;
+                }
+                _monitorSleep(_monitoringInterval.load());
+            }
+        });
+        _monitorThread = std::unique_ptr<std::thread>(t);
+    }
+    if (options.introspectionSocket != nullptr) {
+        startIntrospectionServer(options.introspectionSocket);
+    }
+}
+
+template <typename Policy>
+BasicThreadMonitorCentralRepository<Policy>::~BasicThreadMonitorCentralRepository() {
+    {
+        std::lock_guard<std::mutex> lock(_monitorSleepMutex);
+        _terminating = true;
+    }
+    _monitorWakeup.notify_all();
+    if (_monitorThread) {
+        _monitorThread->join();
+    }
+    if (_reportThread) {
+        _reportThread->join();
+    }
+    stopIntrospectionServer();
+    stopTraceCapture();
+    for (auto* shards : _nodeShards) {
+        for (uint32_t i = 0; i < _shardsPerNode; ++i) {
+            shards[i].~LockableColony();
+        }
+        details::freeOnNumaNode(shards, _shardsPerNode * sizeof(LockableColony));
+    }
+}
+
+template <typename Policy>
+void BasicThreadMonitorCentralRepository<Policy>::_monitorSleep(
+    std::chrono::system_clock::duration duration) {
+    std::unique_lock<std::mutex> lock(_monitorSleepMutex);
+    _monitorWakeup.wait_for(lock, duration, [this] { return _terminating.load(); });
+}
+
+template <typename Policy>
+const char* BasicThreadMonitorCentralRepository<Policy>::name() const {
+    return _name;
+}
+
+template <typename Policy>
+uint32_t BasicThreadMonitorCentralRepository<Policy>::shardCount() const {
+    return _shardCount;
+}
+
+template <typename Policy>
+MonitorDomain::ShardPlacement BasicThreadMonitorCentralRepository<Policy>::shardPlacement() const {
+    return _shardPlacement;
+}
+
+template <typename Policy>
+inline typename BasicThreadMonitorCentralRepository<Policy>::LockableColony&
+BasicThreadMonitorCentralRepository<Policy>::_shard(uint32_t index) const {
+    return _nodeShards[index / _shardsPerNode][index % _shardsPerNode];
+}
+
+template <typename Policy>
+typename BasicThreadMonitorCentralRepository<Policy>::LockableColony&
+BasicThreadMonitorCentralRepository<Policy>::_shardForThread(std::thread::id threadId) {
+    const size_t hash = std::hash<std::thread::id>{}(threadId);
+    if (_shardPlacement == ShardPlacement::kNumaNode) {
+        return _nodeShards[details::currentNumaNode()][hash % _shardsPerNode];
+    }
+    return _shard(hash % _shardCount);
+}
+
+template <typename Policy>
+void BasicThreadMonitorCentralRepository<Policy>::setThreadTimeout(
+    std::chrono::system_clock::duration timeout) {
+    _threadTimeout = timeout;
+}
+
+template <typename Policy>
+std::chrono::system_clock::duration
+BasicThreadMonitorCentralRepository<Policy>::reportingInterval() const {
+    return _reportingInterval;
+}
+
+template <typename Policy>
+void BasicThreadMonitorCentralRepository<Policy>::setReportingInterval(
+    std::chrono::system_clock::duration interval) {
+    _reportingInterval = interval;
+}
+
+template <typename Policy>
+void BasicThreadMonitorCentralRepository<Policy>::setLivenessErrorConditionDetectedCallback(
+    std::function<void()> cb) {
+    _frozenConditionCallback = cb;
+}
+
+template <typename Policy>
+bool BasicThreadMonitorCentralRepository<Policy>::addEscalationTier(const EscalationTier& tier) {
+    std::lock_guard<std::mutex> lock(_escalationMutex);
+    if (_escalationTiers.size() >= kMaxEscalationTiers) {
+        return false;
+    }
+    _escalationTiers.push_back({tier, std::chrono::system_clock::time_point::min()});
+    _escalationTierCount = _escalationTiers.size();
+    return true;
+}
+
+template <typename Policy>
+void BasicThreadMonitorCentralRepository<Policy>::clearEscalationTiers() {
+    std::lock_guard<std::mutex> lock(_escalationMutex);
+    _escalationTiers.clear();
+    _escalationTierCount = 0;
+}
+
+template <typename Policy>
+void BasicThreadMonitorCentralRepository<Policy>::setKernelStateSamplingInterval(
+    std::chrono::system_clock::duration interval) {
+    _kernelStateSamplingInterval = interval;
+}
+
+template <typename Policy>
+void BasicThreadMonitorCentralRepository<Policy>::setNativeStackCaptureTimeout(
+    std::chrono::system_clock::duration timeout) {
+    _nativeStackCaptureTimeout = timeout;
+}
+
+template <typename Policy>
+void BasicThreadMonitorCentralRepository<Policy>::setThreadCountersEnabled(bool enabled) {
+    _threadCountersEnabled = enabled;
+}
+
+template <typename Policy>
+void BasicThreadMonitorCentralRepository<Policy>::setMonitoringInterval(
+    std::chrono::system_clock::duration interval) {
+    // Applies after the current sleep of the monitor thread.
+    _monitoringInterval = interval;
+}
+
+
+template <typename Policy>
+MonitorDomain::ThreadRegistration* BasicThreadMonitorCentralRepository<Policy>::registerThread(
+    std::thread::id threadId,
+    pid_t tid,
+    details::ThreadMonitorBase* monitor,
+    details::ThreadHistorySlot* historySlot,
+    std::chrono::system_clock::time_point now) {
+    LockableColony& shard = _shardForThread(threadId);
+    RegistrationColony& coll = std::get<0>(shard);
+    auto* const retireList = &std::get<5>(shard);
+    // The syscalls are outside of the shard lock.
+    details::ThreadCounters* const counters =
+        _threadCountersEnabled.load(std::memory_order_relaxed)
+            ? details::ThreadCounters::open(tid, now).release()
+            : nullptr;
+    size_t size;
+    {
+        std::lock_guard<ShardLock> lock(std::get<2>(shard));
+        FreeSlots& freeSlots = std::get<3>(shard);
+        if (freeSlots.head != nullptr) {
+            ThreadRegistration* r = freeSlots.head;
+            freeSlots.head = r->nextRetired;
+            --freeSlots.count;
+            // Nothing references a reclaimed registration but the shard.
+            r->~ThreadRegistration();
+            return new (r) ThreadRegistration(threadId, tid, monitor, historySlot, now, retireList,
+                                              counters);
+        }
+        size = coll.size();
+        // There is a free slot if the colony is not full, it will not allocate.
+        if (size < coll.capacity()) {
+            return &*coll.emplace(threadId, tid, monitor, historySlot, now, retireList, counters);
+        }
+    }
+    // The colony is full. Allocate the next block outside of the lock, same size
+    // as the colony would, and link it to the shard.
+    RegistrationColony block(_registrationAllocator());
+    block.reserve(std::max<size_t>(size, kMinRegistrationBlock));
+    ThreadRegistration* r =
+        &*block.emplace(threadId, tid, monitor, historySlot, now, retireList, counters);
+    std::lock_guard<ShardLock> lock(std::get<2>(shard));
+    if (coll.size() < coll.capacity()) {
+        // A concurrent registration has grown the shard meanwhile. Nothing
+        // references the copy in the block, it returns to the allocator with the
+        // block after the lock is released.
+        return &*coll.emplace(threadId, tid, monitor, historySlot, now, retireList, counters);
+    }
+    coll.splice(block);
+    return r;
+}
+
+template <typename Policy>
+void BasicThreadMonitorCentralRepository<Policy>::reserve(uint32_t expectedThreads,
+                                                          bool hugePages) {
+    // Shards are picked by the thread id hash, leave room for the imbalance.
+    const size_t perShard = expectedThreads / _shardCount * 5 / 4 + kMinRegistrationBlock;
+    if (hugePages) {
+        // Every block also has the container overhead per element and a header.
+        _registrationArena.reserve(
+            _shardCount *
+            (perShard * (sizeof(ThreadRegistration) + Policy::Container::kElementOverhead) + 256));
+    }
+    for (uint32_t shard = 0; shard < _shardCount; ++shard) {
+        RegistrationColony& coll = std::get<0>(_shard(shard));
+        {
+            std::lock_guard<ShardLock> lock(std::get<2>(_shard(shard)));
+            if (!coll.empty() || coll.capacity() >= perShard) {
+                // The registrations allocate their next blocks outside of the lock.
+                continue;
+            }
+        }
+        RegistrationColony reserved(_registrationAllocator());
+        reserved.reserve(perShard);
+        std::lock_guard<ShardLock> lock(std::get<2>(_shard(shard)));
+        if (coll.empty()) {
+            coll.swap(reserved);
+        }
+    }
+}
+
+template <typename Policy>
+void BasicThreadMonitorCentralRepository<Policy>::trim() {
+    for (uint32_t shard = 0; shard < _shardCount; ++shard) {
+        _reclaimRetired(_shard(shard));
+        std::lock_guard<ShardLock> lock(std::get<2>(_shard(shard)));
+        _eraseFreeSlots(_shard(shard), 0);
+    }
+}
+
+template <typename Policy>
+void BasicThreadMonitorCentralRepository<Policy>::_eraseFreeSlots(LockableColony& shard,
+                                                                  size_t keep) {
+    RegistrationColony& coll = std::get<0>(shard);
+    FreeSlots& freeSlots = std::get<3>(shard);
+    if (freeSlots.count <= keep) {
+        return;
+    }
+    // The erased slots are detached from the free list and linked to themselves,
+    // which no other registration is, then erased in one pass: looking up every
+    // slot is linear with the list container.
+    ThreadRegistration** link = &freeSlots.head;
+    for (size_t i = 0; i < keep; ++i) {
+        link = &(*link)->nextRetired;
+    }
+    for (ThreadRegistration* r = *link; r != nullptr;) {
+        ThreadRegistration* const next = r->nextRetired;
+        r->nextRetired = r;
+        r = next;
+    }
+    *link = nullptr;
+    freeSlots.count = keep;
+    for (auto it = coll.begin(); it != coll.end();) {
+        if (it->nextRetired == &*it) {
+            it = coll.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    coll.trim();
+}
+
+template <typename Policy>
+uint32_t BasicThreadMonitorCentralRepository<Policy>::threadCount() const {
+    uint32_t size = 0;
+    for (uint32_t shard = 0; shard < _shardCount; ++shard) {
+        std::lock_guard<ShardLock> lock(const_cast<ShardLock&>(std::get<2>(_shard(shard))));
+        size += std::get<0>(_shard(shard)).size() - std::get<3>(_shard(shard)).count;
+    }
+    return size;
+}
+
+template <typename Policy>
+std::vector<MonitorDomain::ThreadLivenessState>
+BasicThreadMonitorCentralRepository<Policy>::getAllThreadLivenessStates() const {
+    std::vector<ThreadLivenessState> states;
+    for (uint32_t shard = 0; shard < _shardCount; ++shard) {
+        std::lock_guard<ShardLock> lock(const_cast<ShardLock&>(std::get<2>(_shard(shard))));
+        for (const auto& r : std::get<0>(_shard(shard))) {
+            if (r.lastSeenAlive.load() != std::chrono::system_clock::time_point::max()) {
+                states.push_back(details::livenessState(r));
+            }
+        }
+    }
+    return states;
+}
+
+template <typename Policy>
+void BasicThreadMonitorCentralRepository<Policy>::queryThreadLiveness(
+    const LivenessQuery& query, const std::function<void(const LivenessMatch&)>& visit) const {
+    const auto staleBefore = Clock::now() - query.minStaleness;
+    const bool readMonitor =
+        !query.namePrefix.empty() || query.lastCheckpointId || query.withHistory;
+    std::vector<LivenessMatch> batch;
+    _visitRegistrations(
+        readMonitor ? details::kTraceBatchRegistrations : details::kIntrospectionStateBatch,
+        [&](ThreadRegistration& r) {
+            const auto lastSeenAlive = r.lastSeenAlive.load();
+            if (lastSeenAlive == std::chrono::system_clock::time_point::max() ||
+                lastSeenAlive > staleBefore) {
+                return;
+            }
+            LivenessMatch match;
+            if (readMonitor) {
+                if (!details::snapshotMonitor(r, &match.history, &match.name) ||
+                    match.name.compare(0, query.namePrefix.size(), query.namePrefix) != 0) {
+                    return;
+                }
+                if (query.lastCheckpointId &&
+                    (match.history.empty() ||
+                     scopeCheckpointId(match.history.back().checkpointId) !=
+                         *query.lastCheckpointId)) {
+                    return;
+                }
+                if (!query.withHistory) {
+                    match.name.clear();
+                    match.history.clear();
+                }
+            }
+            match.state = details::livenessState(r);
+            batch.push_back(std::move(match));
+        },
+        // Visited outside of the shard lock.
+        [&batch, &visit] {
+            for (const auto& match : batch) {
+                visit(match);
+            }
+            batch.clear();
+        });
+}
+
+template <typename Policy>
+MonitorStats BasicThreadMonitorCentralRepository<Policy>::stats() const {
+    return _publishedStats.load();
+}
+
+template <typename Policy>
+template <typename Visit, typename EndBatch>
+void BasicThreadMonitorCentralRepository<Policy>::_visitRegistrations(uint32_t batchSize,
+                                                                      Visit visit,
+                                                                      EndBatch endBatch) const {
+    for (uint32_t shard = 0; shard < _shardCount; ++shard) {
+        size_t position = 0;
+        bool shardDone = false;
+        while (!shardDone) {
+            {
+                std::lock_guard<ShardLock> lock(
+                    const_cast<ShardLock&>(std::get<2>(_shard(shard))));
+                auto& coll = const_cast<RegistrationColony&>(std::get<0>(_shard(shard)));
+                auto it = coll.begin();
+                if (position >= coll.size()) {
+                    it = coll.end();
+                } else if (position > 0) {
+                    // The colony skips whole blocks, the list steps through.
+                    using std::advance;
+                    advance(it, position);
+                }
+                uint32_t visited = 0;
+                for (; it != coll.end() && visited < batchSize; ++it, ++visited) {
+                    visit(*it);
+                }
+                position += visited;
+                shardDone = it == coll.end();
+            }
+            endBatch();
+        }
+    }
+}
+
+template <typename Policy>
+void BasicThreadMonitorCentralRepository<Policy>::_writeTraceSnapshot(
+    ChromeTraceWriter& writer) const {
+    std::vector<details::TraceRecord> batch;
+    batch.reserve(details::kTraceBatchRegistrations);
+    _visitRegistrations(
+        details::kTraceBatchRegistrations,
+        [&batch](ThreadRegistration& r) {
+            details::TraceRecord record;
+            record.registration = &r;
+            record.tid = r.tid;
+            if (details::snapshotMonitor(r, &record.history, &record.name)) {
+                batch.push_back(std::move(record));
+            }
+        },
+        // Written outside of the shard lock.
+        [&batch, &writer] {
+            for (const auto& record : batch) {
+                writer.addHistory(record.registration, record.tid, record.name, record.history);
+            }
+            batch.clear();
+        });
+    writer.endSnapshot();
+}
+
+template <typename Policy>
+void BasicThreadMonitorCentralRepository<Policy>::writeChromeTrace(std::ostream& out) const {
+    ChromeTraceWriter writer(out);
+    _writeTraceSnapshot(writer);
+    writer.finish(Clock::now());
+}
+
+template <typename Policy>
+bool BasicThreadMonitorCentralRepository<Policy>::startTraceCapture(
+    const std::string& path, std::chrono::system_clock::duration duration) {
+    std::lock_guard<std::mutex> lock(_traceCaptureMutex);
+    if (_traceCapture) {
+        return false;
+    }
+    auto capture = std::make_unique<TraceCapture>(path);
+    if (!capture->file) {
+        return false;
+    }
+    capture->end = Clock::now() + duration;
+    // The capture starts with the histories as of now.
+    _writeTraceSnapshot(capture->writer);
+    _traceCapture = std::move(capture);
+    _traceCaptureActive = true;
+    return true;
+}
+
+template <typename Policy>
+void BasicThreadMonitorCentralRepository<Policy>::stopTraceCapture() {
+    std::lock_guard<std::mutex> lock(_traceCaptureMutex);
+    if (!_traceCapture) {
+        return;
+    }
+    _traceCapture->writer.finish(Clock::now());
+    _traceCapture.reset();
+    _traceCaptureActive = false;
+}
+
+template <typename Policy>
+bool BasicThreadMonitorCentralRepository<Policy>::isTraceCaptureActive() const {
+    return _traceCaptureActive;
+}
+
+template <typename Policy>
+void BasicThreadMonitorCentralRepository<Policy>::_maybeCaptureTrace(
+    std::chrono::system_clock::time_point now) {
+    if (!_traceCaptureActive.load(std::memory_order_relaxed)) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(_traceCaptureMutex);
+        if (!_traceCapture) {
+            return;
+        }
+        _writeTraceSnapshot(_traceCapture->writer);
+        if (now < _traceCapture->end) {
+            return;
+        }
+    }
+    stopTraceCapture();
+}
+
+template <typename Policy>
+bool BasicThreadMonitorCentralRepository<Policy>::startIntrospectionServer(
+    const std::string& path) {
+    std::lock_guard<std::mutex> lock(_introspectionMutex);
+    if (_introspectionServer) {
+        return false;
+    }
+    auto server = std::make_unique<details::IntrospectionServer>(
+        [this](const std::string& command, std::ostream& out) {
+            writeIntrospection(command, out);
+        });
+    if (!server->start(path)) {
+        return false;
+    }
+    _introspectionServer = std::move(server);
+    return true;
+}
+
+template <typename Policy>
+void BasicThreadMonitorCentralRepository<Policy>::stopIntrospectionServer() {
+    std::unique_ptr<details::IntrospectionServer> server;
+    {
+        std::lock_guard<std::mutex> lock(_introspectionMutex);
+        server = std::move(_introspectionServer);
+    }
+    // Waits for the request in progress.
+    server.reset();
+}
+
+template <typename Policy>
+void BasicThreadMonitorCentralRepository<Policy>::writeIntrospection(const std::string& command,
+                                                                     std::ostream& out) const {
+    if (command == "stats") {
+        writePrometheusText(out, stats(), _name);
+        return;
+    }
+    if (command == "trace") {
+        writeChromeTrace(out);
+        return;
+    }
+    if (command != "states" && command != "histories") {
+        out << "{\"error\":\"unknown command\",\"commands\":"
+            << "[\"states\",\"histories\",\"stats\",\"trace\"]}" << std::endl;
+        return;
+    }
+
+    out << "{\"domain\":";
+    details::writeJsonString(out, _name);
+    out << ",\"threads\":[";
+    bool first = true;
+    if (command == "states") {
+        std::vector<ThreadLivenessState> batch;
+        _visitRegistrations(
+            details::kIntrospectionStateBatch,
+            [&batch](ThreadRegistration& r) {
+                if (r.lastSeenAlive.load() != std::chrono::system_clock::time_point::max()) {
+                    batch.push_back(details::livenessState(r));
+                }
+            },
+            [&] {
+                for (const auto& state : batch) {
+                    details::writeSeparator(out, &first);
+                    out << "\n{\"threadId\":\"" << state.threadId << "\",\"tid\":" << state.tid
+                        << ",\"lastSeenAlive\":" << details::toMicros(state.lastSeenAliveTimestamp)
+                        << ",\"checkpointsPerSecond\":" << state.checkpointsPerSecond
+                        << ",\"activity\":\"" << toString(state.activity) << "\"}";
+                }
+                batch.clear();
+            });
+    } else {
+        std::vector<details::TraceRecord> batch;
+        _visitRegistrations(
+            details::kTraceBatchRegistrations,
+            [&batch](ThreadRegistration& r) {
+                details::TraceRecord record;
+                record.tid = r.tid;
+                if (details::snapshotMonitor(r, &record.history, &record.name)) {
+                    batch.push_back(std::move(record));
+                }
+            },
+            [&] {
+                for (const auto& record : batch) {
+                    details::writeSeparator(out, &first);
+                    out << "\n{\"tid\":" << record.tid << ",\"name\":";
+                    details::writeJsonString(out, record.name);
+                    out << ",\"history\":[";
+                    bool firstRecord = true;
+                    for (const auto& h : record.history) {
+                        details::writeSeparator(out, &firstRecord);
+                        out << "{\"id\":" << h.checkpointId << ",\"checkpoint\":";
+                        details::writeJsonString(out, checkpointName(h.checkpointId));
+                        out << ",\"ts\":" << details::toMicros(h.timestamp)
+                            << ",\"payload\":" << h.payload << "}";
+                    }
+                    out << "]}";
+                }
+                batch.clear();
+            });
+    }
+    out << "]}" << std::endl;
+}
+
+template <typename Policy>
+uint32_t
+BasicThreadMonitorCentralRepository<Policy>::getLivenessErrorConditionDetectedCount() const {
+    return _frozenConditionsDetected;
+}
+
+template <typename Policy>
+uint32_t BasicThreadMonitorCentralRepository<Policy>::getLivelockDetectedCount() const {
+    return _livelocksDetected;
+}
+
+template <typename Policy>
+unsigned int BasicThreadMonitorCentralRepository<Policy>::runMonitorCycle() {
+    return _scanShards(0, _shardCount, false);
+}
+
+template <typename Policy>
+std::chrono::system_clock::time_point BasicThreadMonitorCentralRepository<Policy>::_runMonitorSlice(
+    std::chrono::system_clock::time_point now) {
+    // The slices do not wrap, the last one of a cycle ends with the last shard.
+    const uint32_t count = std::min(kShardsPerMonitorSlice, _shardCount - _nextSliceShard);
+    const auto garbageCollected = _scanShards(_nextSliceShard, count, true);
+    _nextSliceShard = (_nextSliceShard + count) % _shardCount;
+    if (garbageCollected > 10) {
+        // Heavy GC, the next reporting thread continues.
+        return now;
+    }
+    // The whole cycle is spread over the monitoring interval.
+    return now + _monitoringInterval.load() * count / _shardCount;
+}
+
+template <typename Policy>
+unsigned int BasicThreadMonitorCentralRepository<Policy>::_scanShards(uint32_t firstShard,
+                                                                      uint32_t count,
+                                                                      bool fromCheckpoint) {
+    const auto methodStart = Clock::now();
+    const auto oldestAliveTimestampThreshold = methodStart - _threadTimeout.load();
+    // The first frozen or livelocked thread found by the scan is reported.
+    bool frozenThread = false;
+    details::StaleThreadReport frozen{};
+    // The frozen thread keeps visiting checkpoints but makes no progress.
+    bool livelocked = false;
+    std::chrono::system_clock::duration noProgressDuration;
+    unsigned int garbageCollected = 0;
+    // A thread that stopped updating its liveness timestamp has no rate anymore.
+    const auto rateExpiration = 2 * _reportingInterval.load();
+    // The fault action is rate limited by the thread timeout.
+    auto lastFaultAction = _lastTimeOfFaultAction.load();
+    const bool faultActionDue = methodStart - lastFaultAction > _threadTimeout.load();
+    // While the monitoring is disabled the cycle only collects the garbage and the
+    // stats. Once enabled, the staleness counts from the moment of enabling, the
+    // acquire pairs with the switch storing the moment first.
+    const bool detect = details::monitoringSwitch.enabled.load(std::memory_order_acquire);
+    const auto enabledSince =
+        details::monitoringSwitch.enabledSince.load(std::memory_order_relaxed);
+    MonitorStats stats;
+    details::EscalationScan escalation;
+    if (detect && _escalationTierCount.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard<std::mutex> tiersLock(_escalationMutex);
+        for (uint32_t t = 0; t < _escalationTiers.size(); ++t) {
+            const auto& state = _escalationTiers[t];
+            if (state.lastReport > methodStart - state.tier.minInterval) {
+                continue;  // Rate limited.
+            }
+            const uint32_t i = escalation.count++;
+            escalation.tierIndex[i] = t;
+            escalation.threshold[i] = state.tier.threshold;
+            escalation.maxThreads[i] = state.tier.maxThreads;
+            escalation.withHistory[i] = state.tier.withHistory;
+            escalation.events[i].tier = state.tier.name;
+            escalation.events[i].timestamp = methodStart;
+            escalation.events[i].omittedThreads = 0;
+            escalation.minThreshold = std::min(escalation.minThreshold, state.tier.threshold);
+        }
+    }
+    // The counters are read before the thread is reported, thus the report has the
+    // activity since the previous cycle. The escalation tiers do not read them.
+    const auto countersThreshold = _threadTimeout.load() / 2;
+    // Collected under the shard lock, read with the syscalls after it is released.
+    std::vector<details::ThreadCounters*> staleCounters;
+    details::ThreadCounters* frozenCounters = nullptr;
+
+    for (uint32_t i = 0; i < count; ++i) {
+        LockableColony& registration = _shard((firstShard + i) % _shardCount);
+        ShardLock& shardLock = const_cast<ShardLock&>(std::get<2>(registration));
+        // The wait is only timed when the lock is contended.
+        if (!shardLock.try_lock()) {
+            const auto lockStart = Clock::now();
+            shardLock.lock();
+            const auto lockWait = Clock::now() - lockStart;
+            stats.shardLockWaitSum += lockWait;
+            stats.lastCycleMaxShardLockWait = std::max(stats.lastCycleMaxShardLockWait, lockWait);
+        }
+        std::unique_lock<ShardLock> lock(shardLock, std::adopt_lock);
+        for (auto it = std::get<0>(registration).begin(); it != std::get<0>(registration).end();
+             ++it) {
+            // The count is published before the timestamp, thus it is at least as
+            // new as the timestamp.
+            const auto lastSeenAlive = it->lastSeenAlive.load();
+            if (lastSeenAlive == std::chrono::system_clock::time_point::max()) {
+                continue;  // Retired or free, reclaimed after the scan.
+            }
+            const uint64_t checkpoints = it->checkpointCount.load(std::memory_order_relaxed);
+            if (lastSeenAlive > it->sampledAt) {
+                const auto elapsed = std::chrono::duration<double>(lastSeenAlive - it->sampledAt);
+                it->checkpointRate.store(
+                    static_cast<uint32_t>((checkpoints - it->sampledCheckpointCount) /
+                                          elapsed.count()),
+                    std::memory_order_relaxed);
+                it->sampledCheckpointCount = checkpoints;
+                it->sampledAt = lastSeenAlive;
+            } else if (methodStart - lastSeenAlive > rateExpiration &&
+                       it->checkpointRate.load(std::memory_order_relaxed) != 0) {
+                it->checkpointRate.store(0, std::memory_order_relaxed);
+            }
+            stats.addThread(std::max(methodStart - lastSeenAlive,
+                                     std::chrono::system_clock::duration::zero()),
+                            it->checkpointRate.load(std::memory_order_relaxed));
+
+            if (!detect) {
+                continue;
+            }
+            // Zero if the coarse clock lags behind the checkpoint timestamp.
+            const auto staleness =
+                std::max(methodStart - std::max(lastSeenAlive, enabledSince),
+                         std::chrono::system_clock::duration::zero());
+            if (it->counters != nullptr && staleness >= countersThreshold) {
+                staleCounters.push_back(it->counters);
+            }
+            if (staleness >= escalation.minThreshold) {
+                escalation.addThread(*it, staleness, methodStart, enabledSince);
+            }
+            // The 'methodStart' is slightly stale but it's not important.
+            if (std::max(lastSeenAlive, enabledSince) < oldestAliveTimestampThreshold) {
+                if (frozenThread) {
+                    continue;  // Only the first one is reported.
+                }
+                // Check the actual thread history to be sure.
+                details::ThreadMonitorBase::History history;
+                std::string name;
+                if (details::snapshotMonitor(*it, &history, &name) && !history.empty() &&
+                    Clock::now() - std::max(history.back().timestamp, enabledSince) >
+                        _threadTimeout.load()) {
+                    frozenThread = true;
+                    // The counters report is taken after they are read.
+                    frozen = {std::move(name), it->threadId, it->tid, std::move(history),
+                              ThreadCounterReport()};
+                    frozenCounters = it->counters;
+                }
+            } else if (it->progressWindow.load() != std::chrono::system_clock::duration::zero()) {
+                // The last checkpoint is compared every cycle, the full history is
+                // only copied when the window expires without a progress seen.
+                details::ThreadMonitorBase::HistoryRecord last;
+                if (!details::lastMonitorCheckpoint(*it, &last)) {
+                    continue;
+                }
+                it->lastProgressObserved = std::max(it->lastProgressObserved, enabledSince);
+                if (isProgressCheckpoint(last.checkpointId)) {
+                    it->lastProgressObserved = std::max(it->lastProgressObserved, last.timestamp);
+                }
+                if (frozenThread ||
+                    methodStart - it->lastProgressObserved <= it->progressWindow.load()) {
+                    continue;
+                }
+                details::ThreadMonitorBase::History history;
+                std::string name;
+                if (details::snapshotMonitor(*it, &history, &name) &&
+                    details::isLivelocked(*it, history, methodStart)) {
+                    frozenThread = true;
+                    frozen = {std::move(name), it->threadId, it->tid, std::move(history),
+                              ThreadCounterReport()};
+                    livelocked = true;
+                    noProgressDuration = methodStart - it->lastProgressObserved;
+                    if (faultActionDue) {
+                        // Rearm, the next report for this thread is due after another
+                        // window. Without the report it remains due.
+                        it->lastProgressObserved = methodStart;
+                    }
+                }
+            }
+        }
+        if (!staleCounters.empty() || frozenCounters != nullptr) {
+            // Taken before the shard lock is released, the collected counters cannot
+            // be closed until they are read.
+            std::lock_guard<std::mutex> countersLock(_countersMutex);
+            lock.unlock();
+            for (auto* counters : staleCounters) {
+                counters->read(methodStart);
+            }
+            staleCounters.clear();
+            if (frozenCounters != nullptr) {
+                frozen.counters = frozenCounters->lastReport();
+                frozenCounters = nullptr;
+            }
+        } else {
+            lock.unlock();
+        }
+        garbageCollected += _reclaimRetired(registration);
+    }
+
+    stats.timestamp = Clock::now();
+    stats.lastCycleDuration = stats.timestamp - methodStart;
+    stats.lastCycleGarbageCollected = garbageCollected;
+
+    for (uint32_t i = 0; i < escalation.count; ++i) {
+        auto& event = escalation.events[i];
+        if (event.threads.empty() && event.omittedThreads == 0) {
+            continue;
+        }
+        std::function<void(const EscalationEvent&)> callback;
+        {
+            std::lock_guard<std::mutex> tiersLock(_escalationMutex);
+            const uint32_t t = escalation.tierIndex[i];
+            // The tiers could be cleared while the shards were scanned.
+            if (t >= _escalationTiers.size() ||
+                _escalationTiers[t].tier.name != event.tier) {
+                continue;
+            }
+            _escalationTiers[t].lastReport = methodStart;
+            callback = _escalationTiers[t].tier.callback;
+        }
+        // Outside of all locks, the callback may reconfigure the tiers.
+        if (!callback) {
+            continue;
+        }
+        if (fromCheckpoint) {
+            // Like the fault report, the callback must not run inside a checkpoint.
+            _postReport([callback = std::move(callback), event = std::move(event)] {
+                callback(event);
+            });
+        } else {
+            callback(event);
+        }
+    }
+
+    if (frozenThread && faultActionDue &&
+        _lastTimeOfFaultAction.compare_exchange_strong(lastFaultAction, methodStart)) {
+        _frozenConditionsDetected.fetch_add(1);
+        if (livelocked) {
+            _livelocksDetected.fetch_add(1);
+        }
+        if (fromCheckpoint) {
+            // The report samples /proc and the stacks and runs the callback, this
+            // must not stall the instrumented thread inside its checkpoint.
+            _postReport([this, frozen = std::move(frozen), livelocked, noProgressDuration] {
+                _reportFrozenThread(frozen, livelocked, noProgressDuration);
+            });
+        } else {
+            _reportFrozenThread(frozen, livelocked, noProgressDuration);
+        }
+    }
+    // The cycle is complete when the last shard is scanned.
+    const bool cycleComplete = firstShard + count >= _shardCount;
+    _addCycleStats(stats, fromCheckpoint, cycleComplete);
+    if (cycleComplete && _traceCaptureActive.load(std::memory_order_relaxed)) {
+        if (fromCheckpoint) {
+            // The snapshot copies every history, not inside a checkpoint.
+            const auto timestamp = stats.timestamp;
+            _postReport([this, timestamp] { _maybeCaptureTrace(timestamp); });
+        } else {
+            _maybeCaptureTrace(stats.timestamp);
+        }
+    }
+    return garbageCollected;
+}
+
+template <typename Policy>
+void BasicThreadMonitorCentralRepository<Policy>::_reportFrozenThread(
+    const details::StaleThreadReport& frozen,
+    bool livelocked,
+    std::chrono::system_clock::duration noProgressDuration) {
+    if (livelocked) {
+        std::cerr << "Livelocked thread in domain " << _name << ": " << frozen.name
+                  << " id: " << frozen.threadId << " tid: " << frozen.tid << " no progress for: "
+                  << std::chrono::duration_cast<std::chrono::milliseconds>(noProgressDuration)
+                         .count()
+                  << " ms";
+        const auto period = details::findRepeatingCycle(frozen.history);
+        if (period > 0) {
+            std::cerr << " repeating cycle of " << period << " checkpoints";
+        }
+        std::cerr << std::endl;
+    } else {
+        std::cerr << "Frozen thread in domain " << _name << ": " << frozen.name
+                  << " id: " << frozen.threadId << " tid: " << frozen.tid << std::endl;
+        printThreadCounterReport(frozen.counters);
+    }
+    details::ThreadMonitorBase::printHistory(frozen.history);
+    _frozenThreadAction();
+}
+
+template <typename Policy>
+void BasicThreadMonitorCentralRepository<Policy>::_postReport(std::function<void()> report) {
+    {
+        std::lock_guard<std::mutex> lock(_monitorSleepMutex);
+        if (_terminating) {
+            return;
+        }
+        _pendingReports.push_back(std::move(report));
+        if (!_reportThread) {
+            _reportThread = std::make_unique<std::thread>([this] {
+                std::unique_lock<std::mutex> lock(_monitorSleepMutex);
+                while (true) {
+                    _monitorWakeup.wait(
+                        lock, [this] { return _terminating.load() || !_pendingReports.empty(); });
+                    // The queued reports are delivered before the termination.
+                    if (_pendingReports.empty()) {
+                        return;
+                    }
+                    auto next = std::move(_pendingReports.front());
+                    _pendingReports.pop_front();
+                    lock.unlock();
+                    next();
+                    lock.lock();
+                }
+            });
+        }
+    }
+    _monitorWakeup.notify_all();
+}
+
+template <typename Policy>
+void BasicThreadMonitorCentralRepository<Policy>::_addCycleStats(const MonitorStats& scanned,
+                                                                 bool slice,
+                                                                 bool cycleComplete) {
+    std::lock_guard<std::mutex> lock(_cycleStatsMutex);
+    MonitorStats cycle = scanned;
+    if (slice) {
+        MonitorStats& slices = _sliceStats;
+        slices.threads += scanned.threads;
+        for (size_t i = 0; i < MonitorStats::kHistogramBuckets; ++i) {
+            slices.staleness[i] += scanned.staleness[i];
+            slices.checkpointRate[i] += scanned.checkpointRate[i];
+        }
+        slices.stalenessSum += scanned.stalenessSum;
+        slices.checkpointRateSum += scanned.checkpointRateSum;
+        slices.lastCycleDuration += scanned.lastCycleDuration;
+        slices.lastCycleGarbageCollected += scanned.lastCycleGarbageCollected;
+        slices.lastCycleMaxShardLockWait =
+            std::max(slices.lastCycleMaxShardLockWait, scanned.lastCycleMaxShardLockWait);
+        slices.shardLockWaitSum += scanned.shardLockWaitSum;
+        if (!cycleComplete) {
+            return;
+        }
+        cycle = slices;
+        slices = MonitorStats();
+    }
+
+    MonitorStats& totals = _cycleTotals;
+    cycle.timestamp = scanned.timestamp;
+    cycle.cycles = ++totals.cycles;
+    cycle.cycleDurationSum = totals.cycleDurationSum += cycle.lastCycleDuration;
+    cycle.garbageCollected = totals.garbageCollected += cycle.lastCycleGarbageCollected;
+    cycle.shardLockWaitSum = totals.shardLockWaitSum += cycle.shardLockWaitSum;
+    cycle.livenessErrors = _frozenConditionsDetected;
+    cycle.livelocks = _livelocksDetected;
+    _publishedStats.publish(cycle);
+}
+
+template <typename Policy>
+void BasicThreadMonitorCentralRepository<Policy>::_frozenThreadAction() {
+    // Collect all threads that are stale for more than configured value to
+    // avoid unnecessary verbosity.
+    std::vector<details::StaleThreadReport> staleThreads;
+    for (uint32_t shard = 0; shard < _shardCount; ++shard) {
+        const auto shardStart = Clock::now();
+        std::lock_guard<ShardLock> lock(const_cast<ShardLock&>(std::get<2>(_shard(shard))));
+        for (auto it = std::get<0>(_shard(shard)).begin(); it != std::get<0>(_shard(shard)).end();
+             ++it) {
+            auto lastSeenAlive = it->lastSeenAlive.load();
+            if (lastSeenAlive == std::chrono::system_clock::time_point::max() ||
+                shardStart - lastSeenAlive < kStaleThreadThreshold) {
+                continue;
+            }
+            // Need to obtain more fresh history.
+            details::ThreadMonitorBase::History threadHistory;
+            std::string name;
+            if (!details::snapshotMonitor(*it, &threadHistory, &name) || threadHistory.empty()) {
+                continue;
+            }
+            lastSeenAlive = threadHistory[threadHistory.size() - 1].timestamp;
+            if (shardStart - lastSeenAlive < kStaleThreadThreshold) {
+                continue;
+            }
+            staleThreads.push_back({std::move(name), it->threadId, it->tid,
+                                    std::move(threadHistory),
+                                    it->counters != nullptr ? it->counters->lastReport()
+                                                            : ThreadCounterReport()});
+        }
+    }
+
+    // The kernel state is read in one batch for all stale threads, outside of
+    // the shard locks. This is the only place where the repository reads /proc.
+    std::vector<pid_t> tids;
+    tids.reserve(staleThreads.size());
+    for (const auto& t : staleThreads) {
+        tids.push_back(t.tid);
+    }
+    std::vector<KernelThreadStateReport> kernelStates;
+    const auto samplingInterval = _kernelStateSamplingInterval.load();
+    if (samplingInterval > std::chrono::system_clock::duration::zero() && !tids.empty()) {
+        kernelStates = sampleKernelThreadStates(tids, samplingInterval);
+    }
+    // Same for the native stacks, the symbolization happens only when printing.
+    std::vector<NativeStackTrace> nativeStacks;
+    const auto captureTimeout = _nativeStackCaptureTimeout.load();
+    if (captureTimeout > std::chrono::system_clock::duration::zero() && !tids.empty()) {
+        nativeStacks = captureNativeStacks(tids, captureTimeout);
+    }
+
+    std::cerr << "All stale threads:" << std::endl;
+    for (size_t i = 0; i < staleThreads.size(); ++i) {
+        const auto& t = staleThreads[i];
+        std::cerr << "Thread: " << t.name << " id: " << t.threadId << " tid: " << t.tid
+                  << std::endl;
+        details::ThreadMonitorBase::printHistory(t.history);
+        printThreadCounterReport(t.counters);
+        if (i < kernelStates.size()) {
+            printKernelThreadStateReport(kernelStates[i]);
+        }
+        if (i < nativeStacks.size()) {
+            printNativeStack(nativeStacks[i]);
+        }
+    }
+
+    if (_frozenConditionCallback) {
+        _frozenConditionCallback();
+    }
+}
+
+template <typename Policy>
+unsigned int BasicThreadMonitorCentralRepository<Policy>::_reclaimRetired(LockableColony& shard) {
+    ThreadRegistration* const retired =
+        std::get<5>(shard).exchange(nullptr, std::memory_order_acquire);
+    if (retired == nullptr) {
+        return 0;
+    }
+    // The detached list is owned by this thread, only the splice is under the lock.
+    unsigned int count = 1;
+    bool withCounters = retired->counters != nullptr;
+    ThreadRegistration* tail = retired;
+    while (tail->nextRetired != nullptr) {
+        tail = tail->nextRetired;
+        ++count;
+        withCounters |= tail->counters != nullptr;
+    }
+    // The queries read the counters under the shard lock, they are detached
+    // under the lock and closed after it is released.
+    std::vector<std::unique_ptr<details::ThreadCounters>> counters;
+    {
+        std::lock_guard<ShardLock> lock(std::get<2>(shard));
+        if (withCounters) {
+            for (auto* r = retired; r != nullptr; r = r->nextRetired) {
+                if (r->counters != nullptr) {
+                    counters.emplace_back(r->counters);
+                    r->counters = nullptr;
+                }
+            }
+        }
+        FreeSlots& freeSlots = std::get<3>(shard);
+        tail->nextRetired = freeSlots.head;
+        freeSlots.head = retired;
+        freeSlots.count += count;
+        // The slots reclaimed after a burst of thread exits are not kept until `trim()`.
+        _eraseFreeSlots(shard, kMaxFreeRegistrations);
+    }
+    if (!counters.empty()) {
+        // A monitor cycle could be reading them after its shard lock.
+        std::lock_guard<std::mutex> countersLock(_countersMutex);
+        counters.clear();
+    }
+    return count;
+}
+
+}  // namespace thread_monitor
@@ -1,19 +1,61 @@
 #include "thread_monitor/thread_monitor_central_repository.h"
 
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <sstream>
 #include <thread>
 
 #include "gtest/gtest.h"
+#include "thread_monitor/chrome_trace_writer.h"
+#include "thread_monitor/introspection_server.h"
+#include "thread_monitor/monitor_simulation.h"
+#include "thread_monitor/numa_topology.h"
+#include "thread_monitor/registration_allocator.h"
 #include "thread_monitor/thread_monitor.h"
+#include "thread_monitor/thread_monitor_central_repository_impl.h"
 
 namespace thread_monitor {
+
+// The tested policies which are not instantiated by the library.
+template class BasicThreadMonitorCentralRepository<
+    RepositoryPolicy<policy::SystemClock, policy::SpinLock, policy::ListContainer>>;
+template class BasicThreadMonitorCentralRepository<
+    RepositoryPolicy<policy::CoarseSystemClock, policy::NoLock, policy::ListContainer>>;
+
 namespace {
 
+// Runs the function on scope exit, also when an assertion returns early.
+template <typename F>
+class ScopeExit {
+public:
+    explicit ScopeExit(F onExit) : _onExit(std::move(onExit)) {}
+    ~ScopeExit() {
+        _onExit();
+    }
+
+    ScopeExit(const ScopeExit&) = delete;
+    ScopeExit& operator=(const ScopeExit&) = delete;
+
+private:
+    F _onExit;
+};
+
 static const bool dummy = ThreadMonitorCentralRepository::instantiateWithoutMonitorThreadForTests();
 
 TEST(ThreadMonitor, MemoryOverhead) {
-    using Collection = plf::colony<ThreadMonitorCentralRepository::ThreadRegistration>;
-    ASSERT_LE(sizeof(Collection),
-              100);  // No more than 100 bytes per shard for empty collection.
+    using Collection = ThreadMonitorCentralRepository::RegistrationColony;
+    // No more than 128 bytes per shard for empty collection, including the copies
+    // of the allocator pointing to the domain registration arena.
+    ASSERT_LE(sizeof(Collection), 128);
 }
 
 TEST(CentralRepository, RegisterThread) {
@@ -30,83 +72,1147 @@ TEST(CentralRepository, GarbageCollection) {
     ASSERT_EQ(0, ThreadMonitorCentralRepository::instance()->threadCount());
 }
 
-TEST(CentralRepository, ThreadTimeout) {
-    const auto frozenCount =
-        ThreadMonitorCentralRepository::instance()->getLivenessErrorConditionDetectedCount();
-    ThreadMonitorCentralRepository::instance()->setThreadTimeout(std::chrono::milliseconds{1});
-    std::atomic<bool> livenessConditionDetected = false;
-    ThreadMonitorCentralRepository::instance()->setLivenessErrorConditionDetectedCallback(
-        [&] { livenessConditionDetected = true; });
+TEST(CentralRepository, RuntimeKillSwitch) {
+    ThreadMonitorCentralRepository::DomainOptions options;
+    options.withMonitorThread = false;
+    ThreadMonitorCentralRepository domain(options);
+    domain.setThreadTimeout(std::chrono::milliseconds{50});
 
-    ThreadMonitor<> monitor("test", 1);
-    std::this_thread::sleep_for(std::chrono::milliseconds{2});
-    while (!livenessConditionDetected) {
+    ThreadMonitor<> monitor(domain, "test", 1);
+    setThreadMonitoringEnabled(false);
+    ScopeExit enable([] { setThreadMonitoringEnabled(true); });
+    ASSERT_FALSE(isThreadMonitoringEnabled());
+    threadMonitorCheckpoint(2);
+    ASSERT_EQ(1, monitor.getHistory().size());  // Not recorded.
+
+    // The monitor is stale but not reported while disabled.
+    std::this_thread::sleep_for(std::chrono::milliseconds{100});
+    domain.runMonitorCycle();
+    ASSERT_EQ(0, domain.getLivenessErrorConditionDetectedCount());
+
+    // Re-armed: the time spent disabled does not count.
+    setThreadMonitoringEnabled(true);
+    ASSERT_TRUE(isThreadMonitoringEnabled());
+    domain.runMonitorCycle();
+    ASSERT_EQ(0, domain.getLivenessErrorConditionDetectedCount());
+    threadMonitorCheckpoint(2);
+    ASSERT_EQ(2, monitor.getHistory().size());
+}
+
+// The thread keeps visiting checkpoints in a loop but never a progress checkpoint.
+TEST(CentralRepository, LivelockDetected) {
+    auto* repo = ThreadMonitorCentralRepository::instance();
+    repo->runMonitorCycle();
+    repo->setThreadTimeout(std::chrono::milliseconds{100});
+    repo->setKernelStateSamplingInterval(std::chrono::milliseconds{0});
+    const auto livelockCount = repo->getLivelockDetectedCount();
+
+    ThreadMonitor<> monitor("livelock", 1);
+    monitor.setProgressWindow(std::chrono::milliseconds{20});
+    while (repo->getLivelockDetectedCount() == livelockCount) {
         threadMonitorCheckpoint(2);
-        std::this_thread::sleep_for(std::chrono::milliseconds{10});
-        ThreadMonitorCentralRepository::instance()->runMonitorCycle();
+        std::this_thread::sleep_for(std::chrono::milliseconds{1});
+        threadMonitorCheckpoint(3);
+        std::this_thread::sleep_for(std::chrono::milliseconds{1});
+        repo->runMonitorCycle();
     }
-    ASSERT_EQ(frozenCount + 1,
-              ThreadMonitorCentralRepository::instance()->getLivenessErrorConditionDetectedCount());
+    ASSERT_EQ(livelockCount + 1, repo->getLivelockDetectedCount());
+    repo->setKernelStateSamplingInterval(
+        ThreadMonitorCentralRepository::kDefaultKernelStateSamplingInterval);
 }
 
-TEST(CentralRepository, ThreadTimeoutMultipleThreads) {
-    const auto frozenCount =
-        ThreadMonitorCentralRepository::instance()->getLivenessErrorConditionDetectedCount();
-    ThreadMonitorCentralRepository::instance()->setThreadTimeout(std::chrono::milliseconds{1});
-    std::atomic<bool> livenessConditionDetected = false;
-    ThreadMonitorCentralRepository::instance()->setLivenessErrorConditionDetectedCallback(
-        [&] { livenessConditionDetected = true; });
+TEST(CentralRepository, ProgressPreventsLivelock) {
+    auto* repo = ThreadMonitorCentralRepository::instance();
+    repo->runMonitorCycle();
+    // Short timeout to not rate limit a false detection.
+    repo->setThreadTimeout(std::chrono::milliseconds{50});
+    const auto livelockCount = repo->getLivelockDetectedCount();
+
+    ThreadMonitor<> monitor("progress", 1);
+    monitor.setProgressWindow(std::chrono::milliseconds{20});
+    const auto start = std::chrono::system_clock::now();
+    while (std::chrono::system_clock::now() - start < std::chrono::milliseconds{100}) {
+        threadMonitorCheckpoint(2);
+        std::this_thread::sleep_for(std::chrono::milliseconds{1});
+        threadMonitorCheckpoint(progressCheckpoint(3));
+        std::this_thread::sleep_for(std::chrono::milliseconds{1});
+        repo->runMonitorCycle();
+    }
+    ASSERT_EQ(livelockCount, repo->getLivelockDetectedCount());
+}
+
+// The checkpoint right after the progress one does not replace it in the history.
+TEST(CentralRepository, CloseCheckpointKeepsProgress) {
+    auto* repo = ThreadMonitorCentralRepository::instance();
+    repo->runMonitorCycle();
+    repo->setThreadTimeout(std::chrono::milliseconds{50});
+    const auto livelockCount = repo->getLivelockDetectedCount();
+
+    const auto run = [repo](details::ThreadMonitorBase& monitor) {
+        monitor.setProgressWindow(std::chrono::milliseconds{20});
+        const auto start = std::chrono::system_clock::now();
+        while (std::chrono::system_clock::now() - start < std::chrono::milliseconds{100}) {
+            threadMonitorCheckpoint(progressCheckpoint(3));
+            threadMonitorCheckpoint(2);
+            std::this_thread::sleep_for(std::chrono::milliseconds{1});
+            repo->runMonitorCycle();
+        }
+    };
+    {
+        ThreadMonitor<> monitor("progress", 1);
+        run(monitor);
+    }
+    {
+        ThreadMonitor<10, history_layout::DeltaEncoded> monitor("encoded progress", 1);
+        run(monitor);
+    }
+    ASSERT_EQ(livelockCount, repo->getLivelockDetectedCount());
+}
+
+TEST(CentralRepository, ThreadArenaFrozenThread) {
+    auto* repo = ThreadMonitorCentralRepository::instance();
+    repo->runMonitorCycle();
+    repo->setThreadTimeout(std::chrono::milliseconds{1});
+    repo->setKernelStateSamplingInterval(std::chrono::milliseconds{0});
+    const auto frozenCount = repo->getLivenessErrorConditionDetectedCount();
+
+    ThreadMonitor<1, history_layout::ThreadArena> monitor("arena", 1);
+    std::this_thread::sleep_for(std::chrono::milliseconds{2});
+    while (repo->getLivenessErrorConditionDetectedCount() == frozenCount) {
+        std::this_thread::sleep_for(std::chrono::milliseconds{10});
+        repo->runMonitorCycle();
+    }
+    ASSERT_EQ(frozenCount + 1, repo->getLivenessErrorConditionDetectedCount());
+    repo->setKernelStateSamplingInterval(
+        ThreadMonitorCentralRepository::kDefaultKernelStateSamplingInterval);
+}
 
+TEST(CentralRepository, ConcurrentRegistrationGrowth) {
+    auto* repo = ThreadMonitorCentralRepository::instance();
+    repo->runMonitorCycle();
+    repo->trim();
+    // Many concurrent registrations grow the shards outside of the lock.
+    std::atomic<int> registered{0};
+    std::atomic<bool> done{false};
     std::vector<std::thread> threads;
-    std::atomic<bool> terminate{ false };
-    for (int i = 0; i < 5; ++i) {
+    for (int i = 0; i < 200; ++i) {
         threads.emplace_back([&] {
-            ThreadMonitor<> monitor("some thread", 5);
-            for (int j = 0; j < 5; ++j) {
-                threadMonitorCheckpoint(i + j);
-                std::this_thread::sleep_for(std::chrono::milliseconds{2});
-            }
-            while (!terminate.load()) {
-                std::this_thread::sleep_for(std::chrono::milliseconds{2});
+            ThreadMonitor<> monitor("growth", 1);
+            ++registered;
+            while (!done) {
+                std::this_thread::sleep_for(std::chrono::milliseconds{1});
             }
         });
     }
-
-    ThreadMonitor<> monitor("main test thread", 1);
-    std::this_thread::sleep_for(std::chrono::milliseconds{2});
-    while (!livenessConditionDetected) {
-        threadMonitorCheckpoint(2);
-        std::this_thread::sleep_for(std::chrono::milliseconds{10});
-        ThreadMonitorCentralRepository::instance()->runMonitorCycle();
+    while (registered < 200) {
+        std::this_thread::yield();
+    }
+    auto states = repo->getAllThreadLivenessStates();
+    ASSERT_EQ(200, states.size());
+    for (const auto& state : states) {
+        ASSERT_NE(0, state.tid);
     }
-    ASSERT_EQ(frozenCount + 1,
-              ThreadMonitorCentralRepository::instance()->getLivenessErrorConditionDetectedCount());
+    done = true;
+    for (auto& t : threads) {
+        t.join();
+    }
+    repo->runMonitorCycle();
+    ASSERT_EQ(0, repo->threadCount());
+}
 
-    terminate = true;
+TEST(CentralRepository, ReserveAndTrim) {
+    auto* repo = ThreadMonitorCentralRepository::instance();
+    repo->runMonitorCycle();
+    repo->reserve(1000, true);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 50; ++i) {
+        threads.emplace_back([] { ThreadMonitor<> monitor("reserved", 1); });
+    }
     for (auto& t : threads) {
         t.join();
     }
+    ThreadMonitor<> monitor("reserved", 1);
+    ASSERT_EQ(51, repo->threadCount());
+    repo->runMonitorCycle();
+    ASSERT_EQ(1, repo->threadCount());
+    repo->trim();
+    ASSERT_EQ(1, repo->threadCount());
 }
 
-// Tests that an instrumented thread updates its liveness timestamp
-// in the central repository.
-TEST(CentralRepository, CentralRepositoryUpdates) {
-    ThreadMonitorCentralRepository::instance()->runMonitorCycle();
-    ThreadMonitorCentralRepository::instance()->setThreadTimeout(std::chrono::milliseconds{1000});
-    ThreadMonitorCentralRepository::instance()->setReportingInterval(std::chrono::milliseconds{1});
+TEST(RegistrationArena, ReserveCarvesTheSpaceLeft) {
+    details::RegistrationArena arena;
+    arena.reserve(4096);
+    auto* first = static_cast<char*>(arena.allocate(128));
+    // Fits in what is left of the first region, nothing is mapped.
+    arena.reserve(4096);
+    auto* second = static_cast<char*>(arena.allocate(128));
+    ASSERT_EQ(first + 128, second);
+    arena.deallocate(first, 128);
+    ASSERT_EQ(first, arena.allocate(128));
+    arena.deallocate(first, 128);
+    arena.deallocate(second, 128);
+}
 
-    ThreadMonitor<> monitor("test", 1);
-    auto initialStates = ThreadMonitorCentralRepository::instance()->getAllThreadLivenessStates();
-    ASSERT_EQ(1, initialStates.size());
-    while (true) {
-        threadMonitorCheckpoint(2);
+TEST(CentralRepository, ShardingOptions) {
+    const uint32_t nodes = details::numaNodeCount();
+    ASSERT_GE(nodes, 1);
+    ASSERT_LT(details::currentNumaNode(), nodes);
+    ASSERT_GE(ThreadMonitorCentralRepository::defaultShardCount(), 8);
+    ASSERT_EQ(0, ThreadMonitorCentralRepository::defaultShardCount() % nodes);
+    ASSERT_FALSE(ThreadMonitorCentralRepository::instantiateWithSharding({}));
+
+    for (auto placement : {ThreadMonitorCentralRepository::ShardPlacement::kThreadIdHash,
+                           ThreadMonitorCentralRepository::ShardPlacement::kNumaNode}) {
+        ThreadMonitorCentralRepository::DomainOptions options;
+        options.withMonitorThread = false;
+        options.sharding = {3, placement};
+        ThreadMonitorCentralRepository repo(options);
+        ASSERT_GE(repo.shardCount(), 3);
+        ASSERT_EQ(0, repo.shardCount() % nodes);
+        ASSERT_EQ(placement, repo.shardPlacement());
+
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 20; ++i) {
+            threads.emplace_back([&repo] {
+                auto* r = repo.registerThread(std::this_thread::get_id(),
+                                              details::currentKernelThreadId(),
+                                              nullptr,
+                                              nullptr,
+                                              std::chrono::system_clock::now());
+                MonitorDomain::deregisterThread(r);
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        ASSERT_EQ(20, repo.threadCount());
+        ASSERT_EQ(20, repo.runMonitorCycle());
+        ASSERT_EQ(0, repo.threadCount());
+    }
+}
+
+TEST(CentralRepository, IndependentDomains) {
+    auto* defaultDomain = ThreadMonitorCentralRepository::instance();
+    defaultDomain->runMonitorCycle();
+    ThreadMonitorCentralRepository::DomainOptions options;
+    options.name = "storage";
+    options.withMonitorThread = false;
+    ThreadMonitorCentralRepository storage(options);
+    ASSERT_STREQ("storage", storage.name());
+    storage.setThreadTimeout(std::chrono::milliseconds{5});
+    int callbacks = 0;
+    storage.setLivenessErrorConditionDetectedCallback([&callbacks] { ++callbacks; });
+    const auto defaultErrors = defaultDomain->getLivenessErrorConditionDetectedCount();
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done = false;
+    std::thread frozen([&] {
+        ThreadMonitor<> monitor(storage, "frozen", 1);
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return done; });
+    });
+    {
+        // Registers with the default domain.
+        ThreadMonitor<> monitor("default", 1);
+        std::this_thread::sleep_for(std::chrono::milliseconds{20});
+        ASSERT_EQ(1, storage.threadCount());
+        ASSERT_EQ(1, defaultDomain->threadCount());
+        storage.runMonitorCycle();
+    }
+    ASSERT_EQ(1, storage.getLivenessErrorConditionDetectedCount());
+    ASSERT_EQ(1, callbacks);
+    ASSERT_EQ(defaultErrors, defaultDomain->getLivenessErrorConditionDetectedCount());
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+    }
+    cv.notify_all();
+    frozen.join();
+    ASSERT_EQ(1, storage.runMonitorCycle());
+    ASSERT_EQ(0, storage.threadCount());
+}
+
+TEST(CentralRepository, QueryThreadLiveness) {
+    ThreadMonitorCentralRepository::DomainOptions options;
+    options.name = "query";
+    options.withMonitorThread = false;
+    ThreadMonitorCentralRepository domain(options);
+    const auto now = std::chrono::system_clock::now();
+    const pid_t tid = details::currentKernelThreadId();
+    std::vector<MonitorDomain::ThreadRegistration*> registrations;
+    for (int i = 0; i < 3; ++i) {
+        registrations.push_back(domain.registerThread(std::this_thread::get_id(), tid, nullptr,
+                                                      nullptr, now - std::chrono::hours{i}));
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool ready = false;
+    bool done = false;
+    std::thread worker([&] {
+        ThreadMonitor<> monitor(domain, "worker", 1);
+        threadMonitorCheckpoint(7);
+        std::unique_lock<std::mutex> lock(mutex);
+        ready = true;
+        cv.notify_all();
+        cv.wait(lock, [&] { return done; });
+    });
+    // An assertion returning early must not leave the worker joinable.
+    ScopeExit joinWorker([&] {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            done = true;
+        }
+        cv.notify_all();
+        worker.join();
+        for (auto* r : registrations) {
+            MonitorDomain::deregisterThread(r);
+        }
+    });
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return ready; });
+    }
+
+    MonitorDomain::LivenessQuery query;
+    query.minStaleness = std::chrono::minutes{30};
+    std::vector<MonitorDomain::LivenessMatch> matches;
+    domain.copyThreadLiveness(query, std::back_inserter(matches));
+    ASSERT_EQ(2, matches.size());
+    ASSERT_TRUE(matches[0].name.empty());
+    ASSERT_TRUE(matches[0].history.empty());
+
+    // Only the worker has a monitor.
+    query = {};
+    query.namePrefix = "work";
+    query.withHistory = true;
+    matches.clear();
+    domain.copyThreadLiveness(query, std::back_inserter(matches));
+    ASSERT_EQ(1, matches.size());
+    ASSERT_EQ("worker", matches[0].name);
+    ASSERT_EQ(7, matches[0].history.back().checkpointId);
+
+    query = {};
+    query.lastCheckpointId = 7;
+    int visited = 0;
+    domain.queryThreadLiveness(query, [&visited](const MonitorDomain::LivenessMatch& match) {
+        ASSERT_TRUE(match.history.empty());
+        ++visited;
+    });
+    ASSERT_EQ(1, visited);
+    query.lastCheckpointId = 8;
+    query.namePrefix = "io";
+    domain.queryThreadLiveness(query, [](const MonitorDomain::LivenessMatch&) { FAIL(); });
+}
+
+#ifdef THREAD_MONITOR_VIRTUAL_CLOCK
+TEST(CentralRepository, EscalationTiers) {
+    // Installed before the domain and the monitor, uninstalled after them.
+    VirtualClock::install(std::chrono::system_clock::now());
+    ScopeExit uninstall([] { VirtualClock::uninstall(); });
+    ThreadMonitorCentralRepository::DomainOptions options;
+    options.name = "escalation";
+    options.withMonitorThread = false;
+    ThreadMonitorCentralRepository domain(options);
+    domain.setReportingInterval(std::chrono::milliseconds{1});
+
+    std::vector<MonitorDomain::EscalationEvent> warnings;
+    std::vector<MonitorDomain::EscalationEvent> snapshots;
+    MonitorDomain::EscalationTier warn;
+    warn.name = "warn";
+    warn.threshold = std::chrono::milliseconds{20};
+    warn.minInterval = std::chrono::system_clock::duration::zero();
+    warn.callback = [&warnings](const MonitorDomain::EscalationEvent& e) {
+        warnings.push_back(e);
+    };
+    ASSERT_TRUE(domain.addEscalationTier(warn));
+    MonitorDomain::EscalationTier snapshot;
+    snapshot.name = "snapshot";
+    snapshot.threshold = std::chrono::milliseconds{200};
+    snapshot.minInterval = std::chrono::hours{1};
+    snapshot.withHistory = true;
+    snapshot.callback = [&snapshots](const MonitorDomain::EscalationEvent& e) {
+        snapshots.push_back(e);
+    };
+    ASSERT_TRUE(domain.addEscalationTier(snapshot));
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool ready = false;
+    bool done = false;
+    std::thread slow([&] {
+        ThreadMonitor<> monitor(domain, "slow", 1);
+        threadMonitorCheckpoint(5);
+        std::unique_lock<std::mutex> lock(mutex);
+        ready = true;
+        cv.notify_all();
+        cv.wait(lock, [&] { return done; });
+    });
+    ScopeExit joinSlow([&] {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            done = true;
+        }
+        cv.notify_all();
+        slow.join();
+    });
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return ready; });
+    }
+
+    VirtualClock::advance(std::chrono::milliseconds{50});
+    domain.runMonitorCycle();
+    ASSERT_EQ(1, warnings.size());
+    ASSERT_STREQ("warn", warnings[0].tier);
+    ASSERT_EQ(1, warnings[0].threads.size());
+    ASSERT_EQ("slow", warnings[0].threads[0].name);
+    ASSERT_TRUE(warnings[0].threads[0].history.empty());
+    ASSERT_TRUE(snapshots.empty());
+
+    VirtualClock::advance(std::chrono::milliseconds{200});
+    domain.runMonitorCycle();
+    ASSERT_EQ(2, warnings.size());
+    ASSERT_EQ(1, snapshots.size());
+    ASSERT_EQ(5, snapshots[0].threads[0].history.back().checkpointId);
+    // Rate limited.
+    domain.runMonitorCycle();
+    ASSERT_EQ(3, warnings.size());
+    ASSERT_EQ(1, snapshots.size());
+    // Soft tiers do not trigger the fault.
+    ASSERT_EQ(0, domain.getLivenessErrorConditionDetectedCount());
+}
+
+// Hours of the virtual time of 100k threads, one of them stuck.
+TEST(MonitorSimulation, LargeScaleTimeout) {
+    MonitorSimulation::Options options;
+    options.threadTimeout = std::chrono::hours{2};
+    MonitorSimulation simulation(options);
+    constexpr size_t kMonitors = 100000;
+    const auto start = simulation.now();
+    ASSERT_EQ(0, simulation.addMonitors(kMonitors));
+    ASSERT_EQ(kMonitors, simulation.domain().getAllThreadLivenessStates().size());
+
+    simulation.advance(std::chrono::hours{1});
+    ASSERT_EQ(start + std::chrono::hours{1}, simulation.now());
+    simulation.checkpoint(1, kMonitors - 1, 2);
+    auto cycle = simulation.runMonitorCycle();
+    ASSERT_EQ(0, cycle.garbageCollected);
+    ASSERT_EQ(0, cycle.livenessErrors);
+
+    // The monitor 0 is stale for 2 hours and 1 second.
+    simulation.advance(std::chrono::hours{1} + std::chrono::seconds{1});
+    simulation.checkpoint(1, kMonitors - 1, 3);
+    cycle = simulation.runMonitorCycle();
+    ASSERT_EQ(1, cycle.livenessErrors);
+    MonitorDomain::LivenessQuery query;
+    query.minStaleness = std::chrono::hours{2};
+    std::vector<MonitorDomain::LivenessMatch> stale;
+    simulation.domain().copyThreadLiveness(query, std::back_inserter(stale));
+    ASSERT_EQ(1, stale.size());
+    ASSERT_EQ(start, stale[0].state.lastSeenAliveTimestamp);
+
+    simulation.removeMonitors(0, kMonitors / 2);
+    cycle = simulation.runMonitorCycle();
+    ASSERT_EQ(kMonitors / 2, cycle.garbageCollected);
+    ASSERT_EQ(0, cycle.livenessErrors);
+    ASSERT_EQ(kMonitors / 2, simulation.domain().getAllThreadLivenessStates().size());
+}
+
+TEST(MonitorSimulation, ThreadTimeout) {
+    MonitorSimulation::Options options;
+    options.threadTimeout = std::chrono::milliseconds{10};
+    options.reportingInterval = std::chrono::milliseconds{1};
+    MonitorSimulation simulation(options);
+    bool livenessConditionDetected = false;
+    simulation.domain().setLivenessErrorConditionDetectedCallback(
+        [&] { livenessConditionDetected = true; });
+    simulation.addMonitors(1);
+
+    // The checkpoints within the timeout keep the thread alive.
+    for (uint32_t i = 0; i < 5; ++i) {
+        simulation.advance(std::chrono::milliseconds{5});
+        simulation.checkpoint(0, 1, 2 + i);
+        ASSERT_EQ(0, simulation.runMonitorCycle().livenessErrors);
+    }
+    simulation.advance(std::chrono::milliseconds{11});
+    ASSERT_EQ(1, simulation.runMonitorCycle().livenessErrors);
+    ASSERT_TRUE(livenessConditionDetected);
+}
+
+TEST(MonitorSimulation, ThreadTimeoutMultipleThreads) {
+    MonitorSimulation::Options options;
+    options.threadTimeout = std::chrono::milliseconds{10};
+    options.reportingInterval = std::chrono::milliseconds{1};
+    MonitorSimulation simulation(options);
+    constexpr size_t kMonitors = 6;
+    simulation.addMonitors(kMonitors);
+    for (uint32_t i = 0; i < 3; ++i) {
+        simulation.advance(std::chrono::milliseconds{5});
+        simulation.checkpoint(0, kMonitors, 2 + i);
+        ASSERT_EQ(0, simulation.runMonitorCycle().livenessErrors);
+    }
+
+    // The last monitor stops visiting the checkpoints.
+    const auto stuckSince = simulation.now();
+    for (uint32_t i = 0; i < 3; ++i) {
+        simulation.advance(std::chrono::milliseconds{5});
+        simulation.checkpoint(0, kMonitors - 1, 5 + i);
+    }
+    ASSERT_EQ(1, simulation.runMonitorCycle().livenessErrors);
+    MonitorDomain::LivenessQuery query;
+    query.minStaleness = options.threadTimeout;
+    std::vector<MonitorDomain::LivenessMatch> stale;
+    simulation.domain().copyThreadLiveness(query, std::back_inserter(stale));
+    ASSERT_EQ(1, stale.size());
+    ASSERT_EQ(stuckSince, stale[0].state.lastSeenAliveTimestamp);
+
+    // The fault action is rate limited by the thread timeout.
+    simulation.advance(std::chrono::milliseconds{5});
+    simulation.checkpoint(0, kMonitors - 1, 8);
+    ASSERT_EQ(0, simulation.runMonitorCycle().livenessErrors);
+}
+
+// Tests that a thread updates its liveness timestamp in the domain once per
+// reporting interval.
+TEST(MonitorSimulation, CentralRepositoryUpdates) {
+    MonitorSimulation::Options options;
+    options.threadTimeout = std::chrono::seconds{1};
+    options.reportingInterval = std::chrono::milliseconds{10};
+    MonitorSimulation simulation(options);
+    const auto start = simulation.now();
+    simulation.addMonitors(1);
+    auto states = simulation.domain().getAllThreadLivenessStates();
+    ASSERT_EQ(1, states.size());
+    ASSERT_EQ(start, states[0].lastSeenAliveTimestamp);
+
+    simulation.advance(std::chrono::milliseconds{1});
+    simulation.checkpoint(0, 1, 2);
+    states = simulation.domain().getAllThreadLivenessStates();
+    ASSERT_EQ(start, states[0].lastSeenAliveTimestamp);
+
+    simulation.advance(std::chrono::milliseconds{10});
+    simulation.checkpoint(0, 1, 3);
+    states = simulation.domain().getAllThreadLivenessStates();
+    ASSERT_EQ(1, states.size());
+    ASSERT_EQ(simulation.now(), states[0].lastSeenAliveTimestamp);
+}
+#endif  // THREAD_MONITOR_VIRTUAL_CLOCK
+
+TEST(ThreadCounters, ClassifyActivity) {
+    using std::chrono::milliseconds;
+    ASSERT_EQ(ThreadActivity::kIdle,
+              details::classifyThreadActivity(milliseconds{100}, milliseconds{1}, 0, true));
+    ASSERT_EQ(ThreadActivity::kSpinning,
+              details::classifyThreadActivity(milliseconds{100}, milliseconds{90}, 0, false));
+    ASSERT_EQ(ThreadActivity::kStalled,
+              details::classifyThreadActivity(milliseconds{100}, milliseconds{90}, 1000, true));
+    ASSERT_EQ(ThreadActivity::kSpinning, details::classifyThreadActivity(
+                                             milliseconds{100}, milliseconds{90}, 200000000, true));
+    ASSERT_EQ(ThreadActivity::kUnknown,
+              details::classifyThreadActivity(milliseconds{0}, milliseconds{0}, 0, true));
+}
+
+// A stale thread burning the CPU and a stale thread waiting on a condition.
+TEST(CentralRepository, ThreadCountersActivity) {
+    if (details::ThreadCounters::open(details::currentKernelThreadId(),
+                                      std::chrono::system_clock::now()) == nullptr) {
+        GTEST_SKIP() << "perf_event_open is not available";
+    }
+    ThreadMonitorCentralRepository::DomainOptions options;
+    options.name = "counters";
+    options.withMonitorThread = false;
+    ThreadMonitorCentralRepository domain(options);
+    // The counters are read past the half of the timeout.
+    domain.setThreadTimeout(std::chrono::milliseconds{80});
+    domain.setThreadCountersEnabled(true);
+
+    std::atomic<bool> terminate{false};
+    std::atomic<pid_t> spinningTid{0};
+    std::atomic<pid_t> idleTid{0};
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread spinning([&] {
+        ThreadMonitor<> monitor(domain, "spinning", 1);
+        spinningTid = details::currentKernelThreadId();
+        volatile uint64_t loops = 0;
+        while (!terminate) {
+            ++loops;
+        }
+    });
+    std::thread idle([&] {
+        ThreadMonitor<> monitor(domain, "idle", 1);
+        idleTid = details::currentKernelThreadId();
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return terminate.load(); });
+    });
+    const auto stopThreads = [&] {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            terminate = true;
+        }
+        cv.notify_all();
+        spinning.join();
+        idle.join();
+    };
+    ScopeExit joinThreads([&] {
+        if (spinning.joinable()) {
+            stopThreads();
+        }
+    });
+    while (spinningTid == 0 || idleTid == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds{1});
+    }
+
+    // The read is the delta since the registration.
+    std::this_thread::sleep_for(std::chrono::milliseconds{50});
+    domain.runMonitorCycle();
+    const auto states = domain.getAllThreadLivenessStates();
+    ASSERT_EQ(2, states.size());
+    for (const auto& state : states) {
+        if (state.tid == spinningTid) {
+            ASSERT_EQ(ThreadActivity::kSpinning, state.activity);
+        } else {
+            ASSERT_EQ(idleTid, state.tid);
+            ASSERT_EQ(ThreadActivity::kIdle, state.activity);
+        }
+    }
+
+    stopThreads();
+    // The reclaimed registrations close their counters.
+    ASSERT_EQ(2, domain.runMonitorCycle());
+}
+
+TEST(CentralRepository, DomainMonitorThread) {
+    ThreadMonitorCentralRepository::DomainOptions options;
+    options.name = "network";
+    auto domain = std::make_unique<ThreadMonitorCentralRepository>(options);
+    domain->setMonitoringInterval(std::chrono::milliseconds{1});
+    std::thread([&domain] { ThreadMonitor<> monitor(*domain, "short", 1); }).join();
+    for (int i = 0; i < 1000 && domain->threadCount() > 0; ++i) {
         std::this_thread::sleep_for(std::chrono::milliseconds{1});
-        auto states = ThreadMonitorCentralRepository::instance()->getAllThreadLivenessStates();
-        ASSERT_EQ(1, initialStates.size());
-        if (initialStates[0].lastSeenAliveTimestamp < states[0].lastSeenAliveTimestamp) {
-            break;  // Timestamp is updated.
+    }
+    ASSERT_EQ(0, domain->threadCount());
+    // The monitor thread is joined without waiting for the idle interval.
+    domain->setMonitoringInterval(std::chrono::minutes{1});
+    domain.reset();
+}
+
+TEST(CentralRepository, CooperativeDomain) {
+    ThreadMonitorCentralRepository::DomainOptions options;
+    options.cooperative = true;
+    options.sharding.shardCount = 16;
+    ThreadMonitorCentralRepository domain(options);
+    ASSERT_TRUE(domain.isCooperative());
+    domain.setReportingInterval(std::chrono::microseconds{100});
+    domain.setMonitoringInterval(std::chrono::milliseconds{2});
+    domain.setThreadTimeout(std::chrono::milliseconds{20});
+    domain.setKernelStateSamplingInterval(std::chrono::milliseconds{0});
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done = false;
+    std::thread::id callbackThread;
+    domain.setLivenessErrorConditionDetectedCallback([&] {
+        std::lock_guard<std::mutex> lock(mutex);
+        callbackThread = std::this_thread::get_id();
+        cv.notify_all();
+    });
+    {
+        std::thread frozen([&] {
+            ThreadMonitor<> monitor(domain, "frozen", 1);
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&] { return done; });
+        });
+        ScopeExit releaseFrozen([&] {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                done = true;
+            }
+            cv.notify_all();
+            frozen.join();
+        });
+        for (int i = 0; i < 10; ++i) {
+            std::thread([&domain] { ThreadMonitor<> monitor(domain, "short", 1); }).join();
+        }
+        {
+            // No monitor thread, this thread detects the frozen one and collects the others.
+            ThreadMonitor<> monitor(domain, "worker", 1);
+            for (int i = 0; i < 2000 && domain.getLivenessErrorConditionDetectedCount() == 0;
+                 ++i) {
+                std::this_thread::sleep_for(std::chrono::microseconds{500});
+                threadMonitorCheckpoint(2);
+            }
+            ASSERT_EQ(1, domain.getLivenessErrorConditionDetectedCount());
+            ASSERT_EQ(2, domain.threadCount());
+            // The slices of a complete cycle are published together.
+            ASSERT_LT(0, domain.stats().cycles);
+        }
+        // The report is delivered by the report thread, not inside the checkpoint.
+        std::unique_lock<std::mutex> lock(mutex);
+        ASSERT_TRUE(cv.wait_for(lock, std::chrono::seconds{10},
+                                [&] { return callbackThread != std::thread::id(); }));
+        ASSERT_NE(std::this_thread::get_id(), callbackThread);
+    }
+    domain.runMonitorCycle();
+    ASSERT_EQ(0, domain.threadCount());
+}
+
+TEST(CentralRepository, MonitorStats) {
+    ThreadMonitorCentralRepository::DomainOptions options;
+    options.name = "stats";
+    options.withMonitorThread = false;
+    ThreadMonitorCentralRepository domain(options);
+    domain.setReportingInterval(std::chrono::milliseconds{1});
+    ASSERT_EQ(0, domain.stats().cycles);
+
+    { ThreadMonitor<> monitor(domain, "short", 1); }
+    ThreadMonitor<> monitor(domain, "test", 1);
+    for (int i = 0; i < 10; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds{1});
+        for (int j = 0; j < 100; ++j) {
+            threadMonitorCheckpoint(2);
+        }
+        domain.runMonitorCycle();
+    }
+
+    const auto stats = domain.stats();
+    ASSERT_EQ(10, stats.cycles);
+    ASSERT_EQ(1, stats.threads);
+    ASSERT_EQ(0, stats.lastCycleGarbageCollected);
+    ASSERT_EQ(1, stats.garbageCollected);
+    ASSERT_LT(0, stats.checkpointRateSum);
+    ASSERT_LE(std::chrono::system_clock::duration::zero(), stats.lastCycleDuration);
+    ASSERT_LE(stats.lastCycleDuration, stats.cycleDurationSum);
+    auto states = domain.getAllThreadLivenessStates();
+    ASSERT_EQ(1, states.size());
+    ASSERT_EQ(stats.checkpointRateSum, states[0].checkpointsPerSecond);
+
+    std::ostringstream text;
+    writePrometheusText(text, stats, domain.name());
+    ASSERT_NE(std::string::npos, text.str().find("thread_monitor_threads{domain=\"stats\"} 1\n"));
+    ASSERT_NE(std::string::npos,
+              text.str().find(
+                  "thread_monitor_staleness_seconds_bucket{domain=\"stats\",le=\"+Inf\"} 1\n"));
+    ASSERT_NE(std::string::npos,
+              text.str().find("thread_monitor_cycles_total{domain=\"stats\"} 10\n"));
+
+    std::ostringstream escaped;
+    writePrometheusText(escaped, stats, "a\\b\"c\nd");
+    ASSERT_NE(std::string::npos,
+              escaped.str().find("thread_monitor_threads{domain=\"a\\\\b\\\"c\\nd\"} 1\n"));
+}
+
+TEST(CentralRepository, CooperativeSlicesPublishFullCycles) {
+    ThreadMonitorCentralRepository::DomainOptions options;
+    options.cooperative = true;
+    options.sharding.shardCount = 10;
+    ThreadMonitorCentralRepository domain(options);
+    domain.setMonitoringInterval(std::chrono::milliseconds{10});
+    ThreadMonitor<> monitor(domain, "test", 1);
+    auto now = std::chrono::system_clock::now();
+    const auto nextSlice = [&] {
+        now += std::chrono::seconds{1};
+        domain.maybeRunMonitorSlice(now);
+    };
+
+    // The slices scan 4, 4 and 2 shards.
+    nextSlice();
+    ASSERT_EQ(0, domain.stats().cycles);
+    // A full cycle in the middle is published alone.
+    domain.runMonitorCycle();
+    ASSERT_EQ(1, domain.stats().cycles);
+    ASSERT_EQ(1, domain.stats().threads);
+    nextSlice();
+    ASSERT_EQ(1, domain.stats().cycles);
+    nextSlice();
+    ASSERT_EQ(2, domain.stats().cycles);
+    ASSERT_EQ(1, domain.stats().threads);
+}
+
+size_t countOccurrences(const std::string& text, const std::string& pattern) {
+    size_t count = 0;
+    for (size_t pos = text.find(pattern); pos != std::string::npos;
+         pos = text.find(pattern, pos + 1)) {
+        ++count;
+    }
+    return count;
+}
+
+details::ThreadMonitorBase::HistoryRecord historyRecord(uint32_t checkpointId,
+                                                        std::chrono::system_clock::time_point ts) {
+    details::ThreadMonitorBase::HistoryRecord record{};
+    record.checkpointId = checkpointId;
+    record.timestamp = ts;
+    return record;
+}
+
+TEST(ChromeTraceWriter, StreamsIntervals) {
+    const auto start = std::chrono::system_clock::now();
+    details::ThreadMonitorBase::History history;
+    for (uint32_t i = 0; i < 3; ++i) {
+        history.push_back(historyRecord(i + 1, start + std::chrono::milliseconds{i}));
+    }
+    std::ostringstream out;
+    ChromeTraceWriter writer(out);
+    // Two threads with the same kernel thread id are separate tracks.
+    const int worker = 0;
+    const int shortLived = 0;
+    writer.addHistory(&worker, 1, "worker \"1\"", history);
+    writer.addHistory(&shortLived, 1, "short", history);
+    writer.endSnapshot();
+    // Overlaps with the previous snapshot.
+    history.push_back(historyRecord(4, start + std::chrono::milliseconds{3}));
+    writer.addHistory(&worker, 1, "worker \"1\"", history);
+    writer.endSnapshot();
+    writer.finish(start + std::chrono::milliseconds{10});
+
+    const std::string text = out.str();
+    ASSERT_EQ(0, text.find("{\"displayTimeUnit\":\"ms\",\"traceEvents\":["));
+    ASSERT_EQ("]}\n", text.substr(text.size() - 3));
+    ASSERT_NE(std::string::npos, text.find("\"args\":{\"name\":\"worker \\\"1\\\"\",\"tid\":1}"));
+    ASSERT_EQ(2, countOccurrences(text, "\"thread_name\""));
+    // Worker: 1-2, 2-3, 3-4 and 4 until the end. Short: 1-2, 2-3, then gone.
+    ASSERT_EQ(6, countOccurrences(text, "\"ph\":\"X\""));
+    ASSERT_EQ(1, countOccurrences(text, "\"ph\":\"i\""));
+    ASSERT_EQ(1, countOccurrences(text, "\"name\":\"4\",\"ts\""));
+    ASSERT_EQ(1, countOccurrences(text, "\"dur\":7000}"));
+}
+
+TEST(ChromeTraceWriter, StartsFreshSliceAfterGap) {
+    const auto start = std::chrono::system_clock::now();
+    std::ostringstream out;
+    ChromeTraceWriter writer(out);
+    const int thread = 0;
+    writer.addHistory(&thread, 1, "worker",
+                      {historyRecord(1, start),
+                       historyRecord(2, start + std::chrono::milliseconds{1})});
+    writer.endSnapshot();
+    // The checkpoints 3 and 4 were overwritten before the next snapshot.
+    writer.addHistory(&thread, 1, "worker",
+                      {historyRecord(5, start + std::chrono::milliseconds{4}),
+                       historyRecord(6, start + std::chrono::milliseconds{5})});
+    writer.endSnapshot();
+    writer.finish(start + std::chrono::milliseconds{6});
+
+    const std::string text = out.str();
+    // 1-2, 5-6 and 6 until the end, the checkpoint 2 ends with an instant event.
+    ASSERT_EQ(3, countOccurrences(text, "\"ph\":\"X\""));
+    ASSERT_EQ(1, countOccurrences(text, "\"ph\":\"i\""));
+    ASSERT_EQ(0, countOccurrences(text, "\"dur\":3000}"));
+}
+
+TEST(CentralRepository, TraceCapture) {
+    ThreadMonitorCentralRepository::DomainOptions options;
+    options.withMonitorThread = false;
+    ThreadMonitorCentralRepository domain(options);
+    const std::string path =
+        testing::TempDir() + "/trace_capture_" + std::to_string(::getpid()) + ".json";
+
+    ThreadMonitor<> monitor(domain, "traced", 1);
+    ASSERT_TRUE(domain.startTraceCapture(path, std::chrono::hours{1}));
+    ASSERT_FALSE(domain.startTraceCapture(path, std::chrono::hours{1}));
+    ASSERT_TRUE(domain.isTraceCaptureActive());
+    for (uint32_t id = 2; id < 10; ++id) {
+        std::this_thread::sleep_for(std::chrono::microseconds{100});
+        threadMonitorCheckpoint(id);
+        if (id % 3 == 0) {
+            domain.runMonitorCycle();
         }
     }
+    domain.stopTraceCapture();
+    ASSERT_FALSE(domain.isTraceCaptureActive());
+
+    std::ifstream file(path);
+    const std::string text((std::istreambuf_iterator<char>(file)),
+                           std::istreambuf_iterator<char>());
+    std::remove(path.c_str());
+    ASSERT_EQ("]}\n", text.substr(text.size() - 3));
+    ASSERT_EQ(1, countOccurrences(text, "\"thread_name\""));
+    // Every checkpoint is written once regardless of the snapshot count.
+    for (uint32_t id = 1; id < 10; ++id) {
+        ASSERT_EQ(1, countOccurrences(text, "\"name\":\"" + std::to_string(id) + "\",\"ts\""));
+    }
+
+    std::ostringstream snapshot;
+    domain.writeChromeTrace(snapshot);
+    ASSERT_EQ(9, countOccurrences(snapshot.str(), "\"ph\":\"X\""));
+}
+
+TEST(CentralRepository, IntrospectionServer) {
+    const std::string path =
+        testing::TempDir() + "/introspection_" + std::to_string(::getpid()) + ".sock";
+    ThreadMonitorCentralRepository::DomainOptions options;
+    options.name = "introspected";
+    options.withMonitorThread = false;
+    options.introspectionSocket = path.c_str();
+    ThreadMonitorCentralRepository domain(options);
+    ASSERT_FALSE(domain.startIntrospectionServer(path));
+    // The socket of a live server is not replaced.
+    details::IntrospectionServer other(
+        [](const std::string&, std::ostream& out) { out << "other"; });
+    ASSERT_FALSE(other.start(path));
+
+    // More registrations than one batch, without monitors.
+    for (int i = 0; i < 3000; ++i) {
+        domain.registerThread(std::this_thread::get_id(), i + 1, nullptr, nullptr,
+                              std::chrono::system_clock::now());
+    }
+    ThreadMonitor<> monitor(domain, "inspected \"thread\"", 1);
+    std::this_thread::sleep_for(std::chrono::milliseconds{1});
+    threadMonitorCheckpoint(2);
+    domain.runMonitorCycle();
+
+    std::ostringstream states;
+    ASSERT_TRUE(details::requestIntrospection(path, "states", states));
+    ASSERT_EQ(0, states.str().find("{\"domain\":\"introspected\",\"threads\":["));
+    ASSERT_EQ(3001, countOccurrences(states.str(), "\"tid\":"));
+    ASSERT_NE(std::string::npos,
+              states.str().find("\"tid\":" + std::to_string(details::currentKernelThreadId())));
+
+    std::ostringstream histories;
+    ASSERT_TRUE(details::requestIntrospection(path, "histories", histories));
+    ASSERT_EQ(1, countOccurrences(histories.str(), "\"tid\":"));
+    ASSERT_NE(std::string::npos, histories.str().find("\"name\":\"inspected \\\"thread\\\"\""));
+    ASSERT_EQ(2, countOccurrences(histories.str(), "\"checkpoint\":"));
+
+    std::ostringstream stats;
+    ASSERT_TRUE(details::requestIntrospection(path, "stats", stats));
+    ASSERT_NE(std::string::npos,
+              stats.str().find("thread_monitor_threads{domain=\"introspected\"} 3001\n"));
+
+    std::ostringstream unknown;
+    ASSERT_TRUE(details::requestIntrospection(path, "bogus", unknown));
+    ASSERT_EQ(0, unknown.str().find("{\"error\":\"unknown command\""));
+
+    domain.stopIntrospectionServer();
+    std::ostringstream stopped;
+    ASSERT_FALSE(details::requestIntrospection(path, "states", stopped));
+
+    // The socket file left by a dead listener is replaced.
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::snprintf(address.sun_path, sizeof(address.sun_path), "%s", path.c_str());
+    const int stale = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT_EQ(0, ::bind(stale, reinterpret_cast<sockaddr*>(&address), sizeof(address)));
+    ::close(stale);
+    ASSERT_TRUE(domain.startIntrospectionServer(path));
+    std::ostringstream restarted;
+    ASSERT_TRUE(details::requestIntrospection(path, "stats", restarted));
+    domain.stopIntrospectionServer();
+}
+
+template <typename Policy>
+class RepositoryPolicyTest : public testing::Test {};
+
+using RepositoryPolicies = testing::Types<
+    DefaultRepositoryPolicy,
+    RepositoryPolicy<policy::CoarseSystemClock, policy::SpinLock, policy::ColonyContainer>,
+    RepositoryPolicy<policy::SystemClock, policy::SpinLock, policy::ListContainer>,
+    RepositoryPolicy<policy::CoarseSystemClock, policy::NoLock, policy::ListContainer>>;
+TYPED_TEST_SUITE(RepositoryPolicyTest, RepositoryPolicies);
+
+TYPED_TEST(RepositoryPolicyTest, RegisterDetectAndCollect) {
+    ThreadMonitorCentralRepository::DomainOptions options;
+    options.withMonitorThread = false;
+    BasicThreadMonitorCentralRepository<TypeParam> domain(options);
+    domain.setThreadTimeout(std::chrono::milliseconds{5});
+    domain.setKernelStateSamplingInterval(std::chrono::milliseconds{0});
+    domain.reserve(100);
+    {
+        ThreadMonitor<> monitor(domain, "frozen", 1);
+        ThreadMonitor<> nested(domain, "nested", 1);
+        ASSERT_FALSE(nested.isEnabled());
+        ASSERT_EQ(1, domain.threadCount());
+        std::this_thread::sleep_for(std::chrono::milliseconds{20});
+        ASSERT_EQ(0, domain.runMonitorCycle());
+        ASSERT_EQ(1, domain.getLivenessErrorConditionDetectedCount());
+    }
+    for (int i = 0; i < 10; ++i) {
+        ThreadMonitor<> monitor(domain, "short", 1);
+    }
+    ASSERT_EQ(11, domain.runMonitorCycle());
+    ASSERT_EQ(0, domain.threadCount());
+    domain.trim();
+}
+
+TYPED_TEST(RepositoryPolicyTest, ReclaimedSlotsAreReused) {
+    ThreadMonitorCentralRepository::DomainOptions options;
+    options.withMonitorThread = false;
+    BasicThreadMonitorCentralRepository<TypeParam> domain(options);
+    const auto registerOne = [&domain] {
+        return domain.registerThread(std::this_thread::get_id(), 0, nullptr, nullptr,
+                                     std::chrono::system_clock::now());
+    };
+    std::vector<MonitorDomain::ThreadRegistration*> retired;
+    for (int i = 0; i < 3; ++i) {
+        retired.push_back(registerOne());
+    }
+    for (auto* r : retired) {
+        MonitorDomain::deregisterThread(r);
+    }
+    // Retired but not reclaimed yet.
+    ASSERT_EQ(3, domain.threadCount());
+    ASSERT_TRUE(domain.getAllThreadLivenessStates().empty());
+    ASSERT_EQ(3, domain.runMonitorCycle());
+    ASSERT_EQ(0, domain.threadCount());
+
+    // Same thread, same shard: the reclaimed slots are reused.
+    auto* reused = registerOne();
+    ASSERT_NE(retired.end(), std::find(retired.begin(), retired.end(), reused));
+    ASSERT_EQ(1, domain.threadCount());
+    ASSERT_EQ(1, domain.getAllThreadLivenessStates().size());
+
+    // The trim releases the free slots, the retired ones are reclaimed first.
+    auto* live = registerOne();
+    MonitorDomain::deregisterThread(reused);
+    domain.trim();
+    ASSERT_EQ(1, domain.threadCount());
+    MonitorDomain::deregisterThread(live);
+    ASSERT_EQ(1, domain.runMonitorCycle());
+    ASSERT_EQ(0, domain.threadCount());
+}
+
+TYPED_TEST(RepositoryPolicyTest, BurstOfFreeSlotsIsErased) {
+    ThreadMonitorCentralRepository::DomainOptions options;
+    options.withMonitorThread = false;
+    BasicThreadMonitorCentralRepository<TypeParam> domain(options);
+    const auto registerOne = [&domain] {
+        return domain.registerThread(std::this_thread::get_id(), 0, nullptr, nullptr,
+                                     std::chrono::system_clock::now());
+    };
+    // Same thread, same shard: far more free slots than the shard keeps.
+    std::vector<MonitorDomain::ThreadRegistration*> retired;
+    for (int i = 0; i < 3000; ++i) {
+        retired.push_back(registerOne());
+    }
+    for (auto* r : retired) {
+        MonitorDomain::deregisterThread(r);
+    }
+    ASSERT_EQ(3000, domain.runMonitorCycle());
+    ASSERT_EQ(0, domain.threadCount());
+
+    // The kept slots are still reused.
+    std::vector<MonitorDomain::ThreadRegistration*> live;
+    for (int i = 0; i < 10; ++i) {
+        live.push_back(registerOne());
+        ASSERT_NE(retired.end(), std::find(retired.begin(), retired.end(), live.back()));
+    }
+    ASSERT_EQ(10, domain.threadCount());
+    ASSERT_EQ(10, domain.getAllThreadLivenessStates().size());
+    domain.trim();
+    ASSERT_EQ(10, domain.getAllThreadLivenessStates().size());
+    for (auto* r : live) {
+        MonitorDomain::deregisterThread(r);
+    }
+    ASSERT_EQ(10, domain.runMonitorCycle());
+    ASSERT_EQ(0, domain.threadCount());
+}
+
+TEST(CentralRepository, RecordsKernelThreadId) {
+    ThreadMonitorCentralRepository::instance()->runMonitorCycle();
+    ThreadMonitor<> monitor("test", 1);
+    auto states = ThreadMonitorCentralRepository::instance()->getAllThreadLivenessStates();
+    ASSERT_EQ(1, states.size());
+    ASSERT_EQ(details::currentKernelThreadId(), states[0].tid);
+}
+
+TEST(KernelThreadState, ReadCurrentThread) {
+    KernelThreadState state;
+    ASSERT_TRUE(readKernelThreadState(details::currentKernelThreadId(), &state));
+    ASSERT_EQ('R', state.state);
+    ASSERT_GE(state.lastCpu, 0);
+    ASSERT_FALSE(readKernelThreadState(-1, &state));
+}
+
+TEST(KernelThreadState, BlockedThreadDiagnosis) {
+    std::mutex mutex;
+    std::condition_variable cv;
+    pid_t tid = 0;
+    bool terminate = false;
+    std::thread t([&] {
+        std::unique_lock<std::mutex> lock(mutex);
+        tid = details::currentKernelThreadId();
+        cv.notify_all();
+        cv.wait(lock, [&] { return terminate; });
+    });
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return tid != 0; });
+    }
+
+    auto reports = sampleKernelThreadStates({tid}, std::chrono::milliseconds{20});
+    ASSERT_EQ(1, reports.size());
+    ASSERT_TRUE(reports[0].valid);
+    ASSERT_EQ(tid, reports[0].state.tid);
+    ASSERT_EQ(ThreadStallDiagnosis::kBlocked, reports[0].diagnosis);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        terminate = true;
+    }
+    cv.notify_all();
+    t.join();
+}
+
+TEST(NativeStackCapture, CapturesWaitingThread) {
+    std::mutex mutex;
+    std::condition_variable cv;
+    pid_t tid = 0;
+    bool terminate = false;
+    std::thread t([&] {
+        std::unique_lock<std::mutex> lock(mutex);
+        tid = details::currentKernelThreadId();
+        cv.notify_all();
+        cv.wait(lock, [&] { return terminate; });
+    });
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return tid != 0; });
+    }
+
+    auto stacks = captureNativeStacks({tid}, std::chrono::seconds{5});
+    ASSERT_EQ(1, stacks.size());
+    ASSERT_EQ(tid, stacks[0].tid);
+    ASSERT_TRUE(stacks[0].captured);
+    ASSERT_FALSE(stacks[0].frames.empty());
+    ASSERT_EQ(stacks[0].frames.size(), symbolizeNativeStack(stacks[0]).size());
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        terminate = true;
+    }
+    cv.notify_all();
+    t.join();
+}
+
+// A thread that never handles the signal does not block the capture.
+TEST(NativeStackCapture, TimesOutOnMaskedSignal) {
+    std::atomic<pid_t> tid{0};
+    std::atomic<bool> terminate{false};
+    std::thread t([&] {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGRTMIN + kStackCaptureSignalOffset);
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+        tid = details::currentKernelThreadId();
+        while (!terminate) {
+            std::this_thread::sleep_for(std::chrono::milliseconds{1});
+        }
+    });
+    while (tid == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds{1});
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    auto stacks = captureNativeStacks({tid}, std::chrono::milliseconds{20});
+    ASSERT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds{1});
+    ASSERT_EQ(1, stacks.size());
+    ASSERT_FALSE(stacks[0].captured);
+
+    terminate = true;
+    t.join();
 }
 
 }  // namespace
@@ -0,0 +1,18 @@
+#include <iostream>
+
+#include "thread_monitor/introspection_server.h"
+
+// Prints the response of a thread monitor domain serving the introspection
+// requests, see `startIntrospectionServer()`.
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " <socket path> <states|histories|stats|trace>"
+                  << std::endl;
+        return 2;
+    }
+    if (!thread_monitor::details::requestIntrospection(argv[1], argv[2], std::cout)) {
+        std::cerr << "Cannot connect to " << argv[1] << std::endl;
+        return 1;
+    }
+    return 0;
+}
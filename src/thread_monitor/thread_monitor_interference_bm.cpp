@@ -0,0 +1,179 @@
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "thread_monitor/benchmark_support.h"
+#include "thread_monitor/thread_monitor.h"
+
+// Cost of the instrumented thread operations while the monitor cycle and the
+// garbage collection run concurrently: the shard lock waits, the cache lines
+// bounced between the monitor and the instrumented threads and the erases
+// under the shard locks. Every benchmark takes range(0) churn threads and
+// range(1) = 1 to run the monitor cycles back to back, the run without any
+// load is the baseline of the inflation counters.
+
+namespace thread_monitor {
+namespace {
+
+// Live registrations scanned by every monitor cycle.
+constexpr int kPreloadedRegistrations = 10000;
+
+// Checkpoints of a churn thread monitor before it is deleted.
+constexpr int kChurnCheckpoints = 8;
+
+// Without the background monitor cycles the measured thread collects the
+// tombstones outside of the measured time every this many operations.
+constexpr int64_t kGarbageCollectionPeriod = 4096;
+
+/**
+ * Background load against a domain until destroyed: every churn thread creates
+ * a monitor, checkpoints a few times and deletes it, leaving a tombstone for the
+ * garbage collection, and the monitor thread runs the monitor cycles back to back.
+ */
+class BackgroundLoad {
+public:
+    BackgroundLoad(ThreadMonitorCentralRepository* domain, int churnThreads, bool monitorCycles) {
+        for (int i = 0; i < churnThreads; ++i) {
+            _threads.emplace_back([this, domain] {
+                while (!_stop.load(std::memory_order_relaxed)) {
+                    ThreadMonitor<> monitor(*domain, "churn", 1);
+                    for (int c = 0; c < kChurnCheckpoints; ++c) {
+                        threadMonitorCheckpoint(c + 2);
+                    }
+                    _churn.fetch_add(1, std::memory_order_relaxed);
+                }
+            });
+        }
+        if (monitorCycles) {
+            _threads.emplace_back([this, domain] {
+                while (!_stop.load(std::memory_order_relaxed)) {
+                    domain->runMonitorCycle();
+                    _cycles.fetch_add(1, std::memory_order_relaxed);
+                }
+            });
+        }
+    }
+
+    ~BackgroundLoad() {
+        _stop = true;
+        for (auto& t : _threads) {
+            t.join();
+        }
+    }
+
+    uint64_t churn() const {
+        return _churn.load();
+    }
+
+    uint64_t cycles() const {
+        return _cycles.load();
+    }
+
+private:
+    std::atomic<bool> _stop{false};
+    std::atomic<uint64_t> _churn{0};
+    std::atomic<uint64_t> _cycles{0};
+    std::vector<std::thread> _threads;
+};
+
+// The registrations are all from one thread, thus in one shard.
+ThreadMonitorCentralRepository* interferenceDomain() {
+    return benchmark_support::preloadedDomain("interference", kPreloadedRegistrations, 1);
+}
+
+/**
+ * Runs the timed 'operation' under the background load of the benchmark
+ * arguments and reports its percentiles, the inflation of the tail latency over
+ * the run without the load and the cache misses per operation of the measured
+ * thread, when the perf counters are available.
+ */
+template <typename Operation>
+void runWithInterference(benchmark::State& state, const std::string& name, Operation operation) {
+    static std::mutex mutex;
+    static std::map<std::string, std::pair<uint64_t, uint64_t>> baselines;
+
+    auto* const domain = interferenceDomain();
+    domain->runMonitorCycle();
+    benchmark_support::LatencyHistogram latency;
+    benchmark_support::PerfCounter cacheMisses(benchmark_support::PerfCounter::kCacheMisses);
+    std::optional<BackgroundLoad> load;
+    load.emplace(domain, state.range(0), state.range(1) == 1);
+    const uint64_t missesBefore = cacheMisses.read();
+    int64_t iteration = 0;
+    for (auto _ : state) {
+        latency.record(operation());
+        if (state.range(1) == 0 && ++iteration % kGarbageCollectionPeriod == 0) {
+            state.PauseTiming();
+            domain->runMonitorCycle();
+            state.ResumeTiming();
+        }
+    }
+    const uint64_t missesAfter = cacheMisses.read();
+    const uint64_t churn = load->churn();
+    const uint64_t cycles = load->cycles();
+    load.reset();
+
+    benchmark_support::reportHistogram(state, latency);
+    state.counters["churn_per_s"] = benchmark::Counter(churn, benchmark::Counter::kIsRate);
+    state.counters["cycles_per_s"] = benchmark::Counter(cycles, benchmark::Counter::kIsRate);
+    if (cacheMisses.valid()) {
+        state.counters["cache_misses_per_op"] =
+            static_cast<double>(missesAfter - missesBefore) / state.iterations();
+    }
+    const uint64_t p99 = latency.percentile(0.99);
+    const uint64_t p999 = latency.percentile(0.999);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (state.range(0) == 0 && state.range(1) == 0) {
+        baselines[name] = {p99, p999};
+    } else if (baselines.count(name) > 0 && baselines[name].first > 0) {
+        state.counters["p99_inflation"] = static_cast<double>(p99) / baselines[name].first;
+        state.counters["p999_inflation"] =
+            static_cast<double>(p999) / baselines[name].second;
+    }
+}
+
+static void BM_InterferenceCheckpoint(benchmark::State& state) {
+    ThreadMonitor<> monitor(*interferenceDomain(), "measured", 1);
+    uint32_t id = 0;
+    runWithInterference(state, "checkpoint", [&id] {
+        const auto start = std::chrono::steady_clock::now();
+        threadMonitorCheckpoint(++id % 16 + 2);
+        return benchmark_support::elapsedNanos(start, std::chrono::steady_clock::now());
+    });
+}
+
+static void BM_InterferenceCreateDelete(benchmark::State& state) {
+    auto* const domain = interferenceDomain();
+    runWithInterference(state, "create_delete", [domain] {
+        const auto start = std::chrono::steady_clock::now();
+        {
+            ThreadMonitor<> monitor(*domain, "measured", 1);
+        }
+        return benchmark_support::elapsedNanos(start, std::chrono::steady_clock::now());
+    });
+}
+
+// The baseline {0, 0} runs first.
+BENCHMARK(BM_InterferenceCheckpoint)
+    ->ArgsProduct({{0, 1, 8}, {0, 1}})
+    ->ArgNames({"churn", "monitor"})
+    ->MinTime(1)
+    ->UseRealTime();
+
+BENCHMARK(BM_InterferenceCreateDelete)
+    ->ArgsProduct({{0, 1, 8}, {0, 1}})
+    ->ArgNames({"churn", "monitor"})
+    ->MinTime(1)
+    ->UseRealTime();
+
+}  // namespace
+}  // namespace thread_monitor
+
+BENCHMARK_MAIN();
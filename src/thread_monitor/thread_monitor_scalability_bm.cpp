@@ -0,0 +1,241 @@
+#include <chrono>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "thread_monitor/benchmark_support.h"
+#include "thread_monitor/kernel_thread_state.h"
+#include "thread_monitor/monitor_simulation.h"
+#include "thread_monitor/thread_monitor.h"
+
+// Scalability of one domain from 1k to 1M registrations. Every operation is
+// timed separately into a `LatencyHistogram`, the percentiles include the
+// ~20-50ns of the two clock reads. Run with `--benchmark_out=<file>.json` and
+// compare to a baseline with `tools/compare_benchmarks.py`.
+
+namespace thread_monitor {
+namespace {
+
+// The preloaded registrations are spread over this many threads, thus every
+// thread has many monitors and the registrations land in different shards.
+constexpr int kLoaderThreads = 64;
+
+// Deregistered monitors are garbage collected outside of the measured time
+// every this many operations, keeping the domain size stable.
+constexpr int64_t kGarbageCollectionPeriod = 4096;
+
+const std::vector<int64_t> kRegistrations{1000, 10000, 100000, 1000000};
+
+ThreadMonitorCentralRepository* scalabilityDomain(int64_t registrations) {
+    return benchmark_support::preloadedDomain("scalability", registrations, kLoaderThreads);
+}
+
+// Latencies of the monitor constructor and destructor in a domain with
+// range(0) registrations.
+static void BM_ScaleRegisterDeregister(benchmark::State& state) {
+    auto* const domain = scalabilityDomain(state.range(0));
+    benchmark_support::LatencyHistogram registerLatency;
+    benchmark_support::LatencyHistogram deregisterLatency;
+    std::optional<ThreadMonitor<>> monitor;
+    int64_t iteration = 0;
+    for (auto _ : state) {
+        const auto start = std::chrono::steady_clock::now();
+        monitor.emplace(*domain, "scalability", 1);
+        const auto registered = std::chrono::steady_clock::now();
+        monitor.reset();
+        const auto deregistered = std::chrono::steady_clock::now();
+        registerLatency.record(benchmark_support::elapsedNanos(start, registered));
+        deregisterLatency.record(benchmark_support::elapsedNanos(registered, deregistered));
+        if (state.thread_index() == 0 && ++iteration % kGarbageCollectionPeriod == 0) {
+            state.PauseTiming();
+            domain->runMonitorCycle();
+            state.ResumeTiming();
+        }
+    }
+    static benchmark_support::HistogramMerger registerLatencies;
+    static benchmark_support::HistogramMerger deregisterLatencies;
+    registerLatencies.report(state, registerLatency, "register_");
+    deregisterLatencies.report(state, deregisterLatency, "deregister_");
+}
+
+BENCHMARK(BM_ScaleRegisterDeregister)
+    ->ArgsProduct({kRegistrations})
+    ->Threads(1)
+    ->Threads(8)
+    ->MinTime(1)
+    ->UseRealTime();
+
+// Checkpoint latency in a domain with range(0) registrations.
+static void BM_ScaleCheckpoint(benchmark::State& state) {
+    auto* const domain = scalabilityDomain(state.range(0));
+    benchmark_support::LatencyHistogram latency;
+    ThreadMonitor<> monitor(*domain, "scalability", 1);
+    uint32_t id = 0;
+    for (auto _ : state) {
+        const auto start = std::chrono::steady_clock::now();
+        threadMonitorCheckpoint(++id % 16 + 2);
+        latency.record(benchmark_support::elapsedNanos(start, std::chrono::steady_clock::now()));
+    }
+    static benchmark_support::HistogramMerger latencies;
+    latencies.report(state, latency);
+}
+
+BENCHMARK(BM_ScaleCheckpoint)
+    ->ArgsProduct({kRegistrations})
+    ->Threads(1)
+    ->Threads(8)
+    ->MinTime(1)
+    ->UseRealTime();
+
+// Monitor cycle of a domain with range(0) registrations and a garbage
+// collection backlog of range(1) percent of the registrations, deregistered
+// outside of the measured time before every cycle.
+static void BM_ScaleMonitorCycle(benchmark::State& state) {
+    auto* const domain = scalabilityDomain(state.range(0));
+    const int64_t backlog = state.range(0) * state.range(1) / 100;
+    const pid_t tid = details::currentKernelThreadId();
+    benchmark_support::LatencyHistogram latency;
+    domain->runMonitorCycle();
+    for (auto _ : state) {
+        state.PauseTiming();
+        for (int64_t i = 0; i < backlog; ++i) {
+            auto* r = domain->registerThread(std::this_thread::get_id(), tid, nullptr, nullptr,
+                                             std::chrono::system_clock::now());
+            MonitorDomain::deregisterThread(r);
+        }
+        state.ResumeTiming();
+        const auto start = std::chrono::steady_clock::now();
+        benchmark::DoNotOptimize(domain->runMonitorCycle());
+        latency.record(benchmark_support::elapsedNanos(start, std::chrono::steady_clock::now()));
+    }
+    benchmark_support::reportHistogram(state, latency);
+    state.counters["registrations"] = state.range(0);
+    state.counters["backlog"] = backlog;
+}
+
+BENCHMARK(BM_ScaleMonitorCycle)
+    ->ArgsProduct({kRegistrations, {0, 1, 10}})
+    ->MinTime(0.5)
+    ->UseRealTime()
+    ->Unit(benchmark::kMicrosecond);
+
+#ifdef THREAD_MONITOR_VIRTUAL_CLOCK
+// Monitor cycle of a simulated domain with range(0) monitors and three
+// escalation tiers. With range(1) = 0 no thread reaches the lowest threshold,
+// the cost of the tiers is one comparison per thread, compare with
+// `BM_ScaleMonitorCycle`. With range(1) = 1 every monitor exceeds the lowest
+// tier and its last checkpoint is checked, up to `maxThreads` of the tier.
+static void BM_ScaleEscalationTiers(benchmark::State& state) {
+    MonitorSimulation::Options options;
+    options.name = "escalation";
+    options.threadTimeout = std::chrono::hours{24};
+    options.threadIds = kLoaderThreads;
+    MonitorSimulation simulation(options);
+    simulation.addMonitors(state.range(0));
+    const auto base = state.range(1) == 1 ? std::chrono::system_clock::duration::zero()
+                                          : std::chrono::hours{1};
+    uint64_t events = 0;
+    const char* const names[] = {"warn", "snapshot", "fault"};
+    for (int i = 0; i < 3; ++i) {
+        MonitorDomain::EscalationTier tier;
+        tier.name = names[i];
+        tier.threshold = base + std::chrono::milliseconds{50} * (i * 20 + 1);
+        tier.callback = [&events](const MonitorDomain::EscalationEvent&) { ++events; };
+        simulation.domain().addEscalationTier(tier);
+    }
+    simulation.advance(std::chrono::milliseconds{100});
+    benchmark_support::LatencyHistogram latency;
+    for (auto _ : state) {
+        latency.record(simulation.runMonitorCycle().duration.count());
+    }
+    benchmark_support::reportHistogram(state, latency);
+    state.counters["events"] = events;
+}
+
+BENCHMARK(BM_ScaleEscalationTiers)
+    ->ArgsProduct({{1000, 10000, 100000}, {0, 1}})
+    ->ArgNames({"monitors", "stale"})
+    ->MinTime(0.5)
+    ->UseRealTime()
+    ->Unit(benchmark::kMicrosecond);
+#endif  // THREAD_MONITOR_VIRTUAL_CLOCK
+
+// The health check looking for the threads stale for an hour, none of the
+// preloaded registrations: the full snapshot copied and filtered by the caller
+// against the streaming query, range(1) = 1.
+static void BM_ScaleStaleThreadQuery(benchmark::State& state) {
+    auto* const domain = scalabilityDomain(state.range(0));
+    benchmark_support::LatencyHistogram latency;
+    MonitorDomain::LivenessQuery query;
+    query.minStaleness = std::chrono::hours{1};
+    for (auto _ : state) {
+        const auto start = std::chrono::steady_clock::now();
+        size_t stale = 0;
+        if (state.range(1) == 0) {
+            const auto staleBefore = std::chrono::system_clock::now() - query.minStaleness;
+            for (const auto& s : domain->getAllThreadLivenessStates()) {
+                stale += s.lastSeenAliveTimestamp <= staleBefore ? 1 : 0;
+            }
+        } else {
+            domain->queryThreadLiveness(
+                query, [&stale](const MonitorDomain::LivenessMatch&) { ++stale; });
+        }
+        benchmark::DoNotOptimize(stale);
+        latency.record(benchmark_support::elapsedNanos(start, std::chrono::steady_clock::now()));
+    }
+    benchmark_support::reportHistogram(state, latency);
+}
+
+BENCHMARK(BM_ScaleStaleThreadQuery)
+    ->ArgsProduct({kRegistrations, {0, 1}})
+    ->ArgNames({"registrations", "streaming"})
+    ->MinTime(0.5)
+    ->UseRealTime()
+    ->Unit(benchmark::kMicrosecond);
+
+#ifdef THREAD_MONITOR_VIRTUAL_CLOCK
+// The monitor cycle of range(0) simulated monitors checkpointing every minute
+// of the virtual time, range(1) percent of them deleted before every cycle and
+// replaced by the new ones. The cycle is timed with the wall clock, this is the
+// cost model of a domain of that size without starting that many threads.
+static void BM_SimulatedMonitorCycle(benchmark::State& state) {
+    MonitorSimulation::Options options;
+    options.threadTimeout = std::chrono::hours{1};
+    options.reportingInterval = std::chrono::seconds{10};
+    MonitorSimulation simulation(options);
+    const size_t monitors = state.range(0);
+    const size_t churn = monitors * state.range(1) / 100;
+    size_t first = simulation.addMonitors(monitors);
+    benchmark_support::LatencyHistogram latency;
+    uint64_t garbageCollected = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        simulation.advance(std::chrono::minutes{1});
+        simulation.removeMonitors(first, churn);
+        first += churn;
+        simulation.addMonitors(churn);
+        simulation.checkpoint(first, monitors, 2);
+        state.ResumeTiming();
+        const auto cycle = simulation.runMonitorCycle();
+        latency.record(cycle.duration.count());
+        garbageCollected += cycle.garbageCollected;
+    }
+    benchmark_support::reportHistogram(state, latency);
+    state.counters["gc_per_cycle"] =
+        static_cast<double>(garbageCollected) / state.iterations();
+}
+
+BENCHMARK(BM_SimulatedMonitorCycle)
+    ->ArgsProduct({{10000, 100000, 1000000}, {0, 1}})
+    ->ArgNames({"monitors", "churn"})
+    ->MinTime(0.5)
+    ->UseRealTime()
+    ->Unit(benchmark::kMicrosecond);
+#endif  // THREAD_MONITOR_VIRTUAL_CLOCK
+
+}  // namespace
+}  // namespace thread_monitor
+
+BENCHMARK_MAIN();
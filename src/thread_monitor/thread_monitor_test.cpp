@@ -1,14 +1,35 @@
 #include "thread_monitor/thread_monitor.h"
 
+#include <cstring>
+#include <sstream>
 #include <thread>
+#include <utility>
 
 #include "gtest/gtest.h"
+#include "thread_monitor/kernel_thread_state.h"
 
 namespace thread_monitor {
 namespace {
 
 using namespace std::chrono_literals;
 
+// Runs 'onExit' when the test returns, also on the early return of a failed ASSERT,
+// thus the threads started by the test are never left joinable.
+template <typename F>
+class ScopeExit {
+public:
+    explicit ScopeExit(F onExit) : _onExit(std::move(onExit)) {}
+    ~ScopeExit() {
+        _onExit();
+    }
+
+    ScopeExit(const ScopeExit&) = delete;
+    ScopeExit& operator=(const ScopeExit&) = delete;
+
+private:
+    F _onExit;
+};
+
 TEST(ThreadMonitor, CantBeEnabledTwiceNested) {
     ThreadMonitor<> monitor("test", 1);
     ASSERT_TRUE(monitor.isEnabled());
@@ -92,5 +113,320 @@ TEST(ThreadMonitor, MergeCheckpoints) {
     }
 }
 
+TEST(ThreadMonitor, Payloads) {
+    static_assert(sizeof(ThreadMonitor<10>) < sizeof(ThreadMonitor<10, history_layout::WithPayload>));
+    ThreadMonitor<10, history_layout::WithPayload> monitor("test", 1);
+    std::this_thread::sleep_for(1ms);
+    threadMonitorCheckpoint(2, 0xabcdef0123456789);
+    std::this_thread::sleep_for(1ms);
+    threadMonitorCheckpoint(3);
+    auto history = monitor.getHistory();
+    ASSERT_EQ(3, history.size());
+    ASSERT_EQ(0, history[0].payload);
+    ASSERT_EQ(2, history[1].checkpointId);
+    ASSERT_EQ(0xabcdef0123456789, history[1].payload);
+    ASSERT_EQ(0, history[2].payload);
+
+    // The ring wraps around, stale payloads are overwritten.
+    for (uint64_t i = 0; i < monitor.depth(); ++i) {
+        std::this_thread::sleep_for(100us);
+        threadMonitorCheckpoint(4, i + 1);
+    }
+    history = monitor.getHistory();
+    ASSERT_EQ(monitor.depth(), history.size());
+    for (uint64_t i = 0; i < history.size(); ++i) {
+        ASSERT_EQ(i + 1, history[i].payload);
+    }
+}
+
+TEST(ThreadMonitor, CompactLayoutDropsPayload) {
+    ThreadMonitor<> monitor("test", 1);
+    std::this_thread::sleep_for(1ms);
+    threadMonitorCheckpoint(2, 42);
+    auto history = monitor.getHistory();
+    ASSERT_EQ(2, history.size());
+    ASSERT_EQ(2, history[1].checkpointId);
+    ASSERT_EQ(0, history[1].payload);
+}
+
+TEST(EncodedHistoryRing, WrapsAroundAndMergesLast) {
+    std::atomic<uint8_t> bytes[32];
+    details::EncodedHistoryRing ring(bytes, sizeof(bytes));
+    ASSERT_TRUE(ring.empty());
+    for (uint32_t i = 0; i < 100; ++i) {
+        ring.append(1000 + i % 7, std::chrono::microseconds{i * 300});
+    }
+    ring.replaceLast(5, std::chrono::microseconds{99 * 300 + 5});
+    const auto records = ring.decode();
+    ASSERT_GT(records.size(), 8);
+    ASSERT_LT(records.size(), 32);
+    for (size_t i = 0; i + 1 < records.size(); ++i) {
+        const uint32_t n = 100 - records.size() + i;
+        ASSERT_EQ(1000 + n % 7, records[i].checkpointId);
+        ASSERT_EQ(std::chrono::microseconds{n * 300}, records[i].durationFromCreation);
+    }
+    ASSERT_EQ(5, records.back().checkpointId);
+    ASSERT_EQ(std::chrono::microseconds{99 * 300 + 5}, ring.lastDuration());
+    ASSERT_EQ(ring.lastDuration(), records.back().durationFromCreation);
+    ASSERT_EQ(5, ring.last().checkpointId);
+    ASSERT_EQ(ring.lastDuration(), ring.last().durationFromCreation);
+}
+
+TEST(ThreadMonitor, DeltaEncodedKeepsMoreCheckpoints) {
+    static_assert(sizeof(ThreadMonitor<10, history_layout::DeltaEncoded>) <=
+                  sizeof(ThreadMonitor<10>) + sizeof(details::EncodedHistoryRing));
+    ThreadMonitor<10, history_layout::DeltaEncoded> monitor("test", 1);
+    for (uint32_t i = 0; i < 100; ++i) {
+        std::this_thread::sleep_for(100us);
+        threadMonitorCheckpoint(2 + i % 3, 42);
+    }
+    const auto history = monitor.getHistory();
+    ASSERT_GT(history.size(), 2 * monitor.depth());
+    for (size_t i = 1; i < history.size(); ++i) {
+        ASSERT_EQ(2 + (100 - history.size() + i) % 3, history[i].checkpointId);
+        ASSERT_LT(history[i - 1].timestamp, history[i].timestamp);
+        ASSERT_EQ(0, history[i].payload);
+    }
+    ASSERT_EQ(history.back().timestamp, monitor.lastCheckpointTime());
+}
+
+TEST(ThreadMonitor, DeltaEncodedConcurrentDecode) {
+    std::atomic<bool> done{false};
+    std::atomic<ThreadMonitor<4, history_layout::DeltaEncoded>*> monitorPtr{nullptr};
+    std::thread writer([&] {
+        ThreadMonitor<4, history_layout::DeltaEncoded> monitor("writer", 1);
+        monitorPtr = &monitor;
+        for (uint32_t i = 0; !done; ++i) {
+            // Ids and times are both increasing, any torn decode breaks this.
+            threadMonitorCheckpoint(2 + i);
+        }
+        while (monitorPtr != nullptr) {
+        }
+    });
+    ScopeExit stopWriter([&] {
+        done = true;
+        monitorPtr = nullptr;
+        writer.join();
+    });
+    while (monitorPtr == nullptr) {
+    }
+    for (int i = 0; i < 10000; ++i) {
+        const auto history = monitorPtr.load()->getHistory();
+        ASSERT_FALSE(history.empty());
+        for (size_t j = 1; j < history.size(); ++j) {
+            ASSERT_LT(history[j - 1].checkpointId, history[j].checkpointId);
+            ASSERT_LE(history[j - 1].timestamp, history[j].timestamp);
+        }
+    }
+}
+
+TEST(ThreadMonitor, ThreadArenaKeepsPreviousMonitorHistory) {
+    std::thread([] {
+        {
+            ThreadMonitor<1, history_layout::ThreadArena> monitor("first", 1);
+            std::this_thread::sleep_for(100us);
+            threadMonitorCheckpoint(2);
+        }
+        std::this_thread::sleep_for(100us);
+        ThreadMonitor<1, history_layout::ThreadArena> monitor("second", 3);
+        ASSERT_EQ(ThreadMonitorCentralRepository::instance()->threadHistoryDepth(),
+                  monitor.depth());
+        std::this_thread::sleep_for(100us);
+        threadMonitorCheckpoint(4);
+        const auto history = monitor.getHistory();
+        ASSERT_EQ(4, history.size());
+        for (uint32_t i = 0; i < history.size(); ++i) {
+            ASSERT_EQ(i + 1, history[i].checkpointId);
+        }
+        ASSERT_EQ(history.back().timestamp, monitor.lastCheckpointTime());
+    }).join();
+}
+
+TEST(ThreadMonitor, ThreadArenaSlotOutlivesThread) {
+    auto* const centralRepo = ThreadMonitorCentralRepository::instance();
+    pid_t tid = 0;
+    std::thread([&tid] {
+        tid = details::currentKernelThreadId();
+        ThreadMonitor<1, history_layout::ThreadArena> monitor("exiting", 1);
+        std::this_thread::sleep_for(100us);
+        threadMonitorCheckpoint(2);
+    }).join();
+
+    // The slot of the exited thread is free but keeps its history.
+    details::ThreadHistorySlot* exited = nullptr;
+    for (auto* slot : centralRepo->threadHistoryArena().slots()) {
+        const auto records = slot->ring.decode();
+        if (slot->tid == 0 && records.size() == 2 && records[1].checkpointId == 2) {
+            exited = slot;
+        }
+    }
+    ASSERT_NE(nullptr, exited);
+    ASSERT_EQ(2, details::decodeHistory(exited->ring, exited->epoch).size());
+
+    // A new thread with the same depth reuses a free slot.
+    const auto slotCount = centralRepo->threadHistoryArena().slots().size();
+    std::thread([] { ThreadMonitor<1, history_layout::ThreadArena> monitor("reusing", 1); })
+        .join();
+    ASSERT_EQ(slotCount, centralRepo->threadHistoryArena().slots().size());
+}
+
+TEST(ThreadMonitor, ThreadArenaNestedMonitorDoesNotLease) {
+    auto* const centralRepo = ThreadMonitorCentralRepository::instance();
+    std::thread([centralRepo] {
+        ThreadMonitor<> monitor("outer", 1);
+        ThreadMonitor<1, history_layout::ThreadArena> nested("nested", 2);
+        ASSERT_FALSE(nested.isEnabled());
+        ASSERT_TRUE(nested.getHistory().empty());
+        const pid_t tid = details::currentKernelThreadId();
+        for (const auto* slot : centralRepo->threadHistoryArena().slots()) {
+            ASSERT_NE(tid, slot->tid.load());
+        }
+    }).join();
+}
+
+TEST(ThreadMonitor, ThreadArenaDepthChange) {
+    auto* const centralRepo = ThreadMonitorCentralRepository::instance();
+    const auto defaultDepth = centralRepo->threadHistoryDepth();
+    std::thread([centralRepo, defaultDepth] {
+        {
+            ThreadMonitor<1, history_layout::ThreadArena> monitor("default", 1);
+            ASSERT_EQ(defaultDepth, monitor.depth());
+            centralRepo->setThreadHistoryDepth(defaultDepth * 2);
+            // Nested monitor does not change the slot in use.
+            ThreadMonitor<1, history_layout::ThreadArena> nested("nested", 2);
+            ASSERT_FALSE(nested.isEnabled());
+        }
+        ThreadMonitor<1, history_layout::ThreadArena> monitor("deeper", 3);
+        ASSERT_EQ(defaultDepth * 2, monitor.depth());
+        // The previous history is lost with the old slot.
+        ASSERT_EQ(1, monitor.getHistory().size());
+    }).join();
+    centralRepo->setThreadHistoryDepth(defaultDepth);
+}
+
+TEST(ThreadMonitor, ProgressCheckpointBit) {
+    static_assert(isProgressCheckpoint(progressCheckpoint(5)));
+    static_assert(!isProgressCheckpoint(5));
+    ThreadMonitor<> monitor("test", 1);
+    std::this_thread::sleep_for(1ms);
+    threadMonitorCheckpoint(progressCheckpoint(2));
+    auto history = monitor.getHistory();
+    ASSERT_EQ(2, history.size());
+    ASSERT_EQ(progressCheckpoint(2), history[1].checkpointId);
+}
+
+TEST(ThreadMonitor, FindRepeatingCycle) {
+    auto makeHistory = [](std::vector<uint32_t> ids) {
+        details::ThreadMonitorBase::History history;
+        for (auto id : ids) {
+            details::ThreadMonitorBase::HistoryRecord r{};
+            r.checkpointId = id;
+            history.push_back(r);
+        }
+        return history;
+    };
+    ASSERT_EQ(3, details::findRepeatingCycle(makeHistory({2, 3, 4, 2, 3, 4, 2})));
+    ASSERT_EQ(1, details::findRepeatingCycle(makeHistory({7, 7, 7})));
+    ASSERT_EQ(0, details::findRepeatingCycle(makeHistory({2, 3, 4, 2, 3, 5})));
+    ASSERT_EQ(0, details::findRepeatingCycle(makeHistory({2, 3, 2})));
+    ASSERT_EQ(0, details::findRepeatingCycle(
+                     makeHistory({2, progressCheckpoint(3), 2, progressCheckpoint(3)})));
+}
+
+TEST(ThreadMonitor, CheckpointDescriptors) {
+    ThreadMonitor<> monitor("test", 1);
+    std::this_thread::sleep_for(1ms);
+    for (int i = 0; i < 2; ++i) {
+        TLM_CHECKPOINT("first");
+        std::this_thread::sleep_for(1ms);
+        TLM_PROGRESS_CHECKPOINT("second");
+        std::this_thread::sleep_for(1ms);
+    }
+    auto history = monitor.getHistory();
+    ASSERT_EQ(5, history.size());
+    // Same call site produces the same id.
+    ASSERT_EQ(history[1].checkpointId, history[3].checkpointId);
+    ASSERT_EQ(history[2].checkpointId, history[4].checkpointId);
+    ASSERT_NE(history[1].checkpointId, history[2].checkpointId);
+    ASSERT_TRUE(isProgressCheckpoint(history[2].checkpointId));
+    ASSERT_FALSE(isProgressCheckpoint(history[1].checkpointId));
+
+    const auto* first = findCheckpointDescriptor(history[1].checkpointId);
+    ASSERT_NE(nullptr, first);
+    ASSERT_STREQ("first", first->label);
+    ASSERT_STREQ("TestBody", first->function);
+    ASSERT_NE(nullptr, std::strstr(first->file, "thread_monitor_test.cpp"));
+    ASSERT_EQ("second", checkpointName(history[2].checkpointId));
+
+    // User picked ids are not descriptors.
+    ASSERT_EQ(nullptr, findCheckpointDescriptor(history[0].checkpointId));
+    ASSERT_EQ("1", checkpointName(history[0].checkpointId));
+}
+
+// Scope records are never merged with the close checkpoints.
+TEST(ThreadMonitor, CheckpointScopes) {
+    ThreadMonitor<> monitor("test", 1);
+    {
+        CheckpointScope outer(5);
+        {
+            CheckpointScope inner(6);
+            threadMonitorCheckpoint(7);
+        }
+    }
+    auto history = monitor.getHistory();
+    ASSERT_EQ(6, history.size());
+    const uint32_t depth1 = 1u << kScopeDepthShift;
+    ASSERT_EQ(5 | kScopeEnterBit, history[1].checkpointId);
+    ASSERT_EQ(6 | kScopeEnterBit | depth1, history[2].checkpointId);
+    ASSERT_EQ(7, history[3].checkpointId);
+    ASSERT_EQ(6 | kScopeExitBit | depth1, history[4].checkpointId);
+    ASSERT_EQ(5 | kScopeExitBit, history[5].checkpointId);
+    ASSERT_EQ(1, scopeDepth(history[4].checkpointId));
+    ASSERT_EQ(6, scopeCheckpointId(history[4].checkpointId));
+    ASSERT_EQ("6", checkpointName(history[4].checkpointId));
+
+    std::ostringstream out;
+    details::ThreadMonitorBase::printHistory(history, out);
+    const std::string tree = out.str();
+    ASSERT_NE(std::string::npos, tree.find("Checkpoint: 5 enter"));
+    ASSERT_NE(std::string::npos, tree.find("Checkpoint:   6 enter"));
+    ASSERT_NE(std::string::npos, tree.find("Checkpoint:     7 "));
+    ASSERT_NE(std::string::npos, tree.find("Checkpoint:   6 exit"));
+    ASSERT_NE(std::string::npos, tree.find("scope: "));
+}
+
+TEST(ThreadMonitor, SaturatedScopesAreNotPaired) {
+    const uint32_t saturated = kMaxScopeDepth << kScopeDepthShift;
+    details::ThreadMonitorBase::History history;
+    const auto now = std::chrono::system_clock::now();
+    for (uint32_t id : {8 | kScopeEnterBit | saturated, 8 | kScopeEnterBit | saturated,
+                        8 | kScopeExitBit | saturated, 8 | kScopeExitBit | saturated}) {
+        details::ThreadMonitorBase::HistoryRecord h{};
+        h.checkpointId = id;
+        h.timestamp = now;
+        history.push_back(h);
+    }
+    std::ostringstream out;
+    details::ThreadMonitorBase::printHistory(history, out);
+    ASSERT_EQ(std::string::npos, out.str().find("scope: "));
+}
+
+TEST(ThreadMonitor, NamedCheckpointScope) {
+    ThreadMonitor<10, history_layout::DeltaEncoded> monitor("test", 1);
+    {
+        TLM_CHECKPOINT_SCOPE("request");
+        TLM_CHECKPOINT("inside");
+    }
+    auto history = monitor.getHistory();
+    ASSERT_EQ(4, history.size());
+    ASSERT_EQ("request", checkpointName(history[1].checkpointId));
+    ASSERT_EQ("request", checkpointName(history[3].checkpointId));
+    ASSERT_EQ(scopeCheckpointId(history[1].checkpointId),
+              scopeCheckpointId(history[3].checkpointId));
+    const auto* descriptor = findCheckpointDescriptor(history[3].checkpointId);
+    ASSERT_NE(nullptr, descriptor);
+    ASSERT_STREQ("TestBody", descriptor->function);
+}
+
 }  // namespace
 }  // namespace thread_monitor
@@ -0,0 +1,34 @@
+#include "thread_monitor/virtual_clock.h"
+
+namespace thread_monitor {
+
+#ifdef THREAD_MONITOR_VIRTUAL_CLOCK
+namespace details {
+
+VirtualClockState virtualClockState;
+
+}  // namespace details
+
+void VirtualClock::install(std::chrono::system_clock::time_point start) {
+    details::virtualClockState.now = start;
+    details::virtualClockState.installed = true;
+}
+
+void VirtualClock::uninstall() {
+    details::virtualClockState.installed = false;
+}
+
+bool VirtualClock::isInstalled() {
+    return details::virtualClockState.installed.load();
+}
+
+std::chrono::system_clock::time_point VirtualClock::now() {
+    return details::virtualClockState.now.load();
+}
+
+void VirtualClock::advance(std::chrono::system_clock::duration duration) {
+    details::virtualClockState.now = details::virtualClockState.now.load() + duration;
+}
+#endif  // THREAD_MONITOR_VIRTUAL_CLOCK
+
+}  // namespace thread_monitor
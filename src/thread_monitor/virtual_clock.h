@@ -0,0 +1,64 @@
+// Author: Andrew Shuvalov
+//
+// Documentation: https://github.com/shuvalov-mdb/thread-liveness-monitor
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+
+namespace thread_monitor {
+
+// The virtual clock is only built with `THREAD_MONITOR_VIRTUAL_CLOCK` defined:
+// always in the simulation library of the tests and the scalability benchmarks,
+// in the production library only with the CMake option of the same name or the
+// SCons `--virtual-clock`. Otherwise the checkpoints and the monitor cycles read
+// the system clock without the branch.
+
+#ifdef THREAD_MONITOR_VIRTUAL_CLOCK
+/**
+ * Process wide virtual time for the deterministic tests and simulations, see
+ * `MonitorSimulation`. While installed, the monitors stamp the checkpoints with
+ * it and the monitor cycles of all domains measure the staleness with it, the
+ * time moves only with `advance()`. Install it before creating the monitors and
+ * the domains of the test and uninstall after they are destroyed, the real and
+ * the virtual time points must not mix.
+ */
+class VirtualClock {
+public:
+    static void install(std::chrono::system_clock::time_point start);
+    static void uninstall();
+    static bool isInstalled();
+
+    static std::chrono::system_clock::time_point now();
+    static void advance(std::chrono::system_clock::duration duration);
+};
+#endif  // THREAD_MONITOR_VIRTUAL_CLOCK
+
+namespace details {
+
+#ifdef THREAD_MONITOR_VIRTUAL_CLOCK
+struct alignas(64) VirtualClockState {
+    std::atomic<bool> installed{false};
+    std::atomic<std::chrono::system_clock::time_point> now;
+};
+
+extern VirtualClockState virtualClockState;
+#endif  // THREAD_MONITOR_VIRTUAL_CLOCK
+
+/**
+ * Time of the checkpoints and of the repository clock policies: the system clock,
+ * or the virtual clock when it is built and installed, at the cost of one
+ * predictable branch.
+ */
+inline std::chrono::system_clock::time_point clockNow() {
+#ifdef THREAD_MONITOR_VIRTUAL_CLOCK
+    if (virtualClockState.installed.load(std::memory_order_relaxed)) {
+        return virtualClockState.now.load(std::memory_order_relaxed);
+    }
+#endif
+    return std::chrono::system_clock::now();
+}
+
+}  // namespace details
+}  // namespace thread_monitor
@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+# Author: Andrew Shuvalov
+#
+# Documentation: https://github.com/shuvalov-mdb/thread-liveness-monitor
+
+"""Compares two Google Benchmark JSON outputs, written with
+`--benchmark_out=<file> --benchmark_out_format=json`, and exits with 1 if any
+time or latency percentile regressed more than the threshold.
+
+    compare_benchmarks.py baseline.json current.json [--threshold 0.1]
+"""
+
+import argparse
+import json
+import sys
+
+# Compared besides the real time, lower is better for all of them.
+LATENCY_SUFFIXES = ('p50_ns', 'p99_ns', 'p999_ns')
+
+
+def load(path):
+    with open(path) as f:
+        results = json.load(f)['benchmarks']
+    # Aggregates are only present with repetitions, compare the mean then.
+    benchmarks = {}
+    for b in results:
+        if b.get('run_type') == 'aggregate' and b.get('aggregate_name') != 'mean':
+            continue
+        benchmarks[b.get('run_name', b['name'])] = b
+    return benchmarks
+
+
+def metrics(benchmark):
+    values = {'real_time': benchmark['real_time']}
+    for key, value in benchmark.items():
+        if key.endswith(LATENCY_SUFFIXES):
+            values[key] = value
+    return values
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('baseline')
+    parser.add_argument('current')
+    parser.add_argument('--threshold', type=float, default=0.1,
+                        help='relative increase reported as a regression')
+    args = parser.parse_args()
+
+    baseline = load(args.baseline)
+    current = load(args.current)
+    regressions = 0
+    print('%-70s %-18s %12s %12s %8s' % ('Benchmark', 'Metric', 'Baseline', 'Current', 'Change'))
+    for name, benchmark in current.items():
+        if name not in baseline:
+            print('%-70s new' % name)
+            continue
+        base = metrics(baseline[name])
+        for metric, value in metrics(benchmark).items():
+            if metric not in base:
+                continue
+            change = (value - base[metric]) / base[metric] if base[metric] else 0.0
+            mark = ''
+            if change > args.threshold:
+                mark = ' REGRESSION'
+                regressions += 1
+            print('%-70s %-18s %12.1f %12.1f %+7.1f%%%s' %
+                  (name, metric, base[metric], value, change * 100, mark))
+    for name in baseline:
+        if name not in current:
+            print('%-70s missing' % name)
+    if regressions:
+        print('%d metrics regressed more than %.0f%%' % (regressions, args.threshold * 100))
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())